@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# overhead.sh
+#
+# Benchmark of pg_query_rewrite per-statement overhead: runs pgbench
+# against a temporary instance, first without the extension, then with
+# the library loaded and an increasing number of rules, for statements
+# matching a rule (hit.sql) and not matching any rule (miss.sql), and
+# reports latency difference with the instance without extension.
+#
+# Rule counts are numbers of rules not matching the benchmark statements;
+# hit traffic adds the rule rewriting hit.sql statement.
+# initdb, pg_ctl, psql and pgbench must be in PATH ("make bench" uses
+# the binaries of pg_config).
+#
+# Usage: bench/overhead.sh [rule count ...]
+#
+# Environment: CLIENTS (default "1 4"), DURATION in seconds (default 10),
+# PGPORT of temporary instance (default 5455).
+#
+
+BENCH_DIR=`cd \`dirname $0\` && pwd`
+CLIENTS=${CLIENTS:-"1 4"}
+DURATION=${DURATION:-10}
+RULES=${*:-"0 10 1000 10000"}
+PGPORT=${PGPORT:-5455}
+
+DATA=`mktemp -d ${TMPDIR:-/tmp}/pgqr_bench.XXXXXX` || exit 1
+trap 'pg_ctl -D $DATA/data -m immediate stop > /dev/null 2>&1; rm -rf $DATA' 0 1 2 15
+
+# temporary instance only listens on a socket in its directory
+PGHOST=$DATA
+PGDATABASE=postgres
+export PGPORT PGHOST PGDATABASE
+
+MAX_RULES=1
+for n in $RULES
+do
+	[ $n -ge $MAX_RULES ] && MAX_RULES=`expr $n + 1`
+done
+
+initdb -D $DATA/data -A trust > $DATA/initdb.log 2>&1 || { cat $DATA/initdb.log; exit 1; }
+
+start()
+{
+	pg_ctl -D $DATA/data -l $DATA/server.log -w \
+		-o "-p $PGPORT -k $PGHOST -c listen_addresses='' $1" start > /dev/null || exit 1
+}
+
+stop()
+{
+	pg_ctl -D $DATA/data -w stop > /dev/null || exit 1
+}
+
+# prints latency in ms of pgbench script $1 with $2 clients
+latency()
+{
+	pgbench -n -M simple -c $2 -j $2 -T $DURATION -f $BENCH_DIR/$1.sql 2>/dev/null |
+	awk '/^latency average/ { lat = $4 } END { print lat }'
+}
+
+# replaces rules by $1 rules not matching benchmark statements,
+# plus rule rewriting hit.sql statement if $2 is hit
+set_rules()
+{
+	psql -X -q -t > /dev/null <<SQL || exit 1
+select pgqr_add_rules(coalesce(array_agg(array[source, target]), '{}'::text[][]), true)
+from (select 'select ' || (100000 + i) || ';' as source, 'select ' || -i || ';' as target
+      from generate_series(1, $1) i
+      union all
+      select 'select 10;', 'select 11;' where '$2' = 'hit') r;
+SQL
+}
+
+start ""
+for traffic in hit miss
+do
+	for c in $CLIENTS
+	do
+		echo "$traffic $c `latency $traffic $c`" >> $DATA/baseline
+	done
+done
+stop
+
+start "-c shared_preload_libraries=pg_query_rewrite -c pg_query_rewrite.max_rules=$MAX_RULES -c pg_query_rewrite.save=off"
+psql -X -q -c "create extension pg_query_rewrite;" || exit 1
+
+echo "rules	traffic	clients	latency_ms	baseline_ms	overhead_us"
+for n in $RULES
+do
+	for traffic in hit miss
+	do
+		set_rules $n $traffic
+		for c in $CLIENTS
+		do
+			lat=`latency $traffic $c`
+			awk -v n=$n -v t=$traffic -v c=$c -v lat=$lat '
+				$1 == t && $2 == c {
+					printf("%s\t%s\t%s\t%s\t%s\t%.1f\n", n, t, c, lat, $3, (lat - $3) * 1000)
+				}' $DATA/baseline
+		done
+	done
+done
+stop
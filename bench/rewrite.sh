@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# rewrite.sh
+#
+# Benchmark of pg_query_rewrite rewritten statements scalability:
+# compares pgbench TPS of a rewritten statement with TPS of the same
+# statement without rule for an increasing number of clients.
+#
+# Requires a running instance with shared_preload_libraries = 'pg_query_rewrite'.
+# Connection is set with usual libpq environment variables (PGHOST, PGPORT, ...).
+#
+# Usage: bench/rewrite.sh [client count ...]
+#
+# Environment: DURATION in seconds (default 10).
+#
+
+BENCH_DIR=`dirname $0`
+DURATION=${DURATION:-10}
+CLIENTS=${*:-"1 2 4 8 16 32"}
+
+pgbench_tps()
+{
+	pgbench -n -M simple -c $1 -j $1 -T $DURATION -f $BENCH_DIR/hit.sql 2>/dev/null |
+	awk '/^tps/ { tps = $3 } END { print tps }'
+}
+
+psql -X -q -c "create extension if not exists pg_query_rewrite;" || exit 1
+
+echo "clients	tps_no_rule	tps_rewritten"
+for c in $CLIENTS
+do
+	psql -X -q -t -c "select pgqr_truncate();" > /dev/null || exit 1
+	no_rule=`pgbench_tps $c`
+	psql -X -q -t -c "select pgqr_add_rule('select 10;', 'select 11;');" > /dev/null || exit 1
+	rewritten=`pgbench_tps $c`
+	echo "$c	$no_rule	$rewritten"
+done
+
+psql -X -q -t -c "select pgqr_truncate();" > /dev/null
@@ -0,0 +1,123 @@
+drop function if exists pgqr_add_rule();
+drop function if exists pgqr_rules();
+--
+CREATE FUNCTION pgqr_add_rule(cstring, cstring) RETURNS BOOLEAN 
+ AS 'pg_query_rewrite.so', 'pgqr_add_rule'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_add_rule(cstring, cstring, cstring) RETURNS BOOLEAN 
+ AS 'pg_query_rewrite.so', 'pgqr_add_rule'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_add_rules(text[], boolean DEFAULT false) RETURNS integer
+ AS 'pg_query_rewrite.so', 'pgqr_add_rules'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_rules(
+    OUT id integer,
+    OUT dbid oid,
+    OUT source text,
+    OUT target text,
+    OUT match text,
+    OUT rewrite text,
+    OUT nested boolean,
+    OUT commands text,
+    OUT rewrite_count bigint,
+    OUT created timestamp with time zone,
+    OUT last_rewrite timestamp with time zone,
+    OUT summary regclass,
+    OUT max_age interval,
+    OUT refreshed timestamp with time zone,
+    OUT result_cache boolean,
+    OUT role regrole,
+    OUT application_name text,
+    OUT schema regnamespace,
+    OUT sample double precision)
+ RETURNS SETOF record
+ AS 'pg_query_rewrite.so', 'pgqr_rules'
+ LANGUAGE C STRICT;
+--
+CREATE VIEW pgqr_rules AS
+  SELECT r.id, r.dbid, d.datname, r.source, r.target, r.match, r.rewrite,
+         r.nested, r.commands, r.rewrite_count, r.created, r.last_rewrite,
+         r.summary, r.max_age, r.refreshed, r.result_cache,
+         r.role, r.application_name, r.schema, r.sample
+    FROM pgqr_rules() r LEFT JOIN pg_database d ON d.oid = r.dbid;
+--
+CREATE FUNCTION pgqr_remove_rule(cstring) RETURNS BOOLEAN 
+ AS 'pg_query_rewrite.so', 'pgqr_remove_rule'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_truncate() RETURNS BOOLEAN
+ AS 'pg_query_rewrite.so', 'pgqr_truncate'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_refreshed(regclass) RETURNS BOOLEAN
+ AS 'pg_query_rewrite.so', 'pgqr_refreshed'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_test() RETURNS BOOLEAN
+ AS 'pg_query_rewrite.so', 'pgqr_test'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_stats(
+    OUT lookups bigint,
+    OUT rewrites bigint,
+    OUT cache_hits bigint,
+    OUT lookup_time double precision,
+    OUT analyze_time double precision,
+    OUT stats_reset timestamp with time zone,
+    OUT result_hits bigint,
+    OUT result_stores bigint)
+ RETURNS record
+ AS 'pg_query_rewrite.so', 'pgqr_stats'
+ LANGUAGE C STRICT;
+--
+CREATE VIEW pgqr_stats AS SELECT * FROM pgqr_stats();
+--
+CREATE FUNCTION pgqr_rule_stats(
+    OUT dbid oid,
+    OUT source text,
+    OUT rewrites bigint,
+    OUT cache_hits bigint,
+    OUT analyze_time double precision,
+    OUT result_hits bigint)
+ RETURNS SETOF record
+ AS 'pg_query_rewrite.so', 'pgqr_rule_stats'
+ LANGUAGE C STRICT;
+--
+CREATE VIEW pgqr_rule_stats AS SELECT * FROM pgqr_rule_stats();
+--
+CREATE FUNCTION pgqr_sample_stats(
+    OUT dbid oid,
+    OUT source text,
+    OUT sample double precision,
+    OUT variant text,
+    OUT calls bigint,
+    OUT total_time double precision,
+    OUT mean_time double precision,
+    OUT p50_time double precision,
+    OUT p99_time double precision)
+ RETURNS SETOF record
+ AS 'pg_query_rewrite.so', 'pgqr_sample_stats'
+ LANGUAGE C STRICT;
+--
+CREATE VIEW pgqr_sample_stats AS SELECT * FROM pgqr_sample_stats();
+--
+CREATE FUNCTION pgqr_stats_reset() RETURNS void
+ AS 'pg_query_rewrite.so', 'pgqr_stats_reset'
+ LANGUAGE C STRICT;
+--
+CREATE FUNCTION pgqr_result_cache_reset() RETURNS void
+ AS 'pg_query_rewrite.so', 'pgqr_result_cache_reset'
+ LANGUAGE C STRICT;
+--
+-- rules, statistics and cached results are shared by all sessions:
+-- only superusers and roles granted EXECUTE can change them
+REVOKE EXECUTE ON FUNCTION pgqr_add_rule(cstring, cstring) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_add_rule(cstring, cstring, cstring) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_add_rules(text[], boolean) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_remove_rule(cstring) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_truncate() FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_stats_reset() FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pgqr_result_cache_reset() FROM PUBLIC;
@@ -12,29 +12,31 @@
  *-------------------------------------------------------------------------
  */
 #include "postgres.h"
+#if PG_VERSION_NUM < 100000
+#error "pg_query_rewrite requires PostgreSQL 10 or later (dynamic shared memory areas)"
+#endif
 #include "executor/executor.h"
 #include "executor/spi.h"
 #include "storage/proc.h"
 #include "storage/procarray.h"
 #include "access/xact.h"
+#include "access/transam.h"
 #include "parser/parse_node.h"
 #include "parser/analyze.h"
 #include "parser/parser.h"
+#include "parser/parse_param.h"
 #include "tcop/tcopprot.h"
 #include "tcop/utility.h"
 #include "utils/guc.h"
 #include "utils/snapmgr.h"
 #include "utils/memutils.h"
-#if PG_VERSION_NUM <= 90600
-#include "storage/lwlock.h"
-#endif
 #include "pgstat.h"
 #include "storage/ipc.h"
 #include "storage/spin.h"
+#include "port/atomics.h"
+#include "utils/dsa.h"
 #include "miscadmin.h"
-#if PG_VERSION_NUM >= 90600
 #include "nodes/extensible.h"
-#endif
 #if PG_VERSION_NUM > 120000
 #include "nodes/pathnodes.h"
 #endif
@@ -45,20 +47,312 @@
 #include "funcapi.h"
 #include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
+#include "catalog/namespace.h"
+#include "nodes/nodeFuncs.h"
+#include "parser/parsetree.h"
+#include "storage/lmgr.h"
+#include "utils/inval.h"
+#include "storage/sinval.h"
+#include "utils/syscache.h"
+#include "utils/array.h"
+#include "storage/fd.h"
+#include "portability/instr_time.h"
+#include "utils/timestamp.h"
+#include "regex/regex.h"
+#include "mb/pg_wchar.h"
+#include "catalog/pg_collation.h"
+#include "catalog/pg_class.h"
+#if PG_VERSION_NUM >= 110000
+#include "catalog/objectaddress.h"
+#endif
+#include "catalog/pg_proc.h"
+#include "nodes/makefuncs.h"
+#include "utils/lsyscache.h"
+#include "utils/acl.h"
+#include "utils/rel.h"
+#include "parser/parse_relation.h"
+#include "rewrite/rewriteHandler.h"
+#include "optimizer/planner.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/clauses.h"
+#endif
+#include "access/parallel.h"
+#include "access/xlog.h"
+#include "replication/worker_internal.h"
+#include "access/htup_details.h"
+#include "catalog/partition.h"
+#if PG_VERSION_NUM >= 110000
+#include "utils/regproc.h"
+#endif
+#if PG_VERSION_NUM >= 160000
+#include "nodes/queryjumble.h"
+#elif PG_VERSION_NUM >= 140000
+#include "utils/queryjumble.h"
+#endif
+#if PG_VERSION_NUM >= 140000
+#include "parser/scanner.h"
+#endif
+#include "parser/scansup.h"
+#include <ctype.h>
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#elif PG_VERSION_NUM >= 120000
+#include "utils/hashutils.h"
+#else
+#include "access/hash.h"
+#endif
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 
 PG_MODULE_MAGIC;
 
+/*
+ * default maximum statement length:
+ * can be raised with pg_query_rewrite.max_stmt_length
+ * since statements are stored in a dynamic shared memory area
+ */
 #define	PGQR_MAX_STMT_LENGTH		32768	
 
-static uint64_t pgqr_max_stmt_length = PGQR_MAX_STMT_LENGTH;
+static int pgqrMaxStmtLength = PGQR_MAX_STMT_LENGTH;
+
+/*
+ * end of hash chain marker
+ */
+#define	PGQR_NO_RULE			(-1)
+
+/*
+ * rules are stored in chunks allocated on demand
+ * in dynamic shared memory area: a chunk is never
+ * moved nor released so that rule counters can be
+ * updated without lock.
+ */
+#define	PGQR_CHUNK_RULES		1024
+#define	PGQR_MAX_CHUNKS			256
+#define	PGQR_MAX_RULES			(PGQR_CHUNK_RULES * PGQR_MAX_CHUNKS)
+
+/*
+ * minimum number of hash buckets
+ */
+#define	PGQR_MIN_BUCKETS		64
+
+/*
+ * number of database stripes (power of 2)
+ */
+#define	PGQR_DB_STRIPES			64
+
+/*
+ * result cache: number of hash buckets, number of bits of
+ * the bitmap of relations read by cached results and number of
+ * relations written by a transaction beyond which all results
+ * of its database are purged at commit.
+ */
+#define	PGQR_RESULT_BUCKETS		1024
+#define	PGQR_RESULT_REL_BITS		1024
+#define	PGQR_RESULT_MAX_WRITTEN		64
+#define	PGQR_RESULT_WRITERS		256
+
+/*
+ * a query rewritten by analysis hook with a result cache rule, a
+ * query matching a rule with sample option or a settings rule, and
+ * a query reading the summary of rules with a freshness bound, is
+ * marked for the planner hook with a WithCheckOption node whose
+ * policy name is PGQR_QUERY_MARK and whose relation name holds mark
+ * kind, rule slot, creation time and sample variant: the mark survives
+ * copies of the query by the plan cache, which analyzes the statement
+ * again when its plans are invalidated. Planner hook removes marks
+ * before planning the query and marks its plan instead.
+ */
+#define	PGQR_QUERY_MARK			"pg_query_rewrite"
+#define	PGQR_MARK_RESULT		0
+#define	PGQR_MARK_SAMPLE		1
+#define	PGQR_MARK_SETTINGS		2
+#define	PGQR_MARK_SUMMARY		3
+#define	PGQR_MARKS			4
+
+/*
+ * plans of result cache rules are marked with two plan
+ * invalidation items of these cache identifiers (which match
+ * no system cache): rule slot and rule creation time.
+ */
+#define	PGQR_RESULT_MARK_SLOT		(-0x5051)
+#define	PGQR_RESULT_MARK_CREATED	(-0x5052)
+
+/*
+ * plans of statements matching a settings rule are
+ * marked the same way with the settings rule
+ */
+#define	PGQR_SETTINGS_MARK_SLOT		(-0x5053)
+#define	PGQR_SETTINGS_MARK_CREATED	(-0x5054)
+
+/*
+ * plans of statements matching a rule with sample
+ * option are marked with the rule and the variant
+ */
+#define	PGQR_SAMPLE_MARK_SLOT		(-0x5055)
+#define	PGQR_SAMPLE_MARK_CREATED	(-0x5056)
+#define	PGQR_SAMPLE_MARK_VARIANT	(-0x5057)
+
+/*
+ * plans of statements reading the summary of rules with a
+ * freshness bound are marked with each rule
+ */
+#define	PGQR_SUMMARY_MARK_SLOT		(-0x5058)
+#define	PGQR_SUMMARY_MARK_CREATED	(-0x5059)
+
+/*
+ * a query marked with a sample rule is analyzed again before each
+ * execution of its cached plan, to draw the variant of the execution,
+ * and a query marked with a summary rule once the freshness bound
+ * of the rule has passed: its mark holds a regclass constant of this
+ * relation identifier, which matches no relation and which the plan
+ * cache records as a dependency of the statement. Executor start
+ * then processes a local relation cache invalidation of the identifier.
+ */
+#define	PGQR_MARK_RELID(kind, slot)	((Oid) (0xF0000000U | ((uint32) (kind) << 24) | (uint32) (slot)))
+
+/*
+ * variants of statements matching a rule with sample option:
+ * executions sampled out run source statement. Latency of each
+ * variant is counted in PGQR_SAMPLE_BUCKETS buckets: bucket 0 counts
+ * executions shorter than 1 microsecond, bucket n executions from
+ * 2^(n-1) to 2^n microseconds and last bucket all longer executions.
+ */
+#define	PGQR_VARIANT_ORIGINAL		0
+#define	PGQR_VARIANT_REWRITTEN		1
+#define	PGQR_VARIANTS			2
+#define	PGQR_SAMPLE_BUCKETS		32
+
+/*
+ * rule matching modes:
+ * - text: statement text is equal to source statement
+ * - queryid: statement query identifier (as computed by
+ *   post-analysis query jumbling) is equal to source statement
+ *   query identifier.
+ * - normalized: as queryid, and constants of statement are
+ *   substituted to $n placeholders of target statement numbered
+ *   as in pg_stat_statements normalized query text.
+ * - regex: statement text matches source statement as an advanced
+ *   regular expression anchored at both ends: \1 to \9 in target
+ *   statement are replaced by text captured by source statement groups.
+ * - like: as regex, source statement is a LIKE pattern whose 
+ *   % and _ wildcards are captured.
+ */
+#define	PGQR_MATCH_TEXT			0
+#define	PGQR_MATCH_QUERYID		1
+#define	PGQR_MATCH_NORMALIZED		2
+#define	PGQR_MATCH_REGEX		3
+#define	PGQR_MATCH_LIKE			4
+
+#define	PGQR_MATCH_BY_QUERYID(match)	((match) == PGQR_MATCH_QUERYID || (match) == PGQR_MATCH_NORMALIZED)
+#define	PGQR_MATCH_BY_PATTERN(match)	((match) == PGQR_MATCH_REGEX || (match) == PGQR_MATCH_LIKE)
+
+/*
+ * rule rewrite modes:
+ * - statement: matching statement is replaced by target statement.
+ * - relation: source and target are relations with the same columns:
+ *   source relation is replaced by target relation in SELECT queries
+ *   of all statements.
+ * - function: source and target are functions with the same argument
+ *   and result types: calls of source function are replaced by calls
+ *   of target function in all statements.
+ * - limit: source is a relation and target a row count: LIMIT is 
+ *   added to SELECT statements reading source relation without LIMIT.
+ * - settings: matching statement is not changed: target is a list of
+ *   configuration parameters set while statement is planned and run.
+ * Relation, function and limit rules transform the analyzed query tree
+ * of statements and are looked up by source object identifier.
+ * Settings rules are looked up as statement rules.
+ */
+#define	PGQR_REWRITE_STATEMENT		0
+#define	PGQR_REWRITE_RELATION		1
+#define	PGQR_REWRITE_FUNCTION		2
+#define	PGQR_REWRITE_LIMIT		3
+#define	PGQR_REWRITE_SETTINGS		4
+
+#define	PGQR_REWRITE_BY_OBJECT(rewrite)	((rewrite) == PGQR_REWRITE_RELATION || \
+					 (rewrite) == PGQR_REWRITE_FUNCTION || \
+					 (rewrite) == PGQR_REWRITE_LIMIT)
+
+/*
+ * rule options given as key=value pairs
+ * in pgqr_add_rule third argument
+ */
+typedef struct pgqrRuleOptions
+{
+	int	match;		/* PGQR_MATCH_xxx */
+	int	rewrite;	/* PGQR_REWRITE_xxx */
+	bool	nested;		/* also rewrite statements run by functions and procedures */
+	uint32	commands;	/* PGQR_COMMAND() mask of rewritten command types */
+	char	*summary;	/* summary relation name of statement rule, NULL if none */
+	int64	max_age;	/* freshness bound of summary in microseconds, -1 if none */
+	bool	result_cache;	/* cache results of rewritten SELECT statements */
+	double	sample;		/* fraction of rewritten executions, -1 if not sampled */
+	/* scope of rule: NULL if rule applies to all sessions */
+	char	*role;
+	char	*application_name;
+	char	*schema;
+} pgqrRuleOptions;
+
+#define	PGQR_COMMAND(cmd)	(((uint32) 1) << (cmd))
+#define	PGQR_ALL_COMMANDS	((uint32) 0xFFFFFFFF)
+
+/*
+ * rule validated before taking pgqr->lock
+ */
+typedef struct pgqrNewRule
+{
+	char		*source;
+	char		*target;
+	Size		source_len;
+	Size		target_len;
+	uint32		source_hash;
+	uint64		queryid;
+	int		nsub;
+	Oid		source_oid;
+	Oid		target_oid;
+	Oid		summary_oid;
+	Oid		role_oid;
+	Oid		schema_oid;
+	pgqrRuleOptions	opts;
+} pgqrNewRule;
 
-#define	PGQR_MAX_STMT_BUF_LENGTH	(PGQR_MAX_STMT_LENGTH + 10)
+/*
+ * scope of a rule: rules are unique by database,
+ * source statement and scope
+ */
+typedef struct pgqrScope
+{
+	Oid		role_oid;
+	const char	*application_name;	/* "" if none */
+	Oid		schema_oid;
+} pgqrScope;
 
 /*
  * maximum number of rules processed
- * by the extension defined as GUC
+ * by the extension defined as GUC:
+ * soft limit which can be changed by reload
+ */
+static int pgqrMaxRules = 10;
+
+/*
+ * save rules to dump file and load them at startup
+ */
+static bool pgqrSave = true;
+
+/*
+ * measure rule lookup and target analysis time
  */
-static int pgqrMaxRules = 0;
+static bool pgqrTrackTiming = false;
+
+/*
+ * result cache size in kB: results of rules with result_cache
+ * option are kept in rules dynamic shared memory area up to
+ * this size, least recently used results are evicted first.
+ */
+static int pgqrResultCacheSize = 8192;
 
 /*
  * for pg_stat_statements assertion 
@@ -68,6 +362,19 @@ static	bool	statement_rewritten = false;
 static	ParseState 	*new_static_pstate = NULL;
 static 	Query		*new_static_query = NULL;  
 
+/*
+ * nesting level of statements run by functions and procedures:
+ * top-level statements are analyzed at level 0
+ */
+static	int	pgqr_nesting_level = 0;
+
+/*
+ * nesting level of statements analyzed by a utility statement
+ * storing them (CREATE VIEW, CREATE RULE ...), -1 if none:
+ * stored statements are neither rewritten nor transformed.
+ */
+static	int	pgqr_definition_level = -1;
+
 /* Saved hook values in case of unload */
 #if PG_VERSION_NUM >= 150000
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
@@ -75,6 +382,11 @@ static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static ExecutorStart_hook_type prev_executor_start_hook = NULL;
+static ExecutorRun_hook_type prev_executor_run_hook = NULL;
+static ExecutorFinish_hook_type prev_executor_finish_hook = NULL;
+static ProcessUtility_hook_type prev_process_utility_hook = NULL;
+static ExecutorEnd_hook_type prev_executor_end_hook = NULL;
+static planner_hook_type prev_planner_hook = NULL;
 
 
 /*
@@ -85,21 +397,371 @@ static ExecutorStart_hook_type prev_executor_start_hook = NULL;
 typedef struct pgqrSharedItem
 {
 	Oid	dbid;
-	char	source_stmt[PGQR_MAX_STMT_BUF_LENGTH];
-	char	target_stmt[PGQR_MAX_STMT_BUF_LENGTH];
-	int	rewrite_count;
+	uint32	source_hash;	/* hash of source_stmt */
+	int	next;		/* next rule in same hash bucket */
+	int	match;	/* PGQR_MATCH_xxx */
+	bool	nested;
+	uint32	commands;
+	uint64	queryid;	/* source query identifier if match = queryid */
+	int	nsub;		/* capturing groups of source pattern if match = regex or like */
+	int	rewrite;	/* PGQR_REWRITE_xxx */
+	Oid	source_oid;	/* source object if rewrite is not statement */
+	Oid	target_oid;	/* target object if rewrite = relation or function */
+	Oid	summary_oid;	/* summary relation read by target, InvalidOid if none */
+	int64	max_age;	/* rule only applies if summary is fresher, -1 if no bound */
+	bool	result_cache;	/* results of target statement are cached */
+	double	sample;		/* fraction of rewritten executions, -1 if not sampled */
+	/* scope of rule: InvalidOid or empty string if none */
+	Oid	role_oid;
+	Oid	schema_oid;
+	char	application_name[NAMEDATALEN];
+	/* statements are null-terminated strings allocated in pgqr_area */
+	Size	source_len;
+	dsa_pointer source_stmt;
+	Size	target_len;
+	dsa_pointer target_stmt;
+	TimestampTz created;
+	pg_atomic_uint64 refreshed;	/* TimestampTz of last summary refresh, 0 if unknown */
+	/* statistics updated without lock */
+	pg_atomic_uint64 rewrite_count;
+	pg_atomic_uint64 last_rewrite;	/* TimestampTz, 0 if never used */
+	pg_atomic_uint64 cache_hits;	/* rewrites using cached analyzed target */
+	pg_atomic_uint64 analyze_time;	/* target analysis time in nanoseconds */
+	pg_atomic_uint64 result_hits;	/* executions served from result cache */
+	/* latency of top-level executions of sampled rule by variant */
+	pg_atomic_uint64 sample_time[PGQR_VARIANTS];	/* in nanoseconds */
+	pg_atomic_uint64 sample_histogram[PGQR_VARIANTS][PGQR_SAMPLE_BUCKETS];
 } pgqrSharedItem;
 
 typedef struct pgqrSharedState
 {
 	LWLock 		*lock;
-	int		current_rule_number;
-	pgqrSharedItem	*rules;
+	/*
+	 * databases are spread over PGQR_DB_STRIPES stripes.
+	 * Stripe generation is bumped by each rule change of its 
+	 * databases while holding lock in exclusive mode: backends 
+	 * rebuild their local copy of rules only when it changes.
+	 * Stripe rule count lets backends of databases without rules
+	 * skip rule lookup with a single read.
+	 */
+	pg_atomic_uint32 generation[PGQR_DB_STRIPES];
+	pg_atomic_uint32 rule_count[PGQR_DB_STRIPES];
+	int		current_rule_number;	/* number of rules */
+	/*
+	 * rules array slots in use: removed rules leave free slots
+	 * chained by pgqrSharedItem.next from free_slot and 
+	 * reused by next rule creations.
+	 */
+	int		nslots;
+	int		free_slot;
+	/*
+	 * rules dump file is loaded by first backend
+	 * using rules: dynamic shared memory area cannot
+	 * be created by postmaster.
+	 */
+	bool		loaded;
+	/*
+	 * rule changes are counted while holding lock in exclusive
+	 * mode: dump file is written by end of transactions having
+	 * changed rules, unless saved_changes shows that a later
+	 * write already includes them. save_lock serializes dump
+	 * file writers and protects saved_changes.
+	 */
+	LWLock		*save_lock;
+	uint64		changes;
+	uint64		saved_changes;
+	/*
+	 * dynamic shared memory area storing rules and statements:
+	 * created by first rule creation
+	 */
+	int		tranche_id;
+	dsa_handle	area_handle;
+	/*
+	 * rules array: rule i is in chunk i / PGQR_CHUNK_RULES
+	 */
+	int		nchunks;
+	dsa_pointer	chunks[PGQR_MAX_CHUNKS];
+	/*
+	 * hash index on (dbid, source_stmt):
+	 * int array of nbuckets elements, each bucket is 
+	 * the head of a chain of rules linked by pgqrSharedItem.next.
+	 * Only used while holding lock: reallocated when rules grow.
+	 */
+	int		nbuckets;
+	dsa_pointer	buckets;
+	/*
+	 * statistics of statements looked up in databases having rules:
+	 * backends add their local counters in batches (see pgqrStats).
+	 * Times are in nanoseconds. stats_reset is protected by lock.
+	 */
+	pg_atomic_uint64 stat_lookups;
+	pg_atomic_uint64 stat_rewrites;
+	pg_atomic_uint64 stat_cache_hits;
+	pg_atomic_uint64 stat_lookup_time;
+	pg_atomic_uint64 stat_analyze_time;
+	TimestampTz	stats_reset;
+	/*
+	 * result cache: entries (see pgqrResultEntry) are allocated in
+	 * rules area, hashed in result_buckets and chained in LRU order.
+	 * They are only accessed while holding result_lock.
+	 * result_epoch is bumped after commit of each transaction having
+	 * written data, whose transaction identifier is kept in ring
+	 * result_writers indexed by epoch (result_evicted is the newest
+	 * identifier overwritten in the ring): a result is only stored if
+	 * epoch has not changed since executor start of its statement and
+	 * if the writers of previous epochs are visible to the statement
+	 * snapshot. Both are protected by result_mutex. result_relations is a
+	 * bitmap of hashed relations read by cached results, set before
+	 * epoch is checked so that writers skip the purge of results 
+	 * which cannot depend on their relations.
+	 */
+	LWLock		*result_lock;
+	pg_atomic_uint32 result_rules;	/* number of rules with result_cache option */
+	pg_atomic_uint64 result_epoch;
+	slock_t		result_mutex;
+	TransactionId	result_writers[PGQR_RESULT_WRITERS];
+	TransactionId	result_evicted;
+	pg_atomic_uint32 result_relations[PGQR_RESULT_REL_BITS / 32];
+	dsa_pointer	result_buckets;
+	dsa_pointer	result_lru_head;	/* most recently used */
+	dsa_pointer	result_lru_tail;	/* least recently used */
+	Size		result_used;		/* bytes used by entries */
+	int64		result_entries;
+	pg_atomic_uint64 stat_result_hits;
+	pg_atomic_uint64 stat_result_stores;
 
 } pgqrSharedState;
 
+/*
+ * rules dump file: all rules are written at end of transactions
+ * changing rules and loaded after server start if pg_query_rewrite.save
+ * is set.
+ * Each rule is written as a pgqrDumpItem followed by null-terminated
+ * source and target statements.
+ */
+#define	PGQR_DUMP_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/pg_query_rewrite.stat"
+#define	PGQR_FILE_HEADER	0x20261024
+#define	PGQR_PG_MAJOR_VERSION	(PG_VERSION_NUM / 100)
+
+typedef struct pgqrDumpItem
+{
+	Oid	dbid;
+	int32	match;
+	bool	nested;
+	uint32	commands;
+	uint64	queryid;
+	int32	nsub;
+	int32	rewrite;
+	Oid	source_oid;
+	Oid	target_oid;
+	Oid	summary_oid;
+	int64	max_age;
+	bool	result_cache;
+	double	sample;
+	Oid	role_oid;
+	Oid	schema_oid;
+	char	application_name[NAMEDATALEN];
+	TimestampTz created;
+	uint32	source_len;
+	uint32	target_len;
+} pgqrDumpItem;
+
 /* Links to shared memory state */
 static pgqrSharedState *pgqr= NULL;
+static dsa_area *pgqr_area = NULL;
+
+/* current transaction has changed rules: dump file is written at its end */
+static bool pgqr_save_pending = false;
+
+#define	PGQR_STMT(dp)	((char *) dsa_get_address(pgqr_area, (dp)))
+
+/*
+ * address of rule i in rules chunks
+ */
+static inline pgqrSharedItem *
+pgqr_rule(int i)
+{
+	pgqrSharedItem	*chunk;
+
+	chunk = (pgqrSharedItem *) dsa_get_address(pgqr_area, pgqr->chunks[i / PGQR_CHUNK_RULES]);
+	return &chunk[i % PGQR_CHUNK_RULES];
+}
+
+#define	PGQR_BUCKETS()	((int *) dsa_get_address(pgqr_area, pgqr->buckets))
+
+/*
+ * free slots have no database
+ */
+#define	PGQR_SLOT_USED(rule)	((rule)->dbid != InvalidOid)
+
+#if PG_VERSION_NUM >= 160000
+typedef SearchPathMatcher pgqrSearchPath;
+#define	pgqr_get_search_path(cxt)	GetSearchPathMatcher(cxt)
+#define	pgqr_search_path_matches(sp)	SearchPathMatchesCurrentEnvironment(sp)
+#else
+typedef OverrideSearchPath pgqrSearchPath;
+#define	pgqr_get_search_path(cxt)	GetOverrideSearchPath(cxt)
+#define	pgqr_search_path_matches(sp)	OverrideSearchPathMatchesCurrent(sp)
+#endif
+
+/*
+ * Backend local copy of the rules of current database:
+ * rebuilt from shared memory when generation of its stripe changes
+ * so that statement lookup does not need any lock.
+ */
+
+typedef struct pgqrLocalRule
+{
+	uint32	source_hash;
+	int	match;
+	bool	nested;
+	uint32	commands;
+	uint64	queryid;
+	char	*source_stmt;
+	int	source_len;
+	char	*target_stmt;
+	bool	target_params;		/* target statement may use $n parameters */
+	bool	target_captures;	/* target statement may use \n captured text */
+	int	slot;			/* index in rules array */
+	struct pgqrLocalRule *next;	/* next rule in same hash bucket */
+	/* match = regex and match = like rules */
+	int	nsub;			/* capturing groups of source pattern */
+	int	pattern_group;		/* outer group of rule in patterns automaton */
+	/*
+	 * rewrite = relation, function and limit rules: compatibility
+	 * of target with source is checked again after catalog invalidation
+	 */
+	int	rewrite;
+	Oid	source_oid;
+	Oid	target_oid;
+	int64	limit_count;
+	bool	checked;
+	bool	compatible;
+	uint64	checked_epoch;
+	int64	max_age;		/* freshness bound of summary, -1 if none */
+	bool	result_cache;		/* results of target statement are cached */
+	double	sample;			/* fraction of rewritten executions, -1 if not sampled */
+	TimestampTz created;		/* identifies rule in plan marks */
+	pgqrScope	scope;
+	uint32		scopes;		/* PGQR_SCOPE_xxx mask of scope */
+	/*
+	 * target statement parse tree cached on first rewrite and
+	 * analyzed target statement valid as long as no catalog 
+	 * invalidation is received and search_path does not change
+	 */
+	RawStmt		*target_raw;
+	MemoryContext	target_context;
+	Query		*target_query;
+	uint64		target_epoch;
+	pgqrSearchPath	*target_search_path;
+	int		target_nparams;
+	Oid		*target_paramtypes;
+	/* rewrite = settings rules: parameter names and values of target */
+	List		*setting_names;
+	List		*setting_values;
+} pgqrLocalRule;
+
+/*
+ * parameter types of a statement collected 
+ * from its analyzed query tree
+ */
+typedef struct pgqrParams
+{
+	int	numParams;
+	int	maxParams;
+	Oid	*paramTypes;
+} pgqrParams;
+
+/*
+ * incremented by catalog invalidation callbacks:
+ * analyzed target statements older than current epoch
+ * must be analyzed again.
+ */
+static uint64 pgqr_catalog_epoch = 0;
+
+typedef struct pgqrLocalState
+{
+	MemoryContext	context;
+	bool		valid;
+	uint32		generation;
+	int		rule_number;
+	/* match = text rules hashed by source statement */
+	int		nbuckets;
+	pgqrLocalRule	**buckets;
+	/* match = queryid rules hashed by query identifier */
+	int		queryid_rule_number;
+	int		queryid_nbuckets;
+	pgqrLocalRule	**queryid_buckets;
+	/* scope of all rules: checked before any rule lookup */
+	bool		nested;
+	uint32		commands;
+	/*
+	 * match = regex and match = like rules by slot order,
+	 * compiled into a single automaton
+	 */
+	int		pattern_rule_number;
+	pgqrLocalRule	**pattern_rules;
+	regex_t		patterns;
+	/*
+	 * rewrite = relation, function and limit rules sorted by
+	 * rewrite mode, source object and slot
+	 */
+	int		transform_rule_number;
+	pgqrLocalRule	**transform_rules;
+	/* statement rules with result_cache option */
+	int		result_rule_number;
+	pgqrLocalRule	**result_rules;
+	/* rewrite = settings rules by slot order */
+	int		settings_rule_number;
+	pgqrLocalRule	**settings_rules;
+	/* rules with max_age option */
+	int		summary_rule_number;
+	pgqrLocalRule	**summary_rules;
+	/* rules with sample option */
+	int		sample_rule_number;
+	pgqrLocalRule	**sample_rules;
+	/*
+	 * scopes used by rules of current database and session scope
+	 * local copy has been built for: rules out of session scope are
+	 * left out of local copy, which is rebuilt when session scope changes.
+	 */
+	uint32		scopes;		/* PGQR_SCOPE_xxx mask */
+	Oid		scope_role;
+	char		*scope_application_name;
+	pgqrSearchPath	*scope_search_path;
+	Oid		scope_schema;	/* first schema of search path */
+} pgqrLocalState;
+
+#define	PGQR_SCOPE_ROLE		0x01
+#define	PGQR_SCOPE_APPLICATION	0x02
+#define	PGQR_SCOPE_SCHEMA	0x04
+
+static pgqrLocalState pgqr_local = {NULL, false, 0, 0, 0, NULL, 0, 0, NULL, false, 0, 0, NULL};
+
+/*
+ * target statement of matching pattern rule built from
+ * captured text by rule lookup of current statement
+ */
+static char *pgqr_pattern_target = NULL;
+
+/*
+ * statistics counted by backend and added to shared counters
+ * every PGQR_STATS_FLUSH lookups, when pgqr_stats is called and
+ * at backend exit: backends do not update the same shared 
+ * counters for each statement.
+ */
+typedef struct pgqrStats
+{
+	uint64	lookups;
+	uint64	rewrites;
+	uint64	cache_hits;
+	uint64	lookup_time;
+	uint64	analyze_time;
+} pgqrStats;
+
+#define	PGQR_STATS_FLUSH	256
+
+static pgqrStats pgqr_pending_stats = {0, 0, 0, 0, 0};
 
 /*---- Function declarations ----*/
 
@@ -115,10 +777,42 @@ static 	void 	pgqr_analyze(ParseState *pstate, Query *query);
 static 	void 	pgqr_analyze(ParseState *pstate, Query *query, JumbleState *jstate);
 #endif
 
-static	void	pgqr_reanalyze(const char *new_query_string);
+static	void	pgqr_reanalyze(const char *new_query_string, RawStmt *new_parsetree,
+			       Oid *paramTypes, int numParams);
+static	RawStmt	*pgqr_parse_single(const char *stmt, const char *kind);
 static  void 	pgqr_exec(QueryDesc *queryDesc, int eflags);
+static	void	pgqr_executor_run(QueryDesc *queryDesc, ScanDirection direction,
+				  uint64 count, bool execute_once);
+static	void	pgqr_executor_finish(QueryDesc *queryDesc);
+static	void	pgqr_executor_end(QueryDesc *queryDesc);
+#if PG_VERSION_NUM >= 130000
+static	PlannedStmt *pgqr_planner(Query *parse, const char *query_string,
+				  int cursorOptions, ParamListInfo boundParams);
+#else
+static	PlannedStmt *pgqr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams);
+#endif
+#if PG_VERSION_NUM >= 140000
+static	void	pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				     bool readOnlyTree, ProcessUtilityContext context,
+				     ParamListInfo params, QueryEnvironment *queryEnv,
+				     DestReceiver *dest, QueryCompletion *qc);
+#elif PG_VERSION_NUM >= 130000
+static	void	pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				     ProcessUtilityContext context,
+				     ParamListInfo params, QueryEnvironment *queryEnv,
+				     DestReceiver *dest, QueryCompletion *qc);
+#else
+static	void	pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				     ProcessUtilityContext context,
+				     ParamListInfo params, QueryEnvironment *queryEnv,
+				     DestReceiver *dest, char *completionTag);
+#endif
 
-static void 	pgqr_incr_rewrite_count(int index);
+static int 	pgqr_incr_rewrite_count(pgqrLocalRule *rule);
+static void	pgqr_count_analysis(int slot, uint32 generation, bool cache_hit, uint64 analyze_time);
+static void	pgqr_xact_callback(XactEvent event, void *arg);
+static void	pgqr_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				      SubTransactionId parentSubid, void *arg);
 
 /*
  * !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
@@ -128,9 +822,16 @@ static void 	pgqr_incr_rewrite_count(int index);
 bool	pgqr_compare(size_t u1, size_t u2, size_t u3);
 
 PG_FUNCTION_INFO_V1(pgqr_add_rule);
+PG_FUNCTION_INFO_V1(pgqr_add_rules);
 PG_FUNCTION_INFO_V1(pgqr_rules);
 PG_FUNCTION_INFO_V1(pgqr_remove_rule);
 PG_FUNCTION_INFO_V1(pgqr_truncate);
+PG_FUNCTION_INFO_V1(pgqr_stats);
+PG_FUNCTION_INFO_V1(pgqr_rule_stats);
+PG_FUNCTION_INFO_V1(pgqr_sample_stats);
+PG_FUNCTION_INFO_V1(pgqr_stats_reset);
+PG_FUNCTION_INFO_V1(pgqr_refreshed);
+PG_FUNCTION_INFO_V1(pgqr_result_cache_reset);
 PG_FUNCTION_INFO_V1(pgqr_test);
 
 /*
@@ -143,7 +844,6 @@ pgqr_memsize(void)
 	Size		size;
 
 	size = MAXALIGN(sizeof(pgqrSharedState));
-	size += MAXALIGN(sizeof(pgqrSharedItem) * pgqrMaxRules);
 
 	return size;
 }
@@ -167,9 +867,7 @@ pgqr_shmem_request(void)
 #endif
 
 	RequestAddinShmemSpace(pgqr_memsize());
-#if PG_VERSION_NUM >= 90600
-	RequestNamedLWLockTranche("pg_query_rewrite", 1);
-#endif
+	RequestNamedLWLockTranche("pg_query_rewrite", 3);
 
 }
 
@@ -204,21 +902,48 @@ pgqr_shmem_startup(void)
 	if (!found)
 	{
 		/* First time through ... */
-#if PG_VERSION_NUM <= 90600
-		RequestAddinLWLocks(1);
-		pgqr->lock = LWLockAssign();
-#else
-		pgqr->lock = &(GetNamedLWLockTranche("pg_query_rewrite"))->lock;
-#endif
-		pgqr->rules = (pgqrSharedItem *)ShmemAlloc(pgqrMaxRules * sizeof(pgqrSharedItem));
-		MemSet(pgqr->rules, 0, pgqrMaxRules * sizeof(pgqrSharedItem));
-		for (i=0; i < pgqrMaxRules; i++)
+		pgqr->lock = &(GetNamedLWLockTranche("pg_query_rewrite"))[0].lock;
+		pgqr->result_lock = &(GetNamedLWLockTranche("pg_query_rewrite"))[1].lock;
+		pgqr->save_lock = &(GetNamedLWLockTranche("pg_query_rewrite"))[2].lock;
+		pgqr->changes = 0;
+		pgqr->saved_changes = 0;
+		pgqr->current_rule_number = 0;
+		pgqr->nslots = 0;
+		pgqr->free_slot = PGQR_NO_RULE;
+		pgqr->loaded = false;
+		for (i = 0; i < PGQR_DB_STRIPES; i++)
 		{
-			pgqr->rules[i].source_stmt[0] = '\0';
-			pgqr->rules[i].target_stmt[0] = '\0'; 	
-			pgqr->rules[i].rewrite_count = 0;
+			pg_atomic_init_u32(&pgqr->generation[i], 0);
+			pg_atomic_init_u32(&pgqr->rule_count[i], 0);
 		}
-		pgqr->current_rule_number = 0;
+		pgqr->tranche_id = LWLockNewTrancheId();
+		pgqr->area_handle = DSA_HANDLE_INVALID;
+		pgqr->nchunks = 0;
+		for (i=0; i < PGQR_MAX_CHUNKS; i++)
+			pgqr->chunks[i] = InvalidDsaPointer;
+		pgqr->nbuckets = 0;
+		pgqr->buckets = InvalidDsaPointer;
+		pg_atomic_init_u64(&pgqr->stat_lookups, 0);
+		pg_atomic_init_u64(&pgqr->stat_rewrites, 0);
+		pg_atomic_init_u64(&pgqr->stat_cache_hits, 0);
+		pg_atomic_init_u64(&pgqr->stat_lookup_time, 0);
+		pg_atomic_init_u64(&pgqr->stat_analyze_time, 0);
+		pgqr->stats_reset = GetCurrentTimestamp();
+		pg_atomic_init_u32(&pgqr->result_rules, 0);
+		pg_atomic_init_u64(&pgqr->result_epoch, 1);
+		SpinLockInit(&pgqr->result_mutex);
+		for (i = 0; i < PGQR_RESULT_WRITERS; i++)
+			pgqr->result_writers[i] = InvalidTransactionId;
+		pgqr->result_evicted = InvalidTransactionId;
+		for (i = 0; i < PGQR_RESULT_REL_BITS / 32; i++)
+			pg_atomic_init_u32(&pgqr->result_relations[i], 0);
+		pgqr->result_buckets = InvalidDsaPointer;
+		pgqr->result_lru_head = InvalidDsaPointer;
+		pgqr->result_lru_tail = InvalidDsaPointer;
+		pgqr->result_used = 0;
+		pgqr->result_entries = 0;
+		pg_atomic_init_u64(&pgqr->stat_result_hits, 0);
+		pg_atomic_init_u64(&pgqr->stat_result_stores, 0);
 
 	}
 
@@ -263,7 +988,7 @@ pgqr_shmem_shutdown(int code, Datum arg)
 	if (!pgqr)
 		return;
 	
-	/* currently: no action */
+	/* no action: rules are saved by transactions changing them */
 
 	elog(DEBUG5, "pg_query_rewrite: pgqr_shmem_shutdown: exit");
 }
@@ -283,21 +1008,64 @@ _PG_init(void)
 	/* get the configuration */
 	DefineCustomIntVariable("pg_query_rewrite.max_rules",
 				"Maximum of number of rules.",
-				NULL,
+				"Rules storage grows on demand up to this limit.",
 				&pgqrMaxRules,
-				0,	
+				10,	
+				1,
+				PGQR_MAX_RULES,
+				PGC_SIGHUP,	
 				0,
-				50,
-				PGC_POSTMASTER,	
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("pg_query_rewrite.max_stmt_length",
+				"Maximum length in bytes of source and target statements.",
+				NULL,
+				&pgqrMaxStmtLength,
+				PGQR_MAX_STMT_LENGTH,
+				1,
+				MaxAllocSize / 2,
+				PGC_SUSET,
 				0,
 				NULL,
 				NULL,
 				NULL);
 
-	if (pgqrMaxRules == 0)
-		pgqrMaxRules = 10;
-	
-	
+	DefineCustomBoolVariable("pg_query_rewrite.save",
+				 "Save rules to a file and reload them after server restart.",
+				 NULL,
+				 &pgqrSave,
+				 true,
+				 PGC_SIGHUP,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+
+	DefineCustomBoolVariable("pg_query_rewrite.track_timing",
+				 "Measure rule lookup and target statement analysis time.",
+				 NULL,
+				 &pgqrTrackTiming,
+				 false,
+				 PGC_SUSET,
+				 0,
+				 NULL,
+				 NULL,
+				 NULL);
+
+	DefineCustomIntVariable("pg_query_rewrite.result_cache_size",
+				"Maximum size of results cached for rules with result_cache option.",
+				"Zero disables the result cache.",
+				&pgqrResultCacheSize,
+				8192,
+				0,
+				MAX_KILOBYTES,
+				PGC_SIGHUP,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
 
 	elog(LOG, "pg_query_rewrite:_PG_init(): pg_query_rewrite is enabled with %d rules", 
                    pgqrMaxRules);
@@ -314,6 +1082,18 @@ _PG_init(void)
 	post_parse_analyze_hook = pgqr_analyze;
 	prev_executor_start_hook = ExecutorStart_hook;
  	ExecutorStart_hook = pgqr_exec;	
+	prev_executor_run_hook = ExecutorRun_hook;
+	ExecutorRun_hook = pgqr_executor_run;
+	prev_executor_finish_hook = ExecutorFinish_hook;
+	ExecutorFinish_hook = pgqr_executor_finish;
+	prev_process_utility_hook = ProcessUtility_hook;
+	ProcessUtility_hook = pgqr_process_utility;
+	prev_executor_end_hook = ExecutorEnd_hook;
+	ExecutorEnd_hook = pgqr_executor_end;
+	prev_planner_hook = planner_hook;
+	planner_hook = pgqr_planner;
+	RegisterXactCallback(pgqr_xact_callback, NULL);
+	RegisterSubXactCallback(pgqr_subxact_callback, NULL);
 
 	elog(DEBUG5, "pg_query_rewrite:_PG_init():exit");
 }
@@ -328,551 +1108,5972 @@ _PG_fini(void)
 	shmem_startup_hook = prev_shmem_startup_hook;	
 	post_parse_analyze_hook = prev_post_parse_analyze_hook;
 	ExecutorStart_hook = prev_executor_start_hook;
+	ExecutorRun_hook = prev_executor_run_hook;
+	ExecutorFinish_hook = prev_executor_finish_hook;
+	ProcessUtility_hook = prev_process_utility_hook;
+	ExecutorEnd_hook = prev_executor_end_hook;
+	planner_hook = prev_planner_hook;
+	UnregisterXactCallback(pgqr_xact_callback, NULL);
+	UnregisterSubXactCallback(pgqr_subxact_callback, NULL);
 }
 
 
-static bool pgqr_add_rule_internal(char *source, char *target)
+/*
+ * hash of a SQL statement text
+ */
+static uint32 pgqr_hash_stmt(const char *stmt, Size len)
 {
+	return DatumGetUInt32(hash_any((const unsigned char *)stmt, (int)len));
+}
 
-	int i;
+/*
+ * hash bucket of a (dbid, source statement hash) pair
+ */
+static int pgqr_bucket(Oid dbid, uint32 source_hash)
+{
+	uint32	h;
 
-	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	h = source_hash ^ DatumGetUInt32(hash_uint32((uint32)dbid));
 
-	if (pgqr->current_rule_number == pgqrMaxRules)
-	{
-		LWLockRelease(pgqr->lock);
-		ereport(ERROR, (errmsg("Maximum rule number is reached %d", pgqrMaxRules)));
-	}
+	return (int)(h & (uint32)(pgqr->nbuckets - 1));
+}
 
-	for (i = 0 ; i< pgqr->current_rule_number; i++)
-	{
-		if (strcmp(source, pgqr->rules[i].source_stmt) == 0)
-		{
-			LWLockRelease(pgqr->lock);
-			ereport(ERROR, (errmsg("rule already exists for %s", source)));
-		}
-	}
+/*
+ * database stripe
+ */
+static inline int pgqr_stripe(Oid dbid)
+{
+	return (int)(hash_uint32(dbid) & (PGQR_DB_STRIPES - 1));
+}
 
-	if (pgqr_compare(strlen(source), pgqr_max_stmt_length, 1))
-	{
-		LWLockRelease(pgqr->lock);
-		ereport(ERROR, (errmsg("Source statement length %zu is greater than %zu", 
-                               strlen(source), pgqr_max_stmt_length)));
-	}
+static int pgqr_my_stripe = -1;
+
+static inline int pgqr_local_stripe(void)
+{
+	if (pgqr_my_stripe < 0)
+		pgqr_my_stripe = pgqr_stripe(MyDatabaseId);
+	return pgqr_my_stripe;
+}
+
+/*
+ * bump rules generation of database dbid stripe 
+ * or of all stripes if dbid is InvalidOid:
+ * caller must hold pgqr->lock in exclusive mode.
+ */
+static void pgqr_bump_generation(Oid dbid)
+{
+	int	i;
 
-	if (pgqr_compare(strlen(target),pgqr_max_stmt_length, 1))
+	if (OidIsValid(dbid))
 	{
-		LWLockRelease(pgqr->lock);
-		ereport(ERROR, (errmsg("Target statement length %zu is greater than %zu", 
-                               strlen(target), pgqr_max_stmt_length)));
+		pg_atomic_fetch_add_u32(&pgqr->generation[pgqr_stripe(dbid)], 1);
+		return;
 	}
+	for (i = 0; i < PGQR_DB_STRIPES; i++)
+		pg_atomic_fetch_add_u32(&pgqr->generation[i], 1);
+}
 
-	pgqr->rules[pgqr->current_rule_number].dbid = MyDatabaseId;
-	strcpy(pgqr->rules[pgqr->current_rule_number].source_stmt, source);
-	strcpy(pgqr->rules[pgqr->current_rule_number].target_stmt, target);
-	pgqr->current_rule_number++;
+/*
+ * attach to dynamic shared memory area if it has been created
+ * by another backend: caller must hold pgqr->lock.
+ */
+static void pgqr_attach_area(void)
+{
+	MemoryContext	oldcontext;
 
-	LWLockRelease(pgqr->lock);	
-	
-	return true;
+	if (pgqr_area != NULL || pgqr->area_handle == DSA_HANDLE_INVALID)
+		return;
 
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockRegisterTranche(pgqr->tranche_id, "pg_query_rewrite");
+	pgqr_area = dsa_attach(pgqr->area_handle);
+	/* keep area mapped until backend exit */
+	dsa_pin_mapping(pgqr_area);
+	MemoryContextSwitchTo(oldcontext);
 }
 
 /*
- * pgqr_add_rule
- *
- * SQL-callable function to add a SQL translation rule
- *
+ * create dynamic shared memory area if needed and attach to it:
+ * caller must hold pgqr->lock in exclusive mode.
  */
-Datum pgqr_add_rule(PG_FUNCTION_ARGS)
+static void pgqr_create_area(void)
 {
+	MemoryContext	oldcontext;
 
- 	 char  *source;
-         char  *target;
-
-         source = PG_GETARG_CSTRING(0);
-         target = PG_GETARG_CSTRING(1);
-         elog(LOG, "pgqr_add_rule source=%s target=%s", source, target);
-
-         PG_RETURN_BOOL(pgqr_add_rule_internal(source, target));	
+	pgqr_attach_area();
+	if (pgqr_area != NULL)
+		return;
 
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockRegisterTranche(pgqr->tranche_id, "pg_query_rewrite");
+	pgqr_area = dsa_create(pgqr->tranche_id);
+	/* keep area until postmaster shutdown */
+	dsa_pin(pgqr_area);
+	dsa_pin_mapping(pgqr_area);
+	pgqr->area_handle = dsa_get_handle(pgqr_area);
+	MemoryContextSwitchTo(oldcontext);
 }
 
-
-static bool pgqr_remove_rule_internal(char *source)
+/*
+ * copy statement into dynamic shared memory area:
+ * returns InvalidDsaPointer if out of memory.
+ */
+static dsa_pointer pgqr_store_stmt(const char *stmt, Size len)
 {
+	dsa_pointer	dp;
 
-	int	i, j;
-	bool	found=false;
+	dp = dsa_allocate_extended(pgqr_area, len + 1, DSA_ALLOC_NO_OOM);
+	if (DsaPointerIsValid(dp))
+		memcpy(PGQR_STMT(dp), stmt, len + 1);
 
-	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	return dp;
+}
 
-	for (i = 0; i < pgqr->current_rule_number && found == false; i++)
-	{
-		if (strcmp(pgqr->rules[i].source_stmt, source) == 0)
-			found = true;
-	}
-	if (found == false)
-	{
-		LWLockRelease(pgqr->lock);	
-		ereport(ERROR, (errmsg("Rule for %s not found", source)));		
-	}
+/*
+ * reset latency histograms of rule: atomics of
+ * a new rules chunk must be initialized instead
+ */
+static void pgqr_reset_samples(pgqrSharedItem *rule, bool init)
+{
+	int	v;
+	int	b;
 
-	for (j = i - 1; j < pgqr->current_rule_number; j++)	
+	for (v = 0; v < PGQR_VARIANTS; v++)
 	{
-		pgqr->rules[j].dbid = pgqr->rules[j+1].dbid;
-		strcpy(pgqr->rules[j].source_stmt, pgqr->rules[j+1].source_stmt);
-		strcpy(pgqr->rules[j].target_stmt, pgqr->rules[j+1].target_stmt);
-		pgqr->rules[j].rewrite_count = pgqr->rules[j+1].rewrite_count;
-	}	
-	pgqr->current_rule_number--;	
+		if (init)
+			pg_atomic_init_u64(&rule->sample_time[v], 0);
+		else
+			pg_atomic_write_u64(&rule->sample_time[v], 0);
+		for (b = 0; b < PGQR_SAMPLE_BUCKETS; b++)
+		{
+			if (init)
+				pg_atomic_init_u64(&rule->sample_histogram[v][b], 0);
+			else
+				pg_atomic_write_u64(&rule->sample_histogram[v][b], 0);
+		}
+	}
+}
 
-	LWLockRelease(pgqr->lock);	
-	
-	return true;
+/*
+ * release statements of rule at index i
+ */
+static void pgqr_free_rule(int i)
+{
+	pgqrSharedItem	*rule = pgqr_rule(i);
+
+	if (DsaPointerIsValid(rule->source_stmt))
+		dsa_free(pgqr_area, rule->source_stmt);
+	if (DsaPointerIsValid(rule->target_stmt))
+		dsa_free(pgqr_area, rule->target_stmt);
+	rule->dbid = 0;
+	rule->match = PGQR_MATCH_TEXT;
+	rule->nested = true;
+	rule->commands = PGQR_ALL_COMMANDS;
+	rule->queryid = 0;
+	rule->nsub = 0;
+	rule->rewrite = PGQR_REWRITE_STATEMENT;
+	rule->source_oid = InvalidOid;
+	rule->target_oid = InvalidOid;
+	rule->summary_oid = InvalidOid;
+	rule->max_age = -1;
+	if (rule->result_cache)
+		pg_atomic_fetch_sub_u32(&pgqr->result_rules, 1);
+	rule->result_cache = false;
+	rule->sample = -1;
+	rule->role_oid = InvalidOid;
+	rule->schema_oid = InvalidOid;
+	rule->application_name[0] = '\0';
+	rule->source_len = 0;
+	rule->source_stmt = InvalidDsaPointer;
+	rule->target_len = 0;
+	rule->target_stmt = InvalidDsaPointer;
+	rule->created = 0;
+	pg_atomic_write_u64(&rule->refreshed, 0);
+	pg_atomic_write_u64(&rule->rewrite_count, 0);
+	pg_atomic_write_u64(&rule->last_rewrite, 0);
+	pg_atomic_write_u64(&rule->cache_hits, 0);
+	pg_atomic_write_u64(&rule->analyze_time, 0);
+	pg_atomic_write_u64(&rule->result_hits, 0);
+	pgqr_reset_samples(rule, false);
+}
 
+/*
+ * check that shared rule has scope
+ */
+static inline bool pgqr_same_scope(pgqrSharedItem *item, const pgqrScope *scope)
+{
+	return	item->role_oid == scope->role_oid &&
+		item->schema_oid == scope->schema_oid &&
+		strcmp(item->application_name, scope->application_name) == 0;
 }
 
 /*
- * pgqr_remove_rule
- *
- * SQL-callable function to remove a SQL translation rule
- *
+ * look up rule for source statement in database dbid with scope,
+ * in any scope if scope is NULL:
+ * returns its index in pgqr->rules array or PGQR_NO_RULE.
  */
-Datum pgqr_remove_rule(PG_FUNCTION_ARGS)
+static int pgqr_find_rule(Oid dbid, const char *source, uint32 source_hash, const pgqrScope *scope)
 {
+	int	i;
+	int	n;
+	Size	source_len = strlen(source);
+	pgqrSharedItem	*rule = NULL;
 
- 	 char  *source;
+	pgqr_attach_area();
+	if (pgqr->nbuckets == 0)
+		return PGQR_NO_RULE;
 
-         source = PG_GETARG_CSTRING(0);
-         elog(LOG, "pgqr_remove_rule source=%s", source);
+	/*
+	 * n guards against a corrupted chain
+	 * which would otherwise loop forever
+	 */
+	for (i = PGQR_BUCKETS()[pgqr_bucket(dbid, source_hash)], n = 0;
+	     i != PGQR_NO_RULE && n < pgqr->current_rule_number;
+	     i = rule->next, n++)
+	{
+		rule = pgqr_rule(i);
+		if (	rule->source_hash == source_hash &&
+			rule->dbid == dbid &&
+			rule->source_len == source_len &&
+			memcmp(source, PGQR_STMT(rule->source_stmt), source_len) == 0 &&
+			(scope == NULL || pgqr_same_scope(rule, scope)))
+			return i;
+	}
 
-         PG_RETURN_BOOL(pgqr_remove_rule_internal(source));	
+	return PGQR_NO_RULE;
+}
 
+/*
+ * link rule at index i in its hash bucket:
+ * caller must hold pgqr->lock in exclusive mode.
+ */
+static void pgqr_index_rule(int i)
+{
+	int		b;
+	int		*buckets = PGQR_BUCKETS();
+	pgqrSharedItem	*rule = pgqr_rule(i);
+
+	b = pgqr_bucket(rule->dbid, rule->source_hash);
+	rule->next = buckets[b];
+	buckets[b] = i;
 }
 
+/*
+ * unlink rule at index i from its hash bucket:
+ * caller must hold pgqr->lock in exclusive mode.
+ */
+static void pgqr_unindex_rule(int i)
+{
+	int		*link;
+	pgqrSharedItem	*rule = pgqr_rule(i);
 
-static bool pgqr_truncate_internal()
+	link = &PGQR_BUCKETS()[pgqr_bucket(rule->dbid, rule->source_hash)];
+	while (*link != PGQR_NO_RULE)
+	{
+		if (*link == i)
+		{
+			*link = rule->next;
+			break;
+		}
+		link = &pgqr_rule(*link)->next;
+	}
+	rule->next = PGQR_NO_RULE;
+}
+
+/*
+ * rebuild hash index from scratch after hash
+ * index has been enlarged: caller must hold pgqr->lock
+ * in exclusive mode.
+ */
+static void pgqr_rebuild_index(void)
 {
 	int	i;
+	int	*buckets;
 
-	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	if (pgqr->nbuckets == 0)
+		return;
+
+	buckets = PGQR_BUCKETS();
+	for (i = 0; i < pgqr->nbuckets; i++)
+		buckets[i] = PGQR_NO_RULE;
+	for (i = 0; i < pgqr->nslots; i++)
+		if (PGQR_SLOT_USED(pgqr_rule(i)))
+			pgqr_index_rule(i);
+}
+
+/*
+ * make room for one more rule: enlarge hash index if needed,
+ * reuse a free slot or allocate a new chunk of rules if all 
+ * chunks are full.
+ * Caller must hold pgqr->lock in exclusive mode.
+ * Returns reserved slot or PGQR_NO_RULE if out of shared memory.
+ */
+static int pgqr_reserve_rule(void)
+{
+	int	needed = pgqr->current_rule_number + 1;
+	int	slot;
+
+	if (2 * needed > pgqr->nbuckets)
+	{
+		dsa_pointer	buckets_dp;
+		int		nbuckets = PGQR_MIN_BUCKETS;
+
+		while (nbuckets < 2 * needed)
+			nbuckets <<= 1;
+		buckets_dp = dsa_allocate_extended(pgqr_area, nbuckets * sizeof(int),
+						   DSA_ALLOC_NO_OOM);
+		if (!DsaPointerIsValid(buckets_dp))
+			return PGQR_NO_RULE;
+		if (DsaPointerIsValid(pgqr->buckets))
+			dsa_free(pgqr_area, pgqr->buckets);
+		pgqr->buckets = buckets_dp;
+		pgqr->nbuckets = nbuckets;
+		pgqr_rebuild_index();
+	}
+
+	if (pgqr->free_slot != PGQR_NO_RULE)
+	{
+		slot = pgqr->free_slot;
+		pgqr->free_slot = pgqr_rule(slot)->next;
+		pgqr_rule(slot)->next = PGQR_NO_RULE;
+		return slot;
+	}
+
+	if (pgqr->nslots == pgqr->nchunks * PGQR_CHUNK_RULES)
+	{
+		dsa_pointer	chunk_dp;
+		pgqrSharedItem	*chunk;
+		int		i;
+
+		if (pgqr->nchunks == PGQR_MAX_CHUNKS)
+			return PGQR_NO_RULE;
+		chunk_dp = dsa_allocate_extended(pgqr_area,
+						 PGQR_CHUNK_RULES * sizeof(pgqrSharedItem),
+						 DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+		if (!DsaPointerIsValid(chunk_dp))
+			return PGQR_NO_RULE;
+		chunk = (pgqrSharedItem *) dsa_get_address(pgqr_area, chunk_dp);
+		for (i = 0; i < PGQR_CHUNK_RULES; i++)
+		{
+			chunk[i].source_stmt = InvalidDsaPointer;
+			chunk[i].target_stmt = InvalidDsaPointer;
+			chunk[i].next = PGQR_NO_RULE;
+			pg_atomic_init_u64(&chunk[i].rewrite_count, 0);
+			pg_atomic_init_u64(&chunk[i].last_rewrite, 0);
+			pg_atomic_init_u64(&chunk[i].cache_hits, 0);
+			pg_atomic_init_u64(&chunk[i].analyze_time, 0);
+			pg_atomic_init_u64(&chunk[i].result_hits, 0);
+			pgqr_reset_samples(&chunk[i], true);
+		}
+		pgqr->chunks[pgqr->nchunks] = chunk_dp;
+		pgqr->nchunks++;
+	}
+
+	return pgqr->nslots++;
+}
+
+/*
+ * put slot i back on free slots list
+ */
+static void pgqr_release_slot(int i)
+{
+	pgqr_rule(i)->next = pgqr->free_slot;
+	pgqr->free_slot = i;
+}
+
+/*
+ * add rule in a free slot of rules array:
+ * caller must hold pgqr->lock in exclusive mode
+ * and bump rules generation.
+ * Returns rule slot or PGQR_NO_RULE if out of shared memory.
+ */
+static int pgqr_insert_rule(Oid dbid, pgqrNewRule *new_rule)
+{
+	int		i;
+	pgqrSharedItem	*rule;
+	dsa_pointer	source_dp;
+	dsa_pointer	target_dp;
+
+	pgqr_create_area();
+	i = pgqr_reserve_rule();
+	if (i == PGQR_NO_RULE)
+		return PGQR_NO_RULE;
+	source_dp = pgqr_store_stmt(new_rule->source, new_rule->source_len);
+	target_dp = pgqr_store_stmt(new_rule->target, new_rule->target_len);
+	if (!DsaPointerIsValid(source_dp) || !DsaPointerIsValid(target_dp))
+	{
+		if (DsaPointerIsValid(source_dp))
+			dsa_free(pgqr_area, source_dp);
+		if (DsaPointerIsValid(target_dp))
+			dsa_free(pgqr_area, target_dp);
+		pgqr_release_slot(i);
+		return PGQR_NO_RULE;
+	}
+
+	rule = pgqr_rule(i);
+	rule->dbid = dbid;
+	rule->source_hash = new_rule->source_hash;
+	rule->match = new_rule->opts.match;
+	rule->nested = new_rule->opts.nested;
+	rule->commands = new_rule->opts.commands;
+	rule->queryid = new_rule->queryid;
+	rule->nsub = new_rule->nsub;
+	rule->rewrite = new_rule->opts.rewrite;
+	rule->source_oid = new_rule->source_oid;
+	rule->target_oid = new_rule->target_oid;
+	rule->summary_oid = new_rule->summary_oid;
+	rule->max_age = new_rule->opts.max_age;
+	rule->result_cache = new_rule->opts.result_cache;
+	rule->sample = new_rule->opts.sample;
+	rule->role_oid = new_rule->role_oid;
+	rule->schema_oid = new_rule->schema_oid;
+	strlcpy(rule->application_name,
+		new_rule->opts.application_name != NULL ? new_rule->opts.application_name : "",
+		NAMEDATALEN);
+	rule->source_len = new_rule->source_len;
+	rule->source_stmt = source_dp;
+	rule->target_len = new_rule->target_len;
+	rule->target_stmt = target_dp;
+	rule->created = GetCurrentTimestamp();
+	pg_atomic_write_u64(&rule->refreshed, 0);
+	pg_atomic_write_u64(&rule->rewrite_count, 0);
+	pg_atomic_write_u64(&rule->last_rewrite, 0);
+	pg_atomic_write_u64(&rule->cache_hits, 0);
+	pg_atomic_write_u64(&rule->analyze_time, 0);
+	pg_atomic_write_u64(&rule->result_hits, 0);
+	pgqr_reset_samples(rule, false);
+	pgqr_index_rule(i);
+	pgqr->current_rule_number++;
+	pg_atomic_fetch_add_u32(&pgqr->rule_count[pgqr_stripe(dbid)], 1);
+	if (rule->result_cache)
+		pg_atomic_fetch_add_u32(&pgqr->result_rules, 1);
+
+	return i;
+}
+
+/*
+ * remove rule at index i: rule is unlinked from hash index
+ * and its slot becomes free, other rules are not moved.
+ * Caller must hold pgqr->lock in exclusive mode
+ * and bump rules generation.
+ */
+static void pgqr_delete_rule(int i)
+{
+	pg_atomic_fetch_sub_u32(&pgqr->rule_count[pgqr_stripe(pgqr_rule(i)->dbid)], 1);
+	pgqr_unindex_rule(i);
+	pgqr_free_rule(i);
+	pgqr_release_slot(i);
+	pgqr->current_rule_number--;
+}
+
+/*
+ * remove all rules:
+ * caller must hold pgqr->lock in exclusive mode
+ * and bump rules generation.
+ */
+static void pgqr_clear_rules(void)
+{
+	int	i;
 
-	for (i=0; i < pgqrMaxRules; i++)
+	pgqr_attach_area();
+	for (i=0; i < pgqr->nslots; i++)
 	{
-		pgqr->rules[i].dbid = 0;
-		pgqr->rules[i].source_stmt[0] = '\0';
-		pgqr->rules[i].target_stmt[0] = '\0';
-		pgqr->rules[i].rewrite_count = 0;
+		pgqr_free_rule(i);
+		pgqr_rule(i)->next = PGQR_NO_RULE;
         }
 	pgqr->current_rule_number = 0;
+	pgqr->nslots = 0;
+	pgqr->free_slot = PGQR_NO_RULE;
+	for (i = 0; i < PGQR_DB_STRIPES; i++)
+		pg_atomic_write_u32(&pgqr->rule_count[i], 0);
+	pgqr_rebuild_index();
+}
 
-	LWLockRelease(pgqr->lock);	
+/*
+ * dump file image built while holding pgqr->lock:
+ * it can be larger than MaxAllocSize with many long rules.
+ */
+typedef struct pgqrDumpBuffer
+{
+	char	*data;
+	Size	len;
+	Size	size;
+} pgqrDumpBuffer;
 
-	return true;
+static void pgqr_dump_append(pgqrDumpBuffer *buf, const void *data, Size len)
+{
+	if (buf->len + len > buf->size)
+	{
+		while (buf->len + len > buf->size)
+			buf->size *= 2;
+		buf->data = (char *) repalloc_huge(buf->data, buf->size);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
 }
 
 /*
- *  pgqr_truncate
- *  
- *  SQL-callable function to remove all SQL translation rules
- * 
+ * save all rules to dump file if they have changed since last write:
+ * rules are copied while holding pgqr->lock in shared mode and the
+ * file is written after lock release, so that rule lookups and rule
+ * changes do not wait for file I/O. Dump file writers are serialized
+ * by pgqr->save_lock, and a writer skips the file if a concurrent
+ * writer has already saved its changes.
+ * Rules are written to a temporary file which is durably renamed
+ * so that a crash leaves either the previous or the new file.
  */
-Datum pgqr_truncate(PG_FUNCTION_ARGS)
+static void pgqr_save_rules(void)
 {
+	FILE		*file = NULL;
+	uint32		header = PGQR_FILE_HEADER;
+	int32		pgver = PGQR_PG_MAJOR_VERSION;
+	int32		num;
+	uint64		changes;
+	pgqrDumpBuffer	buf;
+	int		i;
 
-         elog(LOG, "pgqr_truncate_rule");
+	if (!pgqrSave)
+		return;
 
-         PG_RETURN_BOOL(pgqr_truncate_internal());
+	LWLockAcquire(pgqr->save_lock, LW_EXCLUSIVE);
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+	changes = pgqr->changes;
+	if (changes == pgqr->saved_changes)
+	{
+		LWLockRelease(pgqr->lock);
+		LWLockRelease(pgqr->save_lock);
+		return;
+	}
+
+	pgqr_attach_area();
+	num = pgqr->current_rule_number;
+	buf.size = 8192;
+	buf.len = 0;
+	buf.data = (char *) palloc(buf.size);
+	pgqr_dump_append(&buf, &header, sizeof(uint32));
+	pgqr_dump_append(&buf, &pgver, sizeof(int32));
+	pgqr_dump_append(&buf, &num, sizeof(int32));
+
+	for (i = 0; i < pgqr->nslots; i++)
+	{
+		pgqrSharedItem	*rule = pgqr_rule(i);
+		pgqrDumpItem	item;
+
+		if (!PGQR_SLOT_USED(rule))
+			continue;
+
+		item.dbid = rule->dbid;
+		item.match = rule->match;
+		item.nested = rule->nested;
+		item.commands = rule->commands;
+		item.queryid = rule->queryid;
+		item.nsub = rule->nsub;
+		item.rewrite = rule->rewrite;
+		item.source_oid = rule->source_oid;
+		item.target_oid = rule->target_oid;
+		item.summary_oid = rule->summary_oid;
+		item.max_age = rule->max_age;
+		item.result_cache = rule->result_cache;
+		item.sample = rule->sample;
+		item.role_oid = rule->role_oid;
+		item.schema_oid = rule->schema_oid;
+		memcpy(item.application_name, rule->application_name, NAMEDATALEN);
+		item.created = rule->created;
+		item.source_len = rule->source_len;
+		item.target_len = rule->target_len;
+		pgqr_dump_append(&buf, &item, sizeof(pgqrDumpItem));
+		pgqr_dump_append(&buf, PGQR_STMT(rule->source_stmt), item.source_len + 1);
+		pgqr_dump_append(&buf, PGQR_STMT(rule->target_stmt), item.target_len + 1);
+	}
+	LWLockRelease(pgqr->lock);
+
+	file = AllocateFile(PGQR_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(buf.data, 1, buf.len, file) != buf.len)
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
 
+	if (durable_rename(PGQR_DUMP_FILE ".tmp", PGQR_DUMP_FILE, WARNING) == 0)
+		pgqr->saved_changes = changes;
+	LWLockRelease(pgqr->save_lock);
+	pfree(buf.data);
+	return;
+
+error:
+	ereport(WARNING,
+		(errcode_for_file_access(),
+		 errmsg("could not write file \"%s\": %m",
+			PGQR_DUMP_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(PGQR_DUMP_FILE ".tmp");
+	LWLockRelease(pgqr->save_lock);
+	pfree(buf.data);
 }
 
+static void pgqr_save_exit_callback(int code, Datum arg);
 
 /*
- * check if the current query needs to be rewritten:
- * returns true if must be rewritten, otherwise false;
- * array_index is the position of the target query
- * in pgqr->rules array.
+ * rules have been changed: caller holds pgqr->lock in exclusive mode.
+ * Dump file is written at end of transaction, so that a transaction
+ * changing many rules writes it once. Rule changes are not
+ * transactional: changes of an aborted transaction are written at
+ * next commit of the backend or when it exits.
  */
-static bool pgqr_check_rewrite(const char *current_query_source, int *rule_index) 
+static void pgqr_rules_changed(void)
 {
+	static bool	exit_callback = false;
 
-	int	i;
+	pgqr->changes++;
+	pgqr_save_pending = true;
+	if (!exit_callback)
+	{
+		before_shmem_exit(pgqr_save_exit_callback, (Datum) 0);
+		exit_callback = true;
+	}
+}
+
+/*
+ * write dump file at end of transaction having changed rules:
+ * nothing is written while aborting
+ */
+static void pgqr_save_xact(XactEvent event)
+{
+	if (!pgqr_save_pending)
+		return;
 
-	*rule_index = pgqrMaxRules;	
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PRE_PREPARE:
+			pgqr_save_pending = false;
+			pgqr_save_rules();
+			break;
+		default:
+			break;
+	}
+}
 
-	/*
- 	 * To be checked: possible recursion issue ?
-	 */
+/*
+ * write dump file at backend exit if rules have been changed
+ * by an aborted transaction since last commit
+ */
+static void pgqr_save_exit_callback(int code, Datum arg)
+{
+	if (!pgqr_save_pending || pgqr == NULL)
+		return;
+
+	/* release locks held by a transaction interrupted by FATAL error */
+	AbortOutOfAnyTransaction();
+	pgqr_save_pending = false;
+	pgqr_save_rules();
+}
+
+/*
+ * load rules from dump file: called by first backend using rules 
+ * after server start while holding pgqr->lock in exclusive mode.
+ * Invalid file is ignored.
+ */
+static void pgqr_load_rules(void)
+{
+	FILE		*file;
+	uint32		header;
+	int32		pgver;
+	int32		num;
+	int		i;
+	int		slot;
+	char		*source = NULL;
+	char		*target = NULL;
+	pgqrNewRule	rule;
+
+	pgqr->loaded = true;
+	if (!pgqrSave)
+		return;
+
+	file = AllocateFile(PGQR_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		return;
+	}
 
-	for (i = 0 ; i < pgqrMaxRules; i++)	
-		if (	pgqr->rules[i].dbid == MyDatabaseId &&
-			strcmp(current_query_source, pgqr->rules[i].source_stmt) == 0)
+	if (	fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(int32), 1, file) != 1 ||
+		fread(&num, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	/* query identifiers are only valid for the same major version */
+	if (header != PGQR_FILE_HEADER || pgver != PGQR_PG_MAJOR_VERSION ||
+	    num < 0 || num > PGQR_MAX_RULES)
+		goto data_error;
+
+	for (i = 0; i < num; i++)
+	{
+		pgqrDumpItem	item;
+
+		if (fread(&item, sizeof(pgqrDumpItem), 1, file) != 1)
+			goto read_error;
+		if (	item.source_len >= MaxAllocSize || 
+			item.target_len >= MaxAllocSize)
+			goto data_error;
+
+		source = (char *) palloc(item.source_len + 1);
+		target = (char *) palloc(item.target_len + 1);
+		if (	fread(source, 1, item.source_len + 1, file) != item.source_len + 1 ||
+			fread(target, 1, item.target_len + 1, file) != item.target_len + 1)
+			goto read_error;
+		if (	source[item.source_len] != '\0' ||
+			target[item.target_len] != '\0')
+			goto data_error;
+
+		if (item.dbid == InvalidOid)
+			goto data_error;
+		rule.source = source;
+		rule.target = target;
+		rule.source_len = item.source_len;
+		rule.target_len = item.target_len;
+		rule.source_hash = pgqr_hash_stmt(source, item.source_len);
+		rule.queryid = item.queryid;
+		rule.nsub = item.nsub;
+		rule.source_oid = item.source_oid;
+		rule.target_oid = item.target_oid;
+		rule.summary_oid = item.summary_oid;
+		rule.role_oid = item.role_oid;
+		rule.schema_oid = item.schema_oid;
+		rule.opts.match = item.match;
+		rule.opts.rewrite = item.rewrite;
+		rule.opts.nested = item.nested;
+		rule.opts.commands = item.commands;
+		rule.opts.summary = NULL;
+		rule.opts.max_age = item.max_age;
+		rule.opts.result_cache = item.result_cache;
+		rule.opts.sample = item.sample;
+		rule.opts.role = NULL;
+		rule.opts.schema = NULL;
+		item.application_name[NAMEDATALEN - 1] = '\0';
+		rule.opts.application_name = item.application_name;
+		slot = pgqr_insert_rule(item.dbid, &rule);
+		if (slot == PGQR_NO_RULE)
 		{
-			*rule_index = i;
-			return true;
+			ereport(LOG,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of shared memory loading rules from file \"%s\"",
+					PGQR_DUMP_FILE)));
+			goto fail;
 		}
+		pgqr_rule(slot)->created = item.created;
+		pfree(source);
+		pfree(target);
+		source = target = NULL;
+	}
 
-	return false;
+	FreeFile(file);
+	pgqr_bump_generation(InvalidOid);
+	elog(LOG, "pg_query_rewrite: %d rules loaded from file \"%s\"", num, PGQR_DUMP_FILE);
+	return;
+
+read_error:
+	ereport(LOG,
+		(errcode_for_file_access(),
+		 errmsg("could not read file \"%s\": %m",
+			PGQR_DUMP_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+		(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		 errmsg("ignoring invalid data in file \"%s\"",
+			PGQR_DUMP_FILE)));
+fail:
+	if (source)
+		pfree(source);
+	if (target)
+		pfree(target);
+	if (file)
+		FreeFile(file);
+	pgqr_clear_rules();
+	pgqr_bump_generation(InvalidOid);
 }
 
-static void pgqr_clone_Query(Query *source, Query *target)
+/*
+ * make sure dump file has been loaded before
+ * rules are read with pgqr->lock in shared mode
+ */
+static void pgqr_ensure_loaded(void)
 {
-	target->type = source->type;
-	target->commandType = source->commandType;
-	target->querySource = source->querySource;
-	target->queryId = source->queryId;
-	target->canSetTag = source->canSetTag;
-	target->utilityStmt = source->utilityStmt;
-	target->resultRelation = source->resultRelation;
-	target->hasAggs = source->hasAggs;
-	target->hasWindowFuncs = source->hasWindowFuncs;
-#if PG_VERSION_NUM > 100000 
-	target->hasTargetSRFs = source->hasTargetSRFs;
-#endif
-	target->hasSubLinks = source->hasSubLinks;
-	target->hasDistinctOn = source->hasDistinctOn;
-	target->hasRecursive = source->hasRecursive;
-	target->hasModifyingCTE = source->hasModifyingCTE;
-	target->hasForUpdate = source->hasForUpdate;
-	target->hasRowSecurity = source->hasRowSecurity;
-	target->cteList = source->cteList;
-	target->rtable = source->rtable;
-	target->jointree = source->jointree;
-	target->targetList = source->targetList;
-#if PG_VERSION_NUM > 100000 
-	target->override = source->override;
-#endif
-	target->onConflict = source->onConflict;
-	target->returningList = source->returningList;
-	target->groupClause = source->groupClause;
-	target->groupingSets = source->groupingSets;
-	target->havingQual = source->havingQual;
-	target->windowClause = source->windowClause;
-	target->distinctClause= source->distinctClause;
-	target->sortClause= source->sortClause;
-	target->limitOffset= source->limitOffset;
-	target->limitCount= source->limitCount;
-#if PG_VERSION_NUM > 130000 
-	target->limitOption = source->limitOption;
-#endif
-	target->rowMarks= source->rowMarks;
-	target->setOperations= source->setOperations;
-	target->constraintDeps= source->constraintDeps;
-	target->withCheckOptions = source->withCheckOptions;
-#if PG_VERSION_NUM > 140000 
-	target->limitOption = source->limitOption;
-#endif
-#if PG_VERSION_NUM > 100000 
-	target->stmt_location=source->stmt_location;
-	target->stmt_len=source->stmt_len;
-#endif
+	if (pgqr->loaded)
+		return;
 
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	if (!pgqr->loaded)
+		pgqr_load_rules();
+	LWLockRelease(pgqr->lock);
 }
 
-static void pgqr_clone_ParseState(ParseState *source, ParseState *target)
+/*
+ * set rule option name to value
+ */
+static void pgqr_set_option(pgqrRuleOptions *opts, const char *name, const char *value)
 {
-	target->parentParseState = source->parentParseState;
-	target->p_sourcetext = source->p_sourcetext;
-	target->p_rtable= source->p_rtable;
-	target->p_joinexprs= source->p_joinexprs;
-	target->p_joinlist= source->p_joinlist;
-	target->p_namespace= source->p_namespace;
-	target->p_lateral_active= source->p_lateral_active;
-	target->p_ctenamespace= source->p_ctenamespace;
-	target->p_future_ctes= source->p_future_ctes;
-	target->p_parent_cte= source->p_parent_cte;
-	target->p_target_relation= source->p_target_relation;
-	target->p_is_insert= source->p_is_insert;
-	target->p_windowdefs= source->p_windowdefs;
-	target->p_expr_kind= source->p_expr_kind;
-	target->p_next_resno= source->p_next_resno;
-	target->p_multiassign_exprs= source->p_multiassign_exprs;
-	target->p_locking_clause= source->p_locking_clause;
-	target->p_locked_from_parent= source->p_locked_from_parent;
-#if PG_VERSION_NUM > 100000 
-	target->p_resolve_unknowns= source->p_resolve_unknowns;
-	target->p_queryEnv= source->p_queryEnv;
-#endif
-	target->p_hasAggs = source->p_hasAggs;
-	target->p_hasWindowFuncs = source->p_hasWindowFuncs;
-#if PG_VERSION_NUM > 100000 
-	target->p_hasTargetSRFs= source->p_hasTargetSRFs;
-#endif
-	target->p_hasSubLinks= source->p_hasSubLinks;
-	target->p_hasModifyingCTE= source->p_hasModifyingCTE;
-#if PG_VERSION_NUM > 100000 
-	target->p_last_srf = source->p_last_srf;
+	if (strcmp(name, "match") == 0)
+	{
+		if (strcmp(value, "text") == 0)
+			opts->match = PGQR_MATCH_TEXT;
+		else if (strcmp(value, "queryid") == 0)
+			opts->match = PGQR_MATCH_QUERYID;
+		else if (strcmp(value, "normalized") == 0)
+			opts->match = PGQR_MATCH_NORMALIZED;
+		else if (strcmp(value, "regex") == 0)
+			opts->match = PGQR_MATCH_REGEX;
+		else if (strcmp(value, "like") == 0)
+			opts->match = PGQR_MATCH_LIKE;
+		else
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for rule option \"match\": \"%s\"", value),
+				 errhint("Valid values are \"text\", \"queryid\", \"normalized\", \"regex\" and \"like\".")));
+	}
+	else if (strcmp(name, "rewrite") == 0)
+	{
+		if (strcmp(value, "statement") == 0)
+			opts->rewrite = PGQR_REWRITE_STATEMENT;
+		else if (strcmp(value, "relation") == 0)
+			opts->rewrite = PGQR_REWRITE_RELATION;
+		else if (strcmp(value, "function") == 0)
+			opts->rewrite = PGQR_REWRITE_FUNCTION;
+		else if (strcmp(value, "limit") == 0)
+			opts->rewrite = PGQR_REWRITE_LIMIT;
+		else if (strcmp(value, "settings") == 0)
+			opts->rewrite = PGQR_REWRITE_SETTINGS;
+		else
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid value for rule option \"rewrite\": \"%s\"", value),
+				 errhint("Valid values are \"statement\", \"relation\", \"function\", \"limit\" and \"settings\".")));
+	}
+	else if (strcmp(name, "nested") == 0)
+	{
+		if (!parse_bool(value, &opts->nested))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"nested\" requires a Boolean value")));
+	}
+	else if (strcmp(name, "commands") == 0)
+	{
+		char	*list = pstrdup(value);
+		char	*command;
+		char	*save;
+
+		opts->commands = 0;
+		for (command = strtok_r(list, ",|", &save); command != NULL; command = strtok_r(NULL, ",|", &save))
+		{
+			if (strcmp(command, "select") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_SELECT);
+			else if (strcmp(command, "insert") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_INSERT);
+			else if (strcmp(command, "update") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_UPDATE);
+			else if (strcmp(command, "delete") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_DELETE);
+#if PG_VERSION_NUM >= 150000
+			else if (strcmp(command, "merge") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_MERGE);
 #endif
-	target->p_pre_columnref_hook = source->p_pre_columnref_hook;
-	target->p_post_columnref_hook = source->p_post_columnref_hook;
-	target->p_paramref_hook = source->p_paramref_hook;
-	target->p_coerce_param_hook = source->p_coerce_param_hook;
+			else if (strcmp(command, "utility") == 0)
+				opts->commands |= PGQR_COMMAND(CMD_UTILITY);
+			else if (strcmp(command, "all") == 0)
+				opts->commands = PGQR_ALL_COMMANDS;
+			else
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid command \"%s\" for rule option \"commands\"", command),
+					 errhint("Valid values are \"select\", \"insert\", \"update\", \"delete\", \"merge\", \"utility\" and \"all\".")));
+		}
+		pfree(list);
+		if (opts->commands == 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"commands\" requires at least one command")));
+	}
+	else if (strcmp(name, "summary") == 0)
+		opts->summary = pstrdup(value);
+	else if (strcmp(name, "role") == 0)
+		opts->role = pstrdup(value);
+	else if (strcmp(name, "application_name") == 0)
+	{
+		if (strlen(value) >= NAMEDATALEN)
+			ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("rule option \"application_name\" must be shorter than %d bytes", NAMEDATALEN)));
+		opts->application_name = pstrdup(value);
+	}
+	else if (strcmp(name, "schema") == 0)
+		opts->schema = pstrdup(value);
+	else if (strcmp(name, "result_cache") == 0)
+	{
+		if (!parse_bool(value, &opts->result_cache))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"result_cache\" requires a Boolean value")));
+	}
+	else if (strcmp(name, "sample") == 0)
+	{
+		char	*end;
+
+		errno = 0;
+		opts->sample = strtod(value, &end);
+		if (end == value || *end != '\0' || errno != 0 ||
+		    !(opts->sample >= 0 && opts->sample <= 1))
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"sample\" requires a number between 0 and 1")));
+	}
+	else if (strcmp(name, "max_age") == 0)
+	{
+		Interval	*age;
+
+		age = DatumGetIntervalP(DirectFunctionCall3(interval_in,
+							    CStringGetDatum(value),
+							    ObjectIdGetDatum(InvalidOid),
+							    Int32GetDatum(-1)));
+		opts->max_age = age->time +
+				((int64) age->month * DAYS_PER_MONTH + age->day) * USECS_PER_DAY;
+		if (opts->max_age < 0)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"max_age\" must not be negative")));
+	}
+	else
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("unrecognized rule option \"%s\"", name)));
+}
+
+/*
+ * parse list of key=value pairs separated by commas or white space;
+ * value can be single-quoted. Each pair is passed to callback, list
+ * names the list in error messages.
+ */
+static void pgqr_parse_pairs(const char *pairs, const char *list,
+			     void (*callback) (void *arg, const char *name, const char *value),
+			     void *arg)
+{
+	char	*buf;
+	char	*p;
+
+	buf = pstrdup(pairs);
+	p = buf;
+	for (;;)
+	{
+		char	*name;
+		char	*value;
+
+		while (isspace((unsigned char) *p) || *p == ',')
+			p++;
+		if (*p == '\0')
+			break;
+
+		name = p;
+		while (*p != '\0' && *p != '=' && *p != ',' && !isspace((unsigned char) *p))
+			p++;
+		while (isspace((unsigned char) *p))
+			*p++ = '\0';
+		if (*p != '=')
+			ereport(ERROR,
+				(errcode(ERRCODE_SYNTAX_ERROR),
+				 errmsg("missing \"=\" after \"%s\" in %s", name, list)));
+		*p++ = '\0';
+		while (isspace((unsigned char) *p))
+			p++;
+
+		if (*p == '\'')
+		{
+			char	*q;
+
+			/* quoted value: '' stands for a single quote */
+			value = q = ++p;
+			for (;;)
+			{
+				if (*p == '\0')
+					ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("unterminated quoted value in %s", list)));
+				if (*p == '\'')
+				{
+					if (p[1] != '\'')
+						break;
+					p++;
+				}
+				*q++ = *p++;
+			}
+			p++;
+			*q = '\0';
+		}
+		else
+		{
+			value = p;
+			while (*p != '\0' && *p != ',' && !isspace((unsigned char) *p))
+				p++;
+			if (*p != '\0')
+				*p++ = '\0';
+		}
+
+		callback(arg, name, value);
+	}
+
+	pfree(buf);
+}
+
+/*
+ * pgqr_parse_pairs callback of rule options
+ */
+static void pgqr_option_pair(void *arg, const char *name, const char *value)
+{
+	pgqr_set_option((pgqrRuleOptions *) arg, name, value);
+}
+
+/*
+ * parse rule options
+ */
+static void pgqr_parse_options(const char *options, pgqrRuleOptions *opts)
+{
+	MemSet(opts, 0, sizeof(pgqrRuleOptions));
+	opts->match = PGQR_MATCH_TEXT;
+	opts->rewrite = PGQR_REWRITE_STATEMENT;
+	opts->nested = true;
+	opts->commands = PGQR_ALL_COMMANDS;
+	opts->summary = NULL;
+	opts->max_age = -1;
+	opts->result_cache = false;
+	opts->sample = -1;
+	opts->role = NULL;
+	opts->application_name = NULL;
+	opts->schema = NULL;
+
+	if (options == NULL)
+		return;
+
+	pgqr_parse_pairs(options, "rule options", pgqr_option_pair, opts);
+}
+
+/*
+ * check parameter of settings rule target without changing it:
+ * arg counts parameters.
+ */
+static void pgqr_check_setting(void *arg, const char *name, const char *value)
+{
+	(void) set_config_option(name, value, PGC_USERSET, PGC_S_SESSION,
+				 GUC_ACTION_SET, false, ERROR, false);
+	(*(int *) arg)++;
+}
+
+/*
+ * add parameter of settings rule target to local copy of rule
+ */
+static void pgqr_add_setting(void *arg, const char *name, const char *value)
+{
+	pgqrLocalRule	*rule = (pgqrLocalRule *) arg;
+
+	rule->setting_names = lappend(rule->setting_names, pstrdup(name));
+	rule->setting_values = lappend(rule->setting_values, pstrdup(value));
+}
+
+#if PG_VERSION_NUM >= 140000
+static int pgqr_location_cmp(const void *a, const void *b)
+{
+	int	l = ((const LocationLen *) a)->location;
+	int	r = ((const LocationLen *) b)->location;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return 1;
+	return 0;
+}
+
+/*
+ * jumble query without changing its query identifier
+ */
+static JumbleState *pgqr_jumble(Query *query, const char *query_string)
+{
+	uint64		queryid = query->queryId;
+	JumbleState	*jstate;
+
+#if PG_VERSION_NUM >= 160000
+	jstate = JumbleQuery(query);
+#else
+	jstate = JumbleQuery(query, query_string);
+#endif
+	query->queryId = queryid;
+
+	return jstate;
+}
+
+/*
+ * locations of jumbled constants sorted by location without 
+ * duplicates and with their length in query text: 
+ * adapted from pg_stat_statements fill_in_constant_lengths.
+ * Returned array is a copy: jumble state can be shared with
+ * other post_parse_analyze_hook.
+ */
+static LocationLen *pgqr_constants(JumbleState *jstate, const char *query_string, int *nconsts)
+{
+	LocationLen		*locs;
+	core_yyscan_t		yyscanner;
+	core_yy_extra_type	yyextra;
+	core_YYSTYPE		yylval;
+	YYLTYPE			yylloc;
+	int			n = 0;
+	int			i;
+
+	*nconsts = 0;
+	if (jstate == NULL || jstate->clocations_count == 0)
+		return NULL;
+
+	locs = (LocationLen *) palloc(jstate->clocations_count * sizeof(LocationLen));
+	memcpy(locs, jstate->clocations, jstate->clocations_count * sizeof(LocationLen));
+	if (jstate->clocations_count > 1)
+		qsort(locs, jstate->clocations_count, sizeof(LocationLen), pgqr_location_cmp);
+
+	yyscanner = scanner_init(query_string, &yyextra, &ScanKeywords, ScanKeywordTokens);
+	yyextra.escape_string_warning = false;
+
+	for (i = 0; i < jstate->clocations_count; i++)
+	{
+		int	loc = locs[i].location;
+		int	tok;
+
+		/* duplicate constant */
+		if (n > 0 && loc <= locs[n - 1].location)
+			continue;
+
+		for (;;)
+		{
+			tok = core_yylex(&yylval, &yylloc, yyscanner);
+			if (tok == 0)
+				break;
+			if (yylloc >= loc)
+			{
+				/* negative constant includes next token */
+				if (query_string[loc] == '-')
+				{
+					tok = core_yylex(&yylval, &yylloc, yyscanner);
+					if (tok == 0)
+						break;
+				}
+				/* scanner has terminated current token */
+				locs[n].location = loc;
+				locs[n].length = strlen(yyextra.scanbuf + loc);
+				n++;
+				break;
+			}
+		}
+		if (tok == 0)
+			break;
+	}
+
+	scanner_finish(yyscanner);
+
+	*nconsts = n;
+	return locs;
+}
+
+/*
+ * calls callback for each $n token of statement:
+ * dollar-quoted strings and $n inside literals are skipped.
+ */
+typedef void (*pgqr_placeholder_callback) (int number, int location, int length, void *arg);
+
+static void pgqr_scan_placeholders(const char *stmt, pgqr_placeholder_callback callback, void *arg)
+{
+	core_yyscan_t		yyscanner;
+	core_yy_extra_type	yyextra;
+	core_YYSTYPE		yylval;
+	YYLTYPE			yylloc;
+
+	yyscanner = scanner_init(stmt, &yyextra, &ScanKeywords, ScanKeywordTokens);
+	yyextra.escape_string_warning = false;
+
+	while (core_yylex(&yylval, &yylloc, yyscanner) != 0)
+	{
+		if (stmt[yylloc] == '$' && isdigit((unsigned char) stmt[yylloc + 1]))
+			callback(atoi(stmt + yylloc + 1), yylloc,
+				 strlen(yyextra.scanbuf + yylloc), arg);
+	}
+
+	scanner_finish(yyscanner);
+}
+
+static void pgqr_max_placeholder(int number, int location, int length, void *arg)
+{
+	int	*max = (int *) arg;
+
+	if (number > *max)
+		*max = number;
+}
+
+/*
+ * target statement of normalized rule for current statement
+ */
+typedef struct pgqrFillState
+{
+	StringInfoData	buf;
+	const char	*target;
+	int		last;		/* end of last copied placeholder */
+	const char	*query_string;
+	LocationLen	*locs;
+	int		nconsts;
+	int		nparams;	/* highest parameter of current statement */
+} pgqrFillState;
+
+static void pgqr_fill_placeholder(int number, int location, int length, void *arg)
+{
+	pgqrFillState	*state = (pgqrFillState *) arg;
+	int		c = number - state->nparams;
+
+	/* parameter of current statement */
+	if (c <= 0)
+		return;
+	if (c > state->nconsts)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("no constant for placeholder $%d of target statement %s",
+				number, state->target)));
+
+	appendBinaryStringInfo(&state->buf, state->target + state->last, location - state->last);
+	appendBinaryStringInfo(&state->buf, state->query_string + state->locs[c - 1].location,
+			       state->locs[c - 1].length);
+	state->last = location + length;
+}
+
+static char *pgqr_fill_placeholders(const char *target, const char *query_string, JumbleState *jstate)
+{
+	pgqrFillState	state;
+
+	initStringInfo(&state.buf);
+	state.target = target;
+	state.last = 0;
+	state.query_string = query_string;
+	state.locs = pgqr_constants(jstate, query_string, &state.nconsts);
+	state.nparams = (jstate != NULL ? jstate->highest_extern_param_id : 0);
+
+	pgqr_scan_placeholders(target, pgqr_fill_placeholder, &state);
+	appendStringInfoString(&state.buf, target + state.last);
+
+	return state.buf.data;
+}
+#endif
+
+/*
+ * regular expression of pattern rule source statement:
+ * LIKE wildcards are captured and other characters
+ * are matched literally ('\' escapes next character).
+ */
+static char *pgqr_pattern_regex(int match, const char *source)
+{
+	StringInfoData	buf;
+	const char	*p;
+
+	if (match == PGQR_MATCH_REGEX)
+		return pstrdup(source);
+
+	initStringInfo(&buf);
+	for (p = source; *p != '\0'; p++)
+	{
+		if (*p == '%')
+			appendStringInfoString(&buf, "(.*)");
+		else if (*p == '_')
+			appendStringInfoString(&buf, "(.)");
+		else
+		{
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			if (!isalnum((unsigned char) *p) && !IS_HIGHBIT_SET(*p))
+				appendStringInfoChar(&buf, '\\');
+			appendStringInfoChar(&buf, *p);
+		}
+	}
+
+	return buf.data;
+}
+
+/*
+ * compile advanced regular expression:
+ * returns pg_regcomp status and sets message if not REG_OKAY.
+ */
+static int pgqr_regcomp(regex_t *re, const char *regex, char *message, size_t size)
+{
+	pg_wchar	*wregex;
+	int		wlen;
+	int		status;
+
+	wregex = (pg_wchar *) palloc((strlen(regex) + 1) * sizeof(pg_wchar));
+	wlen = pg_mb2wchar_with_len(regex, wregex, strlen(regex));
+	status = pg_regcomp(re, wregex, wlen, REG_ADVANCED, C_COLLATION_OID);
+	pfree(wregex);
+	if (status != REG_OKAY)
+		pg_regerror(status, re, message, size);
+
+	return status;
+}
+
+/*
+ * callback of pgqr_scan_captures for each \n of target statement
+ */
+typedef void (*pgqr_capture_callback) (int number, void *arg);
+
+/*
+ * scan \1 to \9 references to captured text in target statement
+ * of pattern rule: other characters are copied to buf if not NULL,
+ * \\ stands for a single backslash.
+ */
+static void pgqr_scan_captures(const char *target, pgqr_capture_callback callback,
+			       StringInfo buf, void *arg)
+{
+	const char	*p;
+
+	for (p = target; *p != '\0'; p++)
+	{
+		if (*p == '\\' && p[1] >= '1' && p[1] <= '9')
+			callback(*++p - '0', arg);
+		else
+		{
+			if (*p == '\\' && p[1] == '\\')
+				p++;
+			if (buf != NULL)
+				appendStringInfoChar(buf, *p);
+		}
+	}
+}
+
+static void pgqr_max_capture(int number, void *arg)
+{
+	int	*max = (int *) arg;
+
+	if (number > *max)
+		*max = number;
+}
+
+/*
+ * validate pattern rule: source pattern is compiled as it will be
+ * compiled with other pattern rules, and target statement can only
+ * use its capturing groups. Back references cannot be used because
+ * groups are renumbered in patterns automaton.
+ * Returns number of capturing groups of source pattern.
+ */
+static int pgqr_check_pattern(int match, const char *source, const char *target)
+{
+	regex_t		re;
+	char		message[100];
+	int		nsub;
+	int		max = 0;
+
+	if (pgqr_regcomp(&re, psprintf("^(?:(%s))$", pgqr_pattern_regex(match, source)),
+			 message, sizeof(message)) != REG_OKAY)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+			 errmsg("invalid regular expression: %s", message)));
+
+	nsub = (int) re.re_nsub - 1;
+	if (re.re_info & REG_UBACKREF)
+	{
+		pg_regfree(&re);
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("back references cannot be used in source pattern %s", source)));
+	}
+	pg_regfree(&re);
+
+	pgqr_scan_captures(target, pgqr_max_capture, NULL, &max);
+	if (max > nsub)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("reference \\%d of target statement has no matching group in source pattern",
+				max)));
+
+	return nsub;
+}
+
+/*
+ * target statement of matching pattern rule
+ */
+typedef struct pgqrCaptureState
+{
+	StringInfoData	buf;
+	const pg_wchar	*wquery;
+	regmatch_t	*groups;	/* outer group of rule followed by its groups */
+} pgqrCaptureState;
+
+static void pgqr_fill_capture(int number, void *arg)
+{
+	pgqrCaptureState	*state = (pgqrCaptureState *) arg;
+	regmatch_t		*group = &state->groups[number];
+	int			len;
+
+	/* group may not have participated in match */
+	if (group->rm_so < 0)
+		return;
+
+	len = group->rm_eo - group->rm_so;
+	enlargeStringInfo(&state->buf, len * pg_database_encoding_max_length() + 1);
+	state->buf.len += pg_wchar2mb_with_len(state->wquery + group->rm_so,
+					       state->buf.data + state->buf.len, len);
+}
+
+static char *pgqr_fill_captures(const char *target, const pg_wchar *wquery, regmatch_t *groups)
+{
+	pgqrCaptureState	state;
+
+	initStringInfo(&state.buf);
+	state.wquery = wquery;
+	state.groups = groups;
+
+	pgqr_scan_captures(target, pgqr_fill_capture, &state.buf, &state);
+
+	return state.buf.data;
+}
+
+/*
+ * query identifier of source statement for match = queryid rules:
+ * statement is analyzed as current statements will be analyzed.
+ * nplaceholders is set to the number of $n placeholders of 
+ * its normalized text.
+ */
+static uint64 pgqr_source_queryid(const char *source, int *nplaceholders)
+{
+#if PG_VERSION_NUM >= 140000
+	RawStmt		*raw;
+	ParseState	*pstate;
+	Query		*query;
+	Oid		*paramTypes = NULL;
+	int		numParams = 0;
+	JumbleState	*jstate;
+	int		nconsts;
+
+	raw = pgqr_parse_single(source, "source");
+
+	/*
+	 * source statement may use $n parameters: 
+	 * analyze it like a prepared statement without parameter types
+	 */
+	pstate = make_parsestate(NULL);
+	pstate->p_sourcetext = source;
+#if PG_VERSION_NUM >= 150000
+	setup_parse_variable_parameters(pstate, &paramTypes, &numParams);
+#else
+	parse_variable_parameters(pstate, &paramTypes, &numParams);
+#endif
+	query = transformTopLevelStmt(pstate, raw);
+	check_variable_parameters(pstate, query);
+#if PG_VERSION_NUM >= 160000
+	jstate = JumbleQuery(query);
+#else
+	jstate = JumbleQuery(query, source);
+#endif
+	free_parsestate(pstate);
+
+	pgqr_constants(jstate, source, &nconsts);
+	*nplaceholders = (jstate != NULL ? jstate->highest_extern_param_id : 0) + nconsts;
+
+	return query->queryId;
+#else
+	ereport(ERROR,
+		(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		 errmsg("rule options match=queryid and match=normalized require PostgreSQL 14 or later")));
+	return 0;
+#endif
+}
+
+/*
+ * relation kinds which can be read by SELECT queries
+ */
+static bool pgqr_readable_relkind(char relkind)
+{
+	return	relkind == RELKIND_RELATION ||
+		relkind == RELKIND_VIEW ||
+		relkind == RELKIND_MATVIEW ||
+		relkind == RELKIND_PARTITIONED_TABLE ||
+		relkind == RELKIND_FOREIGN_TABLE;
+}
+
+/*
+ * check that target relation can replace source relation in query
+ * trees: each column of source relation must have a column with the
+ * same number, name, type, type modifier and collation in target
+ * relation so that Vars remain valid. Relations must be locked.
+ * Raises an error if not compatible and error is true.
+ */
+static bool pgqr_check_relations(Oid source_oid, Oid target_oid, bool error)
+{
+	Relation	source_rel;
+	Relation	target_rel;
+	TupleDesc	source_desc;
+	TupleDesc	target_desc;
+	char		*column = NULL;
+	bool		compatible;
+	int		i;
+
+	source_rel = RelationIdGetRelation(source_oid);
+	target_rel = RelationIdGetRelation(target_oid);
+	compatible = (RelationIsValid(source_rel) && RelationIsValid(target_rel) &&
+		      pgqr_readable_relkind(source_rel->rd_rel->relkind) &&
+		      pgqr_readable_relkind(target_rel->rd_rel->relkind));
+
+	if (compatible)
+	{
+		source_desc = RelationGetDescr(source_rel);
+		target_desc = RelationGetDescr(target_rel);
+		for (i = 0; i < source_desc->natts; i++)
+		{
+			Form_pg_attribute	source_attr = TupleDescAttr(source_desc, i);
+			Form_pg_attribute	target_attr;
+
+			if (source_attr->attisdropped)
+				continue;
+			target_attr = (i < target_desc->natts ? TupleDescAttr(target_desc, i) : NULL);
+			if (	target_attr == NULL ||
+				target_attr->attisdropped ||
+				strcmp(NameStr(source_attr->attname), NameStr(target_attr->attname)) != 0 ||
+				source_attr->atttypid != target_attr->atttypid ||
+				source_attr->atttypmod != target_attr->atttypmod ||
+				source_attr->attcollation != target_attr->attcollation)
+			{
+				column = pstrdup(NameStr(source_attr->attname));
+				compatible = false;
+				break;
+			}
+		}
+	}
+
+	if (RelationIsValid(source_rel))
+		RelationClose(source_rel);
+	if (RelationIsValid(target_rel))
+		RelationClose(target_rel);
+
+	if (!compatible && error)
+	{
+		if (column != NULL)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("column \"%s\" of relation \"%s\" has no matching column in relation \"%s\"",
+					column, get_rel_name(source_oid), get_rel_name(target_oid)),
+				 errdetail("Target relation must have the same columns at the same positions.")));
+		ereport(ERROR,
+			(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+			 errmsg("relation \"%s\" cannot replace relation \"%s\"",
+				get_rel_name(target_oid), get_rel_name(source_oid))));
+	}
+
+	return compatible;
+}
+
+/*
+ * check that calls of source function can call target function:
+ * functions must have the same argument and result types.
+ * Raises an error if not compatible and error is true.
+ */
+static bool pgqr_check_functions(Oid source_oid, Oid target_oid, bool error)
+{
+	HeapTuple	source_tuple;
+	HeapTuple	target_tuple;
+	bool		compatible = false;
+
+	source_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(source_oid));
+	target_tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(target_oid));
+	if (HeapTupleIsValid(source_tuple) && HeapTupleIsValid(target_tuple))
+	{
+		Form_pg_proc	source_proc = (Form_pg_proc) GETSTRUCT(source_tuple);
+		Form_pg_proc	target_proc = (Form_pg_proc) GETSTRUCT(target_tuple);
+
+		compatible = (source_proc->prorettype == target_proc->prorettype &&
+			      source_proc->proretset == target_proc->proretset &&
+			      source_proc->pronargs == target_proc->pronargs &&
+			      memcmp(source_proc->proargtypes.values, target_proc->proargtypes.values,
+				     source_proc->pronargs * sizeof(Oid)) == 0 &&
+#if PG_VERSION_NUM >= 110000
+			      source_proc->prokind == PROKIND_FUNCTION &&
+			      target_proc->prokind == PROKIND_FUNCTION);
+#else
+			      !source_proc->proisagg && !source_proc->proiswindow &&
+			      !target_proc->proisagg && !target_proc->proiswindow);
+#endif
+	}
+	if (HeapTupleIsValid(source_tuple))
+		ReleaseSysCache(source_tuple);
+	if (HeapTupleIsValid(target_tuple))
+		ReleaseSysCache(target_tuple);
+
+	if (!compatible && error)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("function %s cannot replace function %s",
+				format_procedure(target_oid), format_procedure(source_oid)),
+			 errdetail("Functions must have the same argument and result types.")));
+
+	return compatible;
+}
+
+/*
+ * row count of limit rule target statement: 0 if invalid
+ */
+static int64 pgqr_limit_count(const char *target)
+{
+	char		*end;
+	long long	count;
+
+	errno = 0;
+	count = strtoll(target, &end, 10);
+	while (isspace((unsigned char) *end))
+		end++;
+	if (errno != 0 || end == target || *end != '\0' || count <= 0)
+		return 0;
+
+	return (int64) count;
+}
+
+/*
+ * resolve source and target objects of relation, function
+ * and limit rules in current database and check that target
+ * can replace source.
+ */
+static void pgqr_prepare_transform(pgqrNewRule *rule)
+{
+	if (rule->opts.match != PGQR_MATCH_TEXT)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("rule option \"match\" can only be used with rule option rewrite=statement or rewrite=settings")));
+
+	switch (rule->opts.rewrite)
+	{
+		case PGQR_REWRITE_RELATION:
+			rule->source_oid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+										CStringGetDatum(rule->source)));
+			rule->target_oid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+										CStringGetDatum(rule->target)));
+			LockRelationOid(rule->source_oid, AccessShareLock);
+			LockRelationOid(rule->target_oid, AccessShareLock);
+			pgqr_check_relations(rule->source_oid, rule->target_oid, true);
+			break;
+		case PGQR_REWRITE_FUNCTION:
+			rule->source_oid = DatumGetObjectId(DirectFunctionCall1(regprocedurein,
+										CStringGetDatum(rule->source)));
+			rule->target_oid = DatumGetObjectId(DirectFunctionCall1(regprocedurein,
+										CStringGetDatum(rule->target)));
+			pgqr_check_functions(rule->source_oid, rule->target_oid, true);
+			break;
+		case PGQR_REWRITE_LIMIT:
+			rule->source_oid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+										CStringGetDatum(rule->source)));
+			if (pgqr_limit_count(rule->target) == 0)
+				ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("target of rule option rewrite=limit must be a positive row count: %s",
+						rule->target)));
+			break;
+	}
+}
+
+/*
+ * check target of settings rule: list of parameters settable
+ * by any user. Backends split it into parameter names and values
+ * when they build their local copy of rules.
+ */
+static void pgqr_prepare_settings(pgqrNewRule *rule)
+{
+#if PG_VERSION_NUM >= 130000
+	int	nsettings = 0;
+
+	pgqr_parse_pairs(rule->target, "target settings", pgqr_check_setting, &nsettings);
+	if (nsettings == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("target of rule option rewrite=settings must set at least one parameter")));
+#else
+	/* statement text is not known by planner */
+	ereport(ERROR,
+		(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		 errmsg("rule option rewrite=settings requires PostgreSQL 13 or later")));
+#endif
+}
+
+/*
+ * resolve summary relation of rule: summary option of statement
+ * rules, target relation of relation rules. A freshness bound
+ * requires a summary relation.
+ */
+static void pgqr_prepare_summary(pgqrNewRule *rule)
+{
+	if (rule->opts.summary != NULL)
+	{
+		if (rule->opts.rewrite != PGQR_REWRITE_STATEMENT)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rule option \"summary\" can only be used with rule option rewrite=statement")));
+		rule->summary_oid = DatumGetObjectId(DirectFunctionCall1(regclassin,
+									 CStringGetDatum(rule->opts.summary)));
+	}
+	else if (rule->opts.rewrite == PGQR_REWRITE_RELATION)
+		rule->summary_oid = rule->target_oid;
+
+	if (rule->opts.max_age >= 0 && !OidIsValid(rule->summary_oid))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("rule option \"max_age\" requires rule option \"summary\" or rewrite=relation")));
+}
+
+/*
+ * validate rule and compute everything that does not
+ * depend on other rules: called without lock.
+ */
+static void pgqr_prepare_rule(pgqrNewRule *rule, char *source, char *target, pgqrRuleOptions *opts)
+{
+	int	nplaceholders = 0;
+
+	rule->source = source;
+	rule->target = target;
+	rule->source_len = strlen(source);
+	rule->target_len = strlen(target);
+	rule->opts = *opts;
+	rule->queryid = 0;
+	rule->nsub = 0;
+	rule->source_oid = InvalidOid;
+	rule->target_oid = InvalidOid;
+	rule->summary_oid = InvalidOid;
+	rule->role_oid = InvalidOid;
+	rule->schema_oid = InvalidOid;
+
+	if (pgqr_compare(rule->source_len, (uint64_t)pgqrMaxStmtLength, 0))
+		ereport(ERROR, (errmsg("Source statement length %zu is greater than %d", 
+                               rule->source_len, pgqrMaxStmtLength)));
+
+	if (pgqr_compare(rule->target_len, (uint64_t)pgqrMaxStmtLength, 0))
+		ereport(ERROR, (errmsg("Target statement length %zu is greater than %d", 
+                               rule->target_len, pgqrMaxStmtLength)));
+
+	rule->source_hash = pgqr_hash_stmt(source, rule->source_len);
+	if (PGQR_REWRITE_BY_OBJECT(opts->rewrite))
+		pgqr_prepare_transform(rule);
+	else if (PGQR_MATCH_BY_QUERYID(opts->match))
+		rule->queryid = pgqr_source_queryid(source, &nplaceholders);
+	else if (PGQR_MATCH_BY_PATTERN(opts->match))
+		rule->nsub = pgqr_check_pattern(opts->match, source, target);
+	/* target of pattern rules is only complete once captured text is filled */
+	if (opts->rewrite == PGQR_REWRITE_STATEMENT && !PGQR_MATCH_BY_PATTERN(opts->match))
+		(void) pgqr_parse_single(target, "target");
+	if (opts->rewrite == PGQR_REWRITE_SETTINGS)
+		pgqr_prepare_settings(rule);
+	pgqr_prepare_summary(rule);
+	if (opts->role != NULL)
+		rule->role_oid = get_role_oid(opts->role, false);
+	if (opts->schema != NULL)
+		rule->schema_oid = get_namespace_oid(opts->schema, false);
+	/* result of target statement must not depend on statement text */
+	if (opts->result_cache &&
+	    (opts->rewrite != PGQR_REWRITE_STATEMENT ||
+	     opts->match == PGQR_MATCH_NORMALIZED || PGQR_MATCH_BY_PATTERN(opts->match)))
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("rule option \"result_cache\" can only be used with rewrite=statement and match=text or match=queryid")));
+	/* only statement rules have an original and a rewritten variant */
+	if (opts->sample >= 0 && opts->rewrite != PGQR_REWRITE_STATEMENT)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("rule option \"sample\" can only be used with rewrite=statement")));
+#if PG_VERSION_NUM >= 140000
+	if (opts->match == PGQR_MATCH_NORMALIZED && opts->rewrite == PGQR_REWRITE_STATEMENT)
+	{
+		int	max = 0;
+
+		pgqr_scan_placeholders(target, pgqr_max_placeholder, &max);
+		if (max > nplaceholders)
+			ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("placeholder $%d of target statement has no matching constant or parameter in source statement",
+					max)));
+	}
+#endif
+}
+
+static void pgqr_new_rule_scope(pgqrNewRule *rule, pgqrScope *scope)
+{
+	scope->role_oid = rule->role_oid;
+	scope->application_name = (rule->opts.application_name != NULL ? rule->opts.application_name : "");
+	scope->schema_oid = rule->schema_oid;
+}
+
+/*
+ * look up match = queryid rule for query identifier
+ * in current database with scope
+ */
+static bool pgqr_queryid_exists(uint64 queryid, const pgqrScope *scope)
+{
+	int	i;
+
+	for (i = 0; i < pgqr->nslots; i++)
+	{
+		pgqrSharedItem	*rule = pgqr_rule(i);
+
+		if (	rule->dbid == MyDatabaseId &&
+			PGQR_MATCH_BY_QUERYID(rule->match) &&
+			rule->queryid == queryid &&
+			pgqr_same_scope(rule, scope))
+			return true;
+	}
+
+	return false;
+}
+
+static void pgqr_duplicate_error(pgqrNewRule *rule, bool queryid)
+{
+	if (queryid)
+		ereport(ERROR, (errmsg("rule already exists for query identifier " INT64_FORMAT " of %s",
+				       (int64) rule->queryid, rule->source)));
+	ereport(ERROR, (errmsg("rule already exists for %s", rule->source)));
+}
+
+static bool pgqr_add_rule_internal(char *source, char *target, pgqrRuleOptions *opts)
+{
+
+	pgqrNewRule	new_rule;
+	pgqrScope	scope;
+
+	pgqr_prepare_rule(&new_rule, source, target, opts);
+	pgqr_new_rule_scope(&new_rule, &scope);
+
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	if (!pgqr->loaded)
+		pgqr_load_rules();
+
+	if (pgqr->current_rule_number >= pgqrMaxRules)
+	{
+		LWLockRelease(pgqr->lock);
+		ereport(ERROR, (errmsg("Maximum rule number is reached %d", pgqrMaxRules)));
+	}
+
+	if (pgqr_find_rule(MyDatabaseId, source, new_rule.source_hash, &scope) != PGQR_NO_RULE)
+	{
+		LWLockRelease(pgqr->lock);
+		pgqr_duplicate_error(&new_rule, false);
+	}
+
+	if (PGQR_MATCH_BY_QUERYID(opts->match) && pgqr_queryid_exists(new_rule.queryid, &scope))
+	{
+		LWLockRelease(pgqr->lock);
+		pgqr_duplicate_error(&new_rule, true);
+	}
+
+	if (pgqr_insert_rule(MyDatabaseId, &new_rule) == PGQR_NO_RULE)
+	{
+		LWLockRelease(pgqr->lock);
+		ereport(ERROR,
+			(errcode(ERRCODE_OUT_OF_MEMORY),
+			 errmsg("out of shared memory for rule %s", source)));
+	}
+	pgqr_bump_generation(MyDatabaseId);
+	pgqr_rules_changed();
+
+	LWLockRelease(pgqr->lock);	
+	
+	return true;
+
+}
+
+/*
+ * pgqr_add_rule
+ *
+ * SQL-callable function to add a SQL translation rule
+ *
+ */
+Datum pgqr_add_rule(PG_FUNCTION_ARGS)
+{
+
+ 	 char  *source;
+         char  *target;
+	 char  *options = NULL;
+	 pgqrRuleOptions opts;
+
+         source = PG_GETARG_CSTRING(0);
+         target = PG_GETARG_CSTRING(1);
+	 if (PG_NARGS() > 2)
+		 options = PG_GETARG_CSTRING(2);
+         elog(LOG, "pgqr_add_rule source=%s target=%s options=%s", source, target,
+	      options != NULL ? options : "");
+
+	 pgqr_parse_options(options, &opts);
+
+         PG_RETURN_BOOL(pgqr_add_rule_internal(source, target, &opts));	
+
+}
+
+static int pgqr_new_rule_scope_cmp(const pgqrNewRule *l, const pgqrNewRule *r)
+{
+	if (l->role_oid != r->role_oid)
+		return (l->role_oid < r->role_oid) ? -1 : 1;
+	if (l->schema_oid != r->schema_oid)
+		return (l->schema_oid < r->schema_oid) ? -1 : 1;
+	return strcmp(l->opts.application_name != NULL ? l->opts.application_name : "",
+		      r->opts.application_name != NULL ? r->opts.application_name : "");
+}
+
+static int pgqr_new_rule_cmp(const void *a, const void *b)
+{
+	const pgqrNewRule	*l = *(const pgqrNewRule * const *) a;
+	const pgqrNewRule	*r = *(const pgqrNewRule * const *) b;
+	int			cmp;
+
+	if (l->source_hash != r->source_hash)
+		return (l->source_hash < r->source_hash) ? -1 : 1;
+	cmp = strcmp(l->source, r->source);
+	if (cmp != 0)
+		return cmp;
+	return pgqr_new_rule_scope_cmp(l, r);
+}
+
+static int pgqr_new_queryid_cmp(const void *a, const void *b)
+{
+	const pgqrNewRule	*l = *(const pgqrNewRule * const *) a;
+	const pgqrNewRule	*r = *(const pgqrNewRule * const *) b;
+
+	if (l->queryid != r->queryid)
+		return (l->queryid < r->queryid) ? -1 : 1;
+	return pgqr_new_rule_scope_cmp(l, r);
+}
+
+static int pgqr_queryid_cmp(const void *a, const void *b)
+{
+	uint64	l = *(const uint64 *) a;
+	uint64	r = *(const uint64 *) b;
+
+	if (l < r)
+		return -1;
+	else if (l > r)
+		return 1;
+	return 0;
+}
+
+/*
+ * check that new rules do not duplicate each other: 
+ * called without lock, O(n log n).
+ */
+static void pgqr_check_new_rules(pgqrNewRule *rules, int n)
+{
+	pgqrNewRule	**sorted;
+	pgqrNewRule	**queryids;
+	int		nqueryids = 0;
+	int		i;
+
+	if (n < 2)
+		return;
+
+	sorted = (pgqrNewRule **) palloc(n * sizeof(pgqrNewRule *));
+	queryids = (pgqrNewRule **) palloc(n * sizeof(pgqrNewRule *));
+	for (i = 0; i < n; i++)
+	{
+		sorted[i] = &rules[i];
+		if (PGQR_MATCH_BY_QUERYID(rules[i].opts.match))
+			queryids[nqueryids++] = &rules[i];
+	}
+
+	qsort(sorted, n, sizeof(pgqrNewRule *), pgqr_new_rule_cmp);
+	for (i = 1; i < n; i++)
+		if (pgqr_new_rule_cmp(&sorted[i - 1], &sorted[i]) == 0)
+			pgqr_duplicate_error(sorted[i], false);
+
+	qsort(queryids, nqueryids, sizeof(pgqrNewRule *), pgqr_new_queryid_cmp);
+	for (i = 1; i < nqueryids; i++)
+		if (pgqr_new_queryid_cmp(&queryids[i - 1], &queryids[i]) == 0)
+			ereport(ERROR, (errmsg("rule already exists for query identifier " INT64_FORMAT,
+					       (int64) queryids[i]->queryid)));
+
+	pfree(sorted);
+	pfree(queryids);
+}
+
+/*
+ * add all rules or none: rules are validated before taking
+ * pgqr->lock, then inserted while holding pgqr->lock in exclusive
+ * mode with a single generation change so that backends see
+ * either all or none of them. If replace is true, previous rules
+ * of current database are removed in the same step.
+ * Returns number of added rules.
+ */
+static int pgqr_add_rules_internal(pgqrNewRule *rules, int n, bool replace)
+{
+	int	*old_slots;
+	int	nold = 0;
+	int	*new_slots;
+	int	i;
+	uint64	*queryids = NULL;
+	int	nqueryids = 0;
+
+	pgqr_check_new_rules(rules, n);
+
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	if (!pgqr->loaded)
+		pgqr_load_rules();
+	pgqr_attach_area();
+
+	/* existing rules of current database */
+	old_slots = (int *) palloc(Max(pgqr->current_rule_number, 1) * sizeof(int));
+	new_slots = (int *) palloc(Max(n, 1) * sizeof(int));
+	for (i = 0; i < pgqr->nslots; i++)
+		if (pgqr_rule(i)->dbid == MyDatabaseId)
+			old_slots[nold++] = i;
+
+	if (pgqr->current_rule_number - (replace ? nold : 0) + n > pgqrMaxRules)
+	{
+		LWLockRelease(pgqr->lock);
+		ereport(ERROR, (errmsg("Maximum rule number is reached %d", pgqrMaxRules)));
+	}
+
+	if (!replace)
+	{
+		queryids = (uint64 *) palloc(Max(nold, 1) * sizeof(uint64));
+		for (i = 0; i < nold; i++)
+		{
+			pgqrSharedItem	*rule = pgqr_rule(old_slots[i]);
+
+			if (PGQR_MATCH_BY_QUERYID(rule->match))
+				queryids[nqueryids++] = rule->queryid;
+		}
+		qsort(queryids, nqueryids, sizeof(uint64), pgqr_queryid_cmp);
+
+		for (i = 0; i < n; i++)
+		{
+			pgqrScope	scope;
+			bool		queryid_exists;
+
+			/* existing query identifiers are checked with scope only if found */
+			pgqr_new_rule_scope(&rules[i], &scope);
+			queryid_exists = (PGQR_MATCH_BY_QUERYID(rules[i].opts.match) &&
+					  bsearch(&rules[i].queryid, queryids, nqueryids, 
+						  sizeof(uint64), pgqr_queryid_cmp) != NULL &&
+					  pgqr_queryid_exists(rules[i].queryid, &scope));
+			if (	queryid_exists ||
+				pgqr_find_rule(MyDatabaseId, rules[i].source, rules[i].source_hash, &scope) != PGQR_NO_RULE)
+			{
+				LWLockRelease(pgqr->lock);
+				pgqr_duplicate_error(&rules[i], queryid_exists);
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		new_slots[i] = pgqr_insert_rule(MyDatabaseId, &rules[i]);
+		if (new_slots[i] == PGQR_NO_RULE)
+		{
+			int	j;
+
+			/* roll back: nothing has been published yet */
+			for (j = 0; j < i; j++)
+				pgqr_delete_rule(new_slots[j]);
+			LWLockRelease(pgqr->lock);
+			ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of shared memory for rule %s", rules[i].source)));
+		}
+	}
+
+	if (replace)
+		for (i = 0; i < nold; i++)
+			pgqr_delete_rule(old_slots[i]);
+
+	pgqr_bump_generation(MyDatabaseId);
+	pgqr_rules_changed();
+
+	LWLockRelease(pgqr->lock);
+
+	pfree(old_slots);
+	pfree(new_slots);
+	if (queryids != NULL)
+		pfree(queryids);
+
+	return n;
+}
+
+/*
+ * pgqr_add_rules
+ *
+ * SQL-callable function to add a set of SQL translation rules
+ * given as a two-dimensional text array of source, target and
+ * optional options.
+ *
+ */
+Datum pgqr_add_rules(PG_FUNCTION_ARGS)
+{
+	ArrayType	*array = PG_GETARG_ARRAYTYPE_P(0);
+	bool		replace = PG_GETARG_BOOL(1);
+	Datum		*elems;
+	bool		*nulls;
+	int		nelems;
+	int		ncols = 0;
+	int		n;
+	int		i;
+	pgqrNewRule	*rules;
+
+	if (ARR_NDIM(array) == 2)
+		ncols = ARR_DIMS(array)[1];
+	if (!(ARR_NDIM(array) == 0 || (ARR_NDIM(array) == 2 && (ncols == 2 || ncols == 3))))
+		ereport(ERROR,
+			(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+			 errmsg("rules must be a two-dimensional array of source, target and optional options")));
+
+	deconstruct_array(array, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+	n = (ncols > 0 ? nelems / ncols : 0);
+	elog(LOG, "pgqr_add_rules rules=%d replace=%s", n, replace ? "true" : "false");
+
+	rules = (pgqrNewRule *) palloc(Max(n, 1) * sizeof(pgqrNewRule));
+	for (i = 0; i < n; i++)
+	{
+		pgqrRuleOptions	opts;
+		Datum		*row = &elems[i * ncols];
+		bool		*rownulls = &nulls[i * ncols];
+
+		if (rownulls[0] || rownulls[1])
+			ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("source and target statements of rule %d must not be null", i + 1)));
+		pgqr_parse_options((ncols == 3 && !rownulls[2]) ? TextDatumGetCString(row[2]) : NULL,
+				   &opts);
+		pgqr_prepare_rule(&rules[i], TextDatumGetCString(row[0]), TextDatumGetCString(row[1]), &opts);
+	}
+
+	PG_RETURN_INT32(pgqr_add_rules_internal(rules, n, replace));
+}
+
+
+/*
+ * remove rules of source statement in all scopes
+ */
+static bool pgqr_remove_rule_internal(char *source)
+{
+
+	int	i;
+	uint32	source_hash = pgqr_hash_stmt(source, strlen(source));
+
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	if (!pgqr->loaded)
+		pgqr_load_rules();
+
+	i = pgqr_find_rule(MyDatabaseId, source, source_hash, NULL);
+	if (i == PGQR_NO_RULE)
+	{
+		LWLockRelease(pgqr->lock);	
+		ereport(ERROR, (errmsg("Rule for %s not found", source)));		
+	}
+
+	while (i != PGQR_NO_RULE)
+	{
+		pgqr_delete_rule(i);
+		i = pgqr_find_rule(MyDatabaseId, source, source_hash, NULL);
+	}
+	pgqr_bump_generation(MyDatabaseId);
+	pgqr_rules_changed();
+
+	LWLockRelease(pgqr->lock);	
+	
+	return true;
+
+}
+
+/*
+ * pgqr_remove_rule
+ *
+ * SQL-callable function to remove a SQL translation rule
+ *
+ */
+Datum pgqr_remove_rule(PG_FUNCTION_ARGS)
+{
+
+ 	 char  *source;
+
+         source = PG_GETARG_CSTRING(0);
+         elog(LOG, "pgqr_remove_rule source=%s", source);
+
+         PG_RETURN_BOOL(pgqr_remove_rule_internal(source));	
+
+}
+
+
+static bool pgqr_truncate_internal()
+{
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	/* rules are not loaded from file only to be removed */
+	pgqr->loaded = true;
+
+	pgqr_clear_rules();
+	pgqr_bump_generation(InvalidOid);
+	pgqr_rules_changed();
+
+	LWLockRelease(pgqr->lock);	
+
+	return true;
+}
+
+/*
+ *  pgqr_truncate
+ *  
+ *  SQL-callable function to remove all SQL translation rules
+ * 
+ */
+Datum pgqr_truncate(PG_FUNCTION_ARGS)
+{
+
+         elog(LOG, "pgqr_truncate_rule");
+
+         PG_RETURN_BOOL(pgqr_truncate_internal());
+
+}
+
+
+/*
+ * catalog invalidation callbacks
+ */
+static void pgqr_relcache_callback(Datum arg, Oid relid)
+{
+	pgqr_catalog_epoch++;
+}
+
+static void pgqr_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	pgqr_catalog_epoch++;
+}
+
+/*
+ * register catalog invalidation callbacks for analyzed target
+ * statements: same catalogs as plan cache.
+ */
+static void pgqr_register_invalidation(void)
+{
+	CacheRegisterRelcacheCallback(pgqr_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(PROCOID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(OPEROID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(AMOPOPID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNSERVEROID, pgqr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(FOREIGNDATAWRAPPEROID, pgqr_syscache_callback, (Datum) 0);
+}
+
+/*
+ * add backend statistics to shared counters
+ */
+static void pgqr_flush_stats(void)
+{
+	if (pgqr_pending_stats.lookups == 0)
+		return;
+
+	pg_atomic_fetch_add_u64(&pgqr->stat_lookups, pgqr_pending_stats.lookups);
+	if (pgqr_pending_stats.rewrites > 0)
+		pg_atomic_fetch_add_u64(&pgqr->stat_rewrites, pgqr_pending_stats.rewrites);
+	if (pgqr_pending_stats.cache_hits > 0)
+		pg_atomic_fetch_add_u64(&pgqr->stat_cache_hits, pgqr_pending_stats.cache_hits);
+	if (pgqr_pending_stats.lookup_time > 0)
+		pg_atomic_fetch_add_u64(&pgqr->stat_lookup_time, pgqr_pending_stats.lookup_time);
+	if (pgqr_pending_stats.analyze_time > 0)
+		pg_atomic_fetch_add_u64(&pgqr->stat_analyze_time, pgqr_pending_stats.analyze_time);
+	MemSet(&pgqr_pending_stats, 0, sizeof(pgqrStats));
+}
+
+static void pgqr_flush_stats_callback(int code, Datum arg)
+{
+	if (pgqr != NULL)
+		pgqr_flush_stats();
+}
+
+/*
+ * relations written by current transaction: cached results
+ * reading them are purged after commit. All results of current
+ * database are purged if too many relations or a relation 
+ * which cannot be identified have been written.
+ */
+static Oid	pgqr_written[PGQR_RESULT_MAX_WRITTEN];
+static int	pgqr_written_number = 0;
+static bool	pgqr_written_all = false;
+static TransactionId	pgqr_written_xid = InvalidTransactionId;
+
+/*
+ * result cache state of the top-level SELECT statement
+ * being run, allocated in its executor memory
+ */
+typedef struct pgqrResultState
+{
+	QueryDesc	*queryDesc;
+	int		slot;
+	uint64		epoch;		/* result epoch read at executor start */
+	char		*key;
+	Size		key_len;
+	uint32		hash;
+	int		nrelations;
+	Oid		*relations;
+	bool		started;	/* ExecutorRun has been called */
+	/* cached result found at executor start */
+	bool		hit;
+	uint64		ntuples;
+	char		*tuples;
+} pgqrResultState;
+
+static pgqrResultState	*pgqr_result = NULL;
+
+/*
+ * top-level execution being measured of a plan marked with
+ * a rule having sample option and the variant of the plan
+ */
+typedef struct pgqrSample
+{
+	int		slot;		/* PGQR_NO_RULE if none */
+	uint32		generation;	/* of local copy of rules holding rule */
+	int		variant;	/* PGQR_VARIANT_xxx */
+	QueryDesc	*queryDesc;
+	instr_time	start;
+} pgqrSample;
+
+static pgqrSample	pgqr_sample_running = {PGQR_NO_RULE};
+
+/*
+ * cached result: allocated in rules area as a single chunk holding
+ * the entry followed by its key, the relations read by its plan 
+ * (with their partition ancestors, as rows inserted into a partitioned
+ * table are not written to the partitions read by the plan) and its
+ * MinimalTuples, each MAXALIGNed.
+ */
+typedef struct pgqrResultEntry
+{
+	dsa_pointer	next;		/* next entry in same hash bucket */
+	dsa_pointer	lru_prev;	/* more recently used entry */
+	dsa_pointer	lru_next;	/* less recently used entry */
+	Oid		dbid;
+	uint32		hash;		/* hash of key */
+	Size		size;		/* chunk size */
+	Size		key_len;
+	int		nrelations;
+	uint64		ntuples;
+	Size		tuples_len;
+} pgqrResultEntry;
+
+#define	PGQR_RESULT_ENTRY(dp)		((pgqrResultEntry *) dsa_get_address(pgqr_area, (dp)))
+#define	PGQR_RESULT_BUCKET_ARRAY()	((dsa_pointer *) dsa_get_address(pgqr_area, pgqr->result_buckets))
+#define	PGQR_RESULT_KEY(e)		((char *) (e) + MAXALIGN(sizeof(pgqrResultEntry)))
+#define	PGQR_RESULT_RELATIONS(e)	((Oid *) (PGQR_RESULT_KEY(e) + MAXALIGN((e)->key_len)))
+#define	PGQR_RESULT_TUPLES(e)		((char *) PGQR_RESULT_RELATIONS(e) + MAXALIGN((e)->nrelations * sizeof(Oid)))
+
+/*
+ * remember relation written by current transaction,
+ * InvalidOid if any relation may have been written
+ */
+static void pgqr_result_written(Oid relid)
+{
+	int	i;
+
+	if (pgqr_written_all)
+		return;
+	if (!OidIsValid(relid) || pgqr_written_number == PGQR_RESULT_MAX_WRITTEN)
+	{
+		pgqr_written_all = true;
+		return;
+	}
+	for (i = 0; i < pgqr_written_number; i++)
+		if (pgqr_written[i] == relid)
+			return;
+	pgqr_written[pgqr_written_number++] = relid;
+}
+
+/*
+ * bit of relation in result_relations bitmap
+ */
+static inline uint32 pgqr_result_bit(Oid dbid, Oid relid)
+{
+	return DatumGetUInt32(hash_uint32((uint32) relid ^ (uint32) dbid)) % PGQR_RESULT_REL_BITS;
+}
+
+/*
+ * unlink entry from LRU list: caller must hold result_lock
+ * in exclusive mode, as for all following functions.
+ */
+static void pgqr_result_lru_unlink(pgqrResultEntry *entry)
+{
+	if (DsaPointerIsValid(entry->lru_prev))
+		PGQR_RESULT_ENTRY(entry->lru_prev)->lru_next = entry->lru_next;
+	else
+		pgqr->result_lru_head = entry->lru_next;
+	if (DsaPointerIsValid(entry->lru_next))
+		PGQR_RESULT_ENTRY(entry->lru_next)->lru_prev = entry->lru_prev;
+	else
+		pgqr->result_lru_tail = entry->lru_prev;
+}
+
+/*
+ * link entry at head of LRU list
+ */
+static void pgqr_result_lru_push(dsa_pointer dp)
+{
+	pgqrResultEntry	*entry = PGQR_RESULT_ENTRY(dp);
+
+	entry->lru_prev = InvalidDsaPointer;
+	entry->lru_next = pgqr->result_lru_head;
+	if (DsaPointerIsValid(pgqr->result_lru_head))
+		PGQR_RESULT_ENTRY(pgqr->result_lru_head)->lru_prev = dp;
+	else
+		pgqr->result_lru_tail = dp;
+	pgqr->result_lru_head = dp;
+}
+
+/*
+ * look up entry by key: returns InvalidDsaPointer if not found
+ */
+static dsa_pointer pgqr_result_find(uint32 hash, const char *key, Size key_len)
+{
+	dsa_pointer	dp;
+
+	if (!DsaPointerIsValid(pgqr->result_buckets))
+		return InvalidDsaPointer;
+
+	for (dp = PGQR_RESULT_BUCKET_ARRAY()[hash % PGQR_RESULT_BUCKETS];
+	     DsaPointerIsValid(dp);
+	     dp = PGQR_RESULT_ENTRY(dp)->next)
+	{
+		pgqrResultEntry	*entry = PGQR_RESULT_ENTRY(dp);
+
+		if (entry->hash == hash && entry->key_len == key_len &&
+		    memcmp(PGQR_RESULT_KEY(entry), key, key_len) == 0)
+			return dp;
+	}
+
+	return InvalidDsaPointer;
+}
+
+/*
+ * remove entry from result cache and free it
+ */
+static void pgqr_result_remove(dsa_pointer dp)
+{
+	pgqrResultEntry	*entry = PGQR_RESULT_ENTRY(dp);
+	dsa_pointer	*prev = &PGQR_RESULT_BUCKET_ARRAY()[entry->hash % PGQR_RESULT_BUCKETS];
+	int		i;
+
+	while (*prev != dp)
+		prev = &PGQR_RESULT_ENTRY(*prev)->next;
+	*prev = entry->next;
+	pgqr_result_lru_unlink(entry);
+	pgqr->result_used -= entry->size;
+	pgqr->result_entries--;
+	dsa_free(pgqr_area, dp);
+
+	/* bitmap is only cleared when no result can depend on it */
+	if (pgqr->result_entries == 0)
+		for (i = 0; i < PGQR_RESULT_REL_BITS / 32; i++)
+			pg_atomic_write_u32(&pgqr->result_relations[i], 0);
+}
+
+/*
+ * remove results of database dbid (all databases if InvalidOid)
+ * reading one of relations (all results if relations is NULL)
+ */
+static void pgqr_result_purge(Oid dbid, Oid *relations, int nrelations)
+{
+	dsa_pointer	dp = pgqr->result_lru_head;
+
+	while (DsaPointerIsValid(dp))
+	{
+		pgqrResultEntry	*entry = PGQR_RESULT_ENTRY(dp);
+		dsa_pointer	next = entry->lru_next;
+		bool		purge = (relations == NULL);
+		int		i;
+		int		j;
+
+		if (OidIsValid(dbid) && entry->dbid != dbid)
+			purge = false;
+		else
+			for (i = 0; i < entry->nrelations && !purge; i++)
+				for (j = 0; j < nrelations && !purge; j++)
+					purge = (PGQR_RESULT_RELATIONS(entry)[i] == relations[j]);
+		if (purge)
+			pgqr_result_remove(dp);
+		dp = next;
+	}
+}
+
+/*
+ * invalidate results which may have been changed by committed
+ * transaction: epoch is bumped first so that a result computed
+ * with a snapshot taken before commit is either not stored or
+ * stored before its relations are checked here and purged.
+ * A transaction without identifier (COMMIT PREPARED) is recorded
+ * with next transaction identifier, which is only visible to
+ * snapshots taken after commit.
+ */
+static void pgqr_result_invalidate(void)
+{
+	TransactionId	xid = pgqr_written_xid;
+	TransactionId	evicted;
+	uint64		epoch;
+	bool		purge = pgqr_written_all;
+	int		i;
+
+	if (!TransactionIdIsValid(xid))
+#if PG_VERSION_NUM >= 140000
+		xid = ReadNextTransactionId();
+#else
+		xid = ReadNewTransactionId();
+#endif
+
+	SpinLockAcquire(&pgqr->result_mutex);
+	epoch = pg_atomic_read_u64(&pgqr->result_epoch) + 1;
+	evicted = pgqr->result_writers[epoch % PGQR_RESULT_WRITERS];
+	if (	TransactionIdIsValid(evicted) &&
+		(!TransactionIdIsValid(pgqr->result_evicted) ||
+		 TransactionIdFollows(evicted, pgqr->result_evicted)))
+		pgqr->result_evicted = evicted;
+	pgqr->result_writers[epoch % PGQR_RESULT_WRITERS] = xid;
+	pg_atomic_write_u64(&pgqr->result_epoch, epoch);
+	SpinLockRelease(&pgqr->result_mutex);
+
+	for (i = 0; i < pgqr_written_number && !purge; i++)
+	{
+		uint32	bit = pgqr_result_bit(MyDatabaseId, pgqr_written[i]);
+
+		purge = (pg_atomic_read_u32(&pgqr->result_relations[bit / 32]) & (1U << (bit % 32))) != 0;
+	}
+	if (!purge || pgqr_area == NULL)
+		return;
+
+	LWLockAcquire(pgqr->result_lock, LW_EXCLUSIVE);
+	pgqr_result_purge(MyDatabaseId, pgqr_written_all ? NULL : pgqr_written, pgqr_written_number);
+	LWLockRelease(pgqr->result_lock);
+}
+
+/*
+ * record relations written by a plan
+ */
+static void pgqr_result_plan_written(PlannedStmt *stmt)
+{
+	ListCell	*lc;
+
+	if (stmt->commandType == CMD_SELECT && !stmt->hasModifyingCTE)
+		return;
+
+	foreach(lc, stmt->resultRelations)
+		pgqr_result_written(rt_fetch(lfirst_int(lc), stmt->rtable)->relid);
+#if PG_VERSION_NUM < 140000
+	foreach(lc, stmt->rootResultRelations)
+		pgqr_result_written(rt_fetch(lfirst_int(lc), stmt->rtable)->relid);
+#endif
+}
+
+/*
+ * record relations written by a utility statement: statements
+ * which cannot change data of existing relations are ignored,
+ * other statements (DDL) may change the result of any statement.
+ */
+static void pgqr_result_utility_written(Node *parsetree)
+{
+	Oid	relid;
+
+	switch (nodeTag(parsetree))
+	{
+		case T_CopyStmt:
+			if (!((CopyStmt *) parsetree)->is_from)
+				break;
+			relid = RangeVarGetRelid(((CopyStmt *) parsetree)->relation, NoLock, true);
+			if (OidIsValid(relid))
+				pgqr_result_written(relid);
+			break;
+		case T_RefreshMatViewStmt:
+			relid = RangeVarGetRelid(((RefreshMatViewStmt *) parsetree)->relation, NoLock, true);
+			if (OidIsValid(relid))
+				pgqr_result_written(relid);
+			break;
+		case T_TransactionStmt:
+			/* data written by prepared transaction are now visible */
+			if (((TransactionStmt *) parsetree)->kind == TRANS_STMT_COMMIT_PREPARED)
+				pgqr_result_written(InvalidOid);
+			break;
+		case T_ExplainStmt:
+		case T_PrepareStmt:
+		case T_ExecuteStmt:
+		case T_DeallocateStmt:
+		case T_DeclareCursorStmt:
+		case T_FetchStmt:
+		case T_ClosePortalStmt:
+		case T_VariableSetStmt:
+		case T_VariableShowStmt:
+		case T_DiscardStmt:
+		case T_NotifyStmt:
+		case T_ListenStmt:
+		case T_UnlistenStmt:
+		case T_LockStmt:
+		case T_ConstraintsSetStmt:
+		case T_CheckPointStmt:
+		case T_LoadStmt:
+		case T_VacuumStmt:
+		case T_ClusterStmt:
+		case T_ReindexStmt:
+		case T_DoStmt:
+#if PG_VERSION_NUM >= 110000
+		case T_CallStmt:
+#endif
+		case T_CreateStmt:
+		case T_CreateTableAsStmt:
+		case T_CreateSeqStmt:
+		case T_IndexStmt:
+			break;
+		default:
+			pgqr_result_written(InvalidOid);
+			break;
+	}
+}
+
+/*
+ * purge results depending on relations written by current transaction
+ * after commit. Rules area is attached at pre-commit so that nothing
+ * can fail after commit. Executor state of result cache is reset at
+ * transaction end.
+ */
+static void pgqr_result_xact(XactEvent event)
+{
+	bool	written;
+
+	/*
+	 * logical replication workers apply changes without executor start
+	 * and utility hooks: any relation may have been written
+	 */
+	if (	event == XACT_EVENT_PRE_COMMIT &&
+		MyLogicalRepWorker != NULL &&
+		TransactionIdIsValid(GetTopTransactionIdIfAny()))
+		pgqr_result_written(InvalidOid);
+
+	written = (pgqr_written_number > 0 || pgqr_written_all);
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			pgqr_written_xid = GetTopTransactionIdIfAny();
+			if (written && pgqr_area == NULL && pgqr->area_handle != DSA_HANDLE_INVALID)
+			{
+				LWLockAcquire(pgqr->lock, LW_SHARED);
+				pgqr_attach_area();
+				LWLockRelease(pgqr->lock);
+			}
+			return;
+		case XACT_EVENT_COMMIT:
+			if (written && pg_atomic_read_u32(&pgqr->result_rules) > 0)
+				pgqr_result_invalidate();
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			break;
+		default:
+			return;
+	}
+	pgqr_written_number = 0;
+	pgqr_written_all = false;
+	pgqr_written_xid = InvalidTransactionId;
+	pgqr_result = NULL;
+}
+
+/*
+ * summary relations refreshed by current transaction: their rules
+ * are marked as refreshed at commit, with transaction start time
+ * as summary data are at least as recent.
+ */
+typedef struct pgqrRefreshed
+{
+	Oid			relid;
+	SubTransactionId	subid;
+} pgqrRefreshed;
+
+static pgqrRefreshed	*pgqr_refreshed = NULL;
+static int		pgqr_refreshed_number = 0;
+static int		pgqr_refreshed_size = 0;
+
+/*
+ * remember summary relation refreshed by current transaction
+ */
+static void pgqr_summary_refreshed(Oid relid)
+{
+	if (pgqr_refreshed == NULL)
+	{
+		pgqr_refreshed_size = 8;
+		pgqr_refreshed = (pgqrRefreshed *) MemoryContextAlloc(TopMemoryContext,
+								     pgqr_refreshed_size * sizeof(pgqrRefreshed));
+	}
+	else if (pgqr_refreshed_number == pgqr_refreshed_size)
+	{
+		pgqr_refreshed_size *= 2;
+		pgqr_refreshed = (pgqrRefreshed *) repalloc(pgqr_refreshed,
+							    pgqr_refreshed_size * sizeof(pgqrRefreshed));
+	}
+	pgqr_refreshed[pgqr_refreshed_number].relid = relid;
+	pgqr_refreshed[pgqr_refreshed_number].subid = GetCurrentSubTransactionId();
+	pgqr_refreshed_number++;
+}
+
+/*
+ * set refresh time of rules whose summary has been refreshed by
+ * committed transaction: slots are scanned under shared lock and
+ * refresh time is written atomically. Rules area is attached at
+ * pre-commit so that nothing can fail after commit.
+ */
+static void pgqr_xact_callback(XactEvent event, void *arg)
+{
+	TimestampTz	refreshed;
+	int		i;
+	int		j;
+
+	pgqr_result_xact(event);
+	pgqr_save_xact(event);
+
+	if (pgqr_refreshed_number == 0)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			pgqr_ensure_loaded();
+			LWLockAcquire(pgqr->lock, LW_SHARED);
+			pgqr_attach_area();
+			LWLockRelease(pgqr->lock);
+			return;
+		case XACT_EVENT_COMMIT:
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+			pgqr_refreshed_number = 0;
+			return;
+		default:
+			return;
+	}
+
+	refreshed = GetCurrentTransactionStartTimestamp();
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+	if (pgqr_area != NULL)
+		for (i = 0; i < pgqr->nslots; i++)
+		{
+			pgqrSharedItem	*rule = pgqr_rule(i);
+
+			if (rule->dbid != MyDatabaseId || !OidIsValid(rule->summary_oid))
+				continue;
+			for (j = 0; j < pgqr_refreshed_number; j++)
+				if (pgqr_refreshed[j].relid == rule->summary_oid)
+				{
+					pg_atomic_write_u64(&rule->refreshed, (uint64) refreshed);
+					break;
+				}
+		}
+	LWLockRelease(pgqr->lock);
+	pgqr_refreshed_number = 0;
+}
+
+/*
+ * forget summaries refreshed by aborted subtransaction
+ * and executor state of result cache
+ */
+static void pgqr_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				  SubTransactionId parentSubid, void *arg)
+{
+	int	i;
+	int	n = 0;
+
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		pgqr_result = NULL;
+
+	for (i = 0; i < pgqr_refreshed_number; i++)
+	{
+		if (pgqr_refreshed[i].subid != mySubid)
+			pgqr_refreshed[n++] = pgqr_refreshed[i];
+		else if (event == SUBXACT_EVENT_COMMIT_SUB)
+		{
+			pgqr_refreshed[i].subid = parentSubid;
+			pgqr_refreshed[n++] = pgqr_refreshed[i];
+		}
+		else if (event != SUBXACT_EVENT_ABORT_SUB)
+			pgqr_refreshed[n++] = pgqr_refreshed[i];
+	}
+	pgqr_refreshed_number = n;
+}
+
+/*
+ * nanoseconds elapsed since start
+ */
+static uint64 pgqr_elapsed(instr_time start)
+{
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	return (uint64) (INSTR_TIME_GET_DOUBLE(duration) * 1000000000.0);
+}
+
+/*
+ * uniform random number in [0, 1) drawing sampled executions
+ */
+static double pgqr_random(void)
+{
+#if PG_VERSION_NUM >= 150000
+	return pg_prng_double(&pg_global_prng_state);
+#else
+	return (double) random() / ((double) PG_INT32_MAX + 1.0);
+#endif
+}
+
+/*
+ * order of transformation rules: lowest slot first for same source object
+ */
+static int pgqr_transform_cmp(const void *a, const void *b)
+{
+	const pgqrLocalRule	*l = *(const pgqrLocalRule * const *) a;
+	const pgqrLocalRule	*r = *(const pgqrLocalRule * const *) b;
+
+	if (l->rewrite != r->rewrite)
+		return (l->rewrite < r->rewrite) ? -1 : 1;
+	if (l->source_oid != r->source_oid)
+		return (l->source_oid < r->source_oid) ? -1 : 1;
+	return (l->slot < r->slot) ? -1 : (l->slot > r->slot);
+}
+
+/*
+ * compile pattern rules of backend local copy into a single
+ * automaton ^(?:(p1)|(p2)|...)$ so that matching a statement
+ * scans its text once whatever the number of pattern rules:
+ * outer group of each rule is followed by the groups of its
+ * own pattern. Pattern rules are ignored if automaton cannot
+ * be compiled: they are only used once compiled.
+ */
+static void pgqr_compile_patterns(int npatterns)
+{
+	StringInfoData	buf;
+	char		message[100];
+	int		group = 1;
+	int		i;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, "^(?:");
+	for (i = 0; i < npatterns; i++)
+	{
+		pgqrLocalRule	*rule = pgqr_local.pattern_rules[i];
+
+		if (i > 0)
+			appendStringInfoChar(&buf, '|');
+		appendStringInfo(&buf, "(%s)", pgqr_pattern_regex(rule->match, rule->source_stmt));
+		rule->pattern_group = group;
+		group += rule->nsub + 1;
+	}
+	appendStringInfoString(&buf, ")$");
+
+	if (pgqr_regcomp(&pgqr_local.patterns, buf.data, message, sizeof(message)) == REG_OKAY)
+		pgqr_local.pattern_rule_number = npatterns;
+	else
+		ereport(WARNING,
+			(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+			 errmsg("pg_query_rewrite: pattern rules are ignored: %s", message)));
+	pfree(buf.data);
+}
+
+/*
+ * scopes used by shared rule
+ */
+static inline uint32 pgqr_rule_scopes(pgqrSharedItem *item)
+{
+	return	(OidIsValid(item->role_oid) ? PGQR_SCOPE_ROLE : 0) |
+		(item->application_name[0] != '\0' ? PGQR_SCOPE_APPLICATION : 0) |
+		(OidIsValid(item->schema_oid) ? PGQR_SCOPE_SCHEMA : 0);
+}
+
+/*
+ * check that shared rule applies to session scope
+ * of local copy of rules
+ */
+static inline bool pgqr_in_session_scope(pgqrSharedItem *item)
+{
+	return	(!OidIsValid(item->role_oid) || item->role_oid == pgqr_local.scope_role) &&
+		(!OidIsValid(item->schema_oid) || item->schema_oid == pgqr_local.scope_schema) &&
+		(item->application_name[0] == '\0' ||
+		 strcmp(item->application_name, pgqr_local.scope_application_name) == 0);
+}
+
+/*
+ * check that session scope has not changed since local copy of rules
+ * has been built: only scopes used by rules of current database are
+ * checked, search path change is detected by its generation number
+ * (PostgreSQL 13 or later).
+ */
+static bool pgqr_scope_matches(void)
+{
+	if (pgqr_local.scopes == 0)
+		return true;
+
+	if (	(pgqr_local.scopes & PGQR_SCOPE_ROLE) != 0 &&
+		GetOuterUserId() != pgqr_local.scope_role)
+		return false;
+	if (	(pgqr_local.scopes & PGQR_SCOPE_APPLICATION) != 0 &&
+		strcmp(application_name != NULL ? application_name : "",
+		       pgqr_local.scope_application_name) != 0)
+		return false;
+	if (	(pgqr_local.scopes & PGQR_SCOPE_SCHEMA) != 0 &&
+		!pgqr_search_path_matches(pgqr_local.scope_search_path))
+		return false;
+
+	return true;
+}
+
+/*
+ * number of scope options of rule
+ */
+static inline int pgqr_scope_count(uint32 scopes)
+{
+	return	((scopes & PGQR_SCOPE_ROLE) != 0) +
+		((scopes & PGQR_SCOPE_APPLICATION) != 0) +
+		((scopes & PGQR_SCOPE_SCHEMA) != 0);
+}
+
+/*
+ * insert rule into hash bucket chain of local copy: rules of
+ * the same source statement in several scopes of the session
+ * are chained from the most specific scope to the least specific
+ * one, so that lookup finds the most specific rule first.
+ */
+static void pgqr_chain_rule(pgqrLocalRule **bucket, pgqrLocalRule *rule)
+{
+	int	count = pgqr_scope_count(rule->scopes);
+
+	while (*bucket != NULL && pgqr_scope_count((*bucket)->scopes) > count)
+		bucket = &(*bucket)->next;
+	rule->next = *bucket;
+	*bucket = rule;
+}
+
+/*
+ * rebuild backend local copy of current database rules
+ * if shared rules or session scope have changed since last copy.
+ */
+static void pgqr_refresh_local_rules(void)
+{
+	uint32		generation;
+	int		i;
+	int		npatterns = 0;
+	int		ntransforms = 0;
+	int		nresults = 0;
+	int		nsettings = 0;
+	int		nsamples = 0;
+	int		nsummaries = 0;
+	bool		schema_scope;
+	List		*search_path;
+	MemoryContext	oldcontext;
+
+	generation = pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]);
+	if (pgqr_local.valid && pgqr_local.generation == generation && pgqr_scope_matches())
+		return;
+
+	elog(DEBUG1, "pg_query_rewrite: pgqr_refresh_local_rules: generation=%u", generation);
+
+	if (pgqr_local.context == NULL)
+	{
+		pgqr_local.context = AllocSetContextCreate(TopMemoryContext,
+							   "pg_query_rewrite rules",
+							   ALLOCSET_DEFAULT_MINSIZE,
+							   ALLOCSET_DEFAULT_INITSIZE,
+							   ALLOCSET_DEFAULT_MAXSIZE);
+		pgqr_register_invalidation();
+		before_shmem_exit(pgqr_flush_stats_callback, (Datum) 0);
+	}
+	else
+	{
+		if (pgqr_local.pattern_rule_number > 0)
+			pg_regfree(&pgqr_local.patterns);
+		MemoryContextReset(pgqr_local.context);
+	}
+	/* search path is only read if rules used schema scope last time */
+	schema_scope = ((pgqr_local.scopes & PGQR_SCOPE_SCHEMA) != 0);
+	pgqr_local.valid = false;
+	pgqr_local.rule_number = 0;
+	pgqr_local.nbuckets = 0;
+	pgqr_local.buckets = NULL;
+	pgqr_local.queryid_rule_number = 0;
+	pgqr_local.queryid_nbuckets = 0;
+	pgqr_local.queryid_buckets = NULL;
+	pgqr_local.nested = false;
+	pgqr_local.commands = 0;
+	pgqr_local.pattern_rule_number = 0;
+	pgqr_local.pattern_rules = NULL;
+	pgqr_local.transform_rule_number = 0;
+	pgqr_local.transform_rules = NULL;
+	pgqr_local.result_rule_number = 0;
+	pgqr_local.result_rules = NULL;
+	pgqr_local.settings_rule_number = 0;
+	pgqr_local.settings_rules = NULL;
+	pgqr_local.summary_rule_number = 0;
+	pgqr_local.summary_rules = NULL;
+	pgqr_local.sample_rule_number = 0;
+	pgqr_local.sample_rules = NULL;
+
+	pgqr_ensure_loaded();
+
+	oldcontext = MemoryContextSwitchTo(pgqr_local.context);
+
+	/*
+	 * session scope is computed before taking lock as it reads catalogs:
+	 * search path is read again after lock release if a rule using
+	 * schema scope is found
+	 */
+	pgqr_local.scope_role = GetOuterUserId();
+	pgqr_local.scope_application_name = pstrdup(application_name != NULL ? application_name : "");
+	pgqr_local.scope_search_path = NULL;
+	pgqr_local.scope_schema = InvalidOid;
+
+retry:
+	if (schema_scope && pgqr_local.scope_search_path == NULL)
+	{
+		pgqr_local.scope_search_path = pgqr_get_search_path(pgqr_local.context);
+		search_path = fetch_search_path(false);
+		pgqr_local.scope_schema = (search_path != NIL ? linitial_oid(search_path) : InvalidOid);
+		list_free(search_path);
+	}
+	pgqr_local.scopes = 0;
+	pgqr_local.rule_number = 0;
+	pgqr_local.queryid_rule_number = 0;
+	npatterns = 0;
+	ntransforms = 0;
+	nresults = 0;
+	nsettings = 0;
+	nsamples = 0;
+	nsummaries = 0;
+
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+
+	/* generation cannot change while lock is held */
+	generation = pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]);
+	pgqr_attach_area();
+
+	for (i = 0; i < pgqr->nslots; i++)
+		if (pgqr_rule(i)->dbid == MyDatabaseId)
+		{
+			pgqr_local.scopes |= pgqr_rule_scopes(pgqr_rule(i));
+			if ((pgqr_local.scopes & PGQR_SCOPE_SCHEMA) != 0 && !schema_scope)
+			{
+				LWLockRelease(pgqr->lock);
+				schema_scope = true;
+				goto retry;
+			}
+			if (!pgqr_in_session_scope(pgqr_rule(i)))
+				continue;
+			if (pgqr_rule(i)->result_cache)
+				nresults++;
+			if (pgqr_rule(i)->rewrite == PGQR_REWRITE_SETTINGS)
+				nsettings++;
+			if (pgqr_rule(i)->max_age >= 0)
+				nsummaries++;
+			if (pgqr_rule(i)->sample >= 0)
+				nsamples++;
+			if (PGQR_REWRITE_BY_OBJECT(pgqr_rule(i)->rewrite))
+				ntransforms++;
+			else if (PGQR_MATCH_BY_QUERYID(pgqr_rule(i)->match))
+				pgqr_local.queryid_rule_number++;
+			else if (PGQR_MATCH_BY_PATTERN(pgqr_rule(i)->match))
+				npatterns++;
+			else
+				pgqr_local.rule_number++;
+		}
+
+	pgqr_local.nbuckets = 1;
+	while (pgqr_local.nbuckets < 2 * pgqr_local.rule_number)
+		pgqr_local.nbuckets <<= 1;
+	pgqr_local.buckets = (pgqrLocalRule **)palloc0(pgqr_local.nbuckets * sizeof(pgqrLocalRule *));
+	pgqr_local.queryid_nbuckets = 1;
+	while (pgqr_local.queryid_nbuckets < 2 * pgqr_local.queryid_rule_number)
+		pgqr_local.queryid_nbuckets <<= 1;
+	pgqr_local.queryid_buckets = (pgqrLocalRule **)palloc0(pgqr_local.queryid_nbuckets * sizeof(pgqrLocalRule *));
+	pgqr_local.pattern_rules = (pgqrLocalRule **)palloc(Max(npatterns, 1) * sizeof(pgqrLocalRule *));
+	npatterns = 0;
+	pgqr_local.transform_rules = (pgqrLocalRule **)palloc(Max(ntransforms, 1) * sizeof(pgqrLocalRule *));
+	pgqr_local.result_rules = (pgqrLocalRule **)palloc(Max(nresults, 1) * sizeof(pgqrLocalRule *));
+	pgqr_local.settings_rules = (pgqrLocalRule **)palloc(Max(nsettings, 1) * sizeof(pgqrLocalRule *));
+	pgqr_local.summary_rules = (pgqrLocalRule **)palloc(Max(nsummaries, 1) * sizeof(pgqrLocalRule *));
+	pgqr_local.sample_rules = (pgqrLocalRule **)palloc(Max(nsamples, 1) * sizeof(pgqrLocalRule *));
+
+	for (i = 0; i < pgqr->nslots; i++)
+	{
+		pgqrSharedItem	*item = pgqr_rule(i);
+		pgqrLocalRule	*rule;
+		int		b;
+
+		if (item->dbid != MyDatabaseId || !pgqr_in_session_scope(item))
+			continue;
+
+		rule = (pgqrLocalRule *)palloc(sizeof(pgqrLocalRule));
+		rule->source_hash = item->source_hash;
+		rule->match = item->match;
+		rule->nested = item->nested;
+		rule->commands = item->commands;
+		rule->queryid = item->queryid;
+		rule->source_stmt = pstrdup(PGQR_STMT(item->source_stmt));
+		rule->source_len = item->source_len;
+		rule->target_stmt = pstrdup(PGQR_STMT(item->target_stmt));
+		rule->target_params = (strchr(rule->target_stmt, '$') != NULL);
+		rule->target_captures = (PGQR_MATCH_BY_PATTERN(rule->match) &&
+					 item->rewrite == PGQR_REWRITE_STATEMENT &&
+					 strchr(rule->target_stmt, '\\') != NULL);
+		rule->slot = i;
+		rule->next = NULL;
+		rule->nsub = item->nsub;
+		rule->pattern_group = 0;
+		rule->rewrite = item->rewrite;
+		rule->source_oid = item->source_oid;
+		rule->target_oid = item->target_oid;
+		rule->limit_count = (rule->rewrite == PGQR_REWRITE_LIMIT ? pgqr_limit_count(rule->target_stmt) : 0);
+		rule->checked = false;
+		rule->compatible = false;
+		rule->checked_epoch = 0;
+		rule->max_age = item->max_age;
+		rule->result_cache = item->result_cache;
+		rule->sample = item->sample;
+		rule->created = item->created;
+		rule->scope.role_oid = item->role_oid;
+		rule->scope.application_name = pstrdup(item->application_name);
+		rule->scope.schema_oid = item->schema_oid;
+		rule->scopes = pgqr_rule_scopes(item);
+		rule->target_raw = NULL;
+		rule->target_context = NULL;
+		rule->target_query = NULL;
+		rule->target_epoch = 0;
+		rule->target_search_path = NULL;
+		rule->target_nparams = 0;
+		rule->target_paramtypes = NULL;
+		rule->setting_names = NIL;
+		rule->setting_values = NIL;
+		pgqr_local.nested |= rule->nested;
+		pgqr_local.commands |= rule->commands;
+		if (rule->result_cache)
+			pgqr_local.result_rules[pgqr_local.result_rule_number++] = rule;
+		if (rule->max_age >= 0)
+			pgqr_local.summary_rules[pgqr_local.summary_rule_number++] = rule;
+		if (rule->sample >= 0)
+			pgqr_local.sample_rules[pgqr_local.sample_rule_number++] = rule;
+		if (rule->rewrite == PGQR_REWRITE_SETTINGS)
+		{
+			pgqr_parse_pairs(rule->target_stmt, "target settings", pgqr_add_setting, rule);
+			pgqr_local.settings_rules[pgqr_local.settings_rule_number++] = rule;
+		}
+		if (PGQR_REWRITE_BY_OBJECT(rule->rewrite))
+			pgqr_local.transform_rules[pgqr_local.transform_rule_number++] = rule;
+		else if (PGQR_MATCH_BY_QUERYID(rule->match))
+		{
+			b = (int)(rule->queryid & (pgqr_local.queryid_nbuckets - 1));
+			pgqr_chain_rule(&pgqr_local.queryid_buckets[b], rule);
+		}
+		else if (PGQR_MATCH_BY_PATTERN(rule->match))
+			pgqr_local.pattern_rules[npatterns++] = rule;
+		else
+		{
+			b = rule->source_hash & (pgqr_local.nbuckets - 1);
+			pgqr_chain_rule(&pgqr_local.buckets[b], rule);
+		}
+	}
+
+	LWLockRelease(pgqr->lock);
+
+	if (npatterns > 0)
+		pgqr_compile_patterns(npatterns);
+	qsort(pgqr_local.transform_rules, pgqr_local.transform_rule_number,
+	      sizeof(pgqrLocalRule *), pgqr_transform_cmp);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgqr_local.generation = generation;
+	pgqr_local.valid = true;
+}
+
+/*
+ * query identifier of current statement: computed by core
+ * when compute_query_id is enabled, otherwise computed here
+ * only because match = queryid rules exist.
+ */
+static uint64 pgqr_query_id(Query *query, const char *current_query_source)
+{
+	uint64	queryid = query->queryId;
+
+#if PG_VERSION_NUM >= 140000
+	if (queryid == 0)
+	{
+#if PG_VERSION_NUM >= 160000
+		JumbleQuery(query);
+#else
+		JumbleQuery(query, current_query_source);
+#endif
+		queryid = query->queryId;
+		/* do not change what core has decided */
+		query->queryId = 0;
+	}
+#endif
+
+	return queryid;
+}
+
+/*
+ * check rule scope for current statement
+ */
+static inline bool pgqr_in_scope(pgqrLocalRule *rule, Query *query)
+{
+	return	(pgqr_nesting_level == 0 || rule->nested) &&
+		(rule->commands & PGQR_COMMAND(query->commandType)) != 0;
+}
+
+/*
+ * check that summary relation of rule has been refreshed within its
+ * freshness bound before current statement start: refresh time is
+ * read without lock from rule slot, which still holds the same rule
+ * unless rules generation has changed. Otherwise rule does not apply
+ * and statement falls back to source relations.
+ */
+static bool pgqr_fresh(pgqrLocalRule *rule)
+{
+	uint64	refreshed;
+
+	if (rule->max_age < 0)
+		return true;
+	if (pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]) != pgqr_local.generation)
+		return false;
+
+	refreshed = pg_atomic_read_u64(&pgqr_rule(rule->slot)->refreshed);
+	return	refreshed != 0 &&
+		(TimestampTz) refreshed >= GetCurrentStatementStartTimestamp() - rule->max_age;
+}
+
+/*
+ * match current statement with patterns automaton: when several
+ * pattern rules match, first one by slot order is used.
+ * Target statement of matching rule using captured text is
+ * built into pgqr_pattern_target.
+ */
+static bool pgqr_match_patterns(const char *stmt, int len, Query *query, pgqrLocalRule **rule)
+{
+	pg_wchar	*wquery;
+	int		wlen;
+	size_t		ngroups = pgqr_local.patterns.re_nsub + 1;
+	regmatch_t	*groups;
+	int		status;
+	char		message[100];
+	int		i;
+	bool		found = false;
+
+	wquery = (pg_wchar *) palloc((len + 1) * sizeof(pg_wchar));
+	wlen = pg_mb2wchar_with_len(stmt, wquery, len);
+	groups = (regmatch_t *) palloc(ngroups * sizeof(regmatch_t));
+
+	status = pg_regexec(&pgqr_local.patterns, wquery, wlen, 0, NULL, ngroups, groups, 0);
+	if (status == REG_OKAY)
+	{
+		for (i = 0; i < pgqr_local.pattern_rule_number; i++)
+		{
+			pgqrLocalRule	*r = pgqr_local.pattern_rules[i];
+
+			if (groups[r->pattern_group].rm_so < 0)
+				continue;
+			if (pgqr_in_scope(r, query) && pgqr_fresh(r))
+			{
+				if (r->target_captures)
+					pgqr_pattern_target = pgqr_fill_captures(r->target_stmt, wquery,
+										 &groups[r->pattern_group]);
+				*rule = r;
+				found = true;
+			}
+			break;
+		}
+	}
+	else if (status != REG_NOMATCH)
+	{
+		pg_regerror(status, &pgqr_local.patterns, message, sizeof(message));
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+			 errmsg("regular expression failed: %s", message)));
+	}
+
+	pfree(wquery);
+	pfree(groups);
+
+	return found;
+}
+
+/*
+ * text of current statement in query string, which holds several
+ * statements when they are sent in a single simple query message:
+ * white space following the previous statement is skipped and
+ * terminating semicolon is kept, so that each statement can be
+ * compared with rule source statements. First statement of string
+ * starts at its beginning, like a single statement.
+ * Statement is not copied: its length is set into len.
+ */
+static const char *pgqr_stmt_text(const char *query_string, Query *query, int *len)
+{
+	const char	*stmt = query_string;
+	int		stmt_len;
+
+	/* location is unknown for some nested statements */
+	if (query->stmt_location < 0)
+	{
+		*len = strlen(query_string);
+		return query_string;
+	}
+
+	stmt += query->stmt_location;
+	/* length is 0 for last statement of string: rest of string */
+	if (query->stmt_len == 0)
+		stmt_len = strlen(stmt);
+	else
+	{
+		int	end = query->stmt_len;
+
+		stmt_len = end;
+		while (stmt[end] != '\0' && scanner_isspace(stmt[end]))
+			end++;
+		if (stmt[end] == ';')
+			stmt_len = end + 1;
+	}
+	if (query->stmt_location > 0)
+		while (stmt_len > 0 && scanner_isspace(*stmt))
+		{
+			stmt++;
+			stmt_len--;
+		}
+
+	*len = stmt_len;
+	return stmt;
+}
+
+/*
+ * look up rule matching current statement in backend local copy
+ * of rules: text rules are checked before match = queryid 
+ * and match = normalized rules, pattern rules are checked last.
+ */
+static bool pgqr_lookup_rule(const char *current_query_source, Query *query, pgqrLocalRule **rule)
+{
+	const char	*stmt;
+	int		stmt_len;
+	uint32		source_hash;
+	uint64		queryid;
+	pgqrLocalRule	*r;
+
+	stmt = pgqr_stmt_text(current_query_source, query, &stmt_len);
+
+	if (pgqr_local.rule_number > 0)
+	{
+		source_hash = pgqr_hash_stmt(stmt, stmt_len);
+		for (r = pgqr_local.buckets[source_hash & (pgqr_local.nbuckets - 1)]; r != NULL; r = r->next)
+		{
+			if (	r->source_hash == source_hash &&
+				pgqr_in_scope(r, query) &&
+				r->source_len == stmt_len &&
+				memcmp(stmt, r->source_stmt, stmt_len) == 0 &&
+				pgqr_fresh(r))
+			{
+				*rule = r;
+				return true;
+			}
+		}
+	}
+
+	if (pgqr_local.queryid_rule_number > 0)
+	{
+		queryid = pgqr_query_id(query, current_query_source);
+		for (r = pgqr_local.queryid_buckets[queryid & (pgqr_local.queryid_nbuckets - 1)]; r != NULL; r = r->next)
+		{
+			if (r->queryid == queryid && pgqr_in_scope(r, query) && pgqr_fresh(r))
+			{
+				*rule = r;
+				return true;
+			}
+		}
+	}
+
+	if (pgqr_local.pattern_rule_number > 0)
+		return pgqr_match_patterns(stmt, stmt_len, query, rule);
+
+	return false;
+}
+
+/*
+ * check if the current query needs to be rewritten:
+ * returns true if must be rewritten, otherwise false;
+ * rule is set to the matching rule in backend local copy.
+ *
+ * Lookup costs one atomic read of rule count of current database
+ * stripe if there is no rule in current database, otherwise 
+ * one atomic read of rules generation, one hash computation and
+ * one bucket probe in backend local memory: no lock is taken 
+ * unless rules have changed. Pattern rules add one scan of 
+ * statement text by patterns automaton.
+ * Only statements of databases having rules in scope
+ * are counted in lookup statistics.
+ */
+static bool pgqr_check_rewrite(const char *current_query_source, Query *query, pgqrLocalRule **rule) 
+{
+	instr_time	start;
+	bool		found;
+
+	/*
+ 	 * To be checked: possible recursion issue ?
+	 */
+
+	*rule = NULL;
+	pgqr_pattern_target = NULL;
+
+	/* rules dump file may not have been loaded yet */
+	if (pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) == 0 && pgqr->loaded)
+		return false;
+
+	pgqr_refresh_local_rules();
+
+	/* no rule applies to this nesting level or command type */
+	if (	(pgqr_nesting_level > 0 && !pgqr_local.nested) ||
+		(pgqr_local.commands & PGQR_COMMAND(query->commandType)) == 0)
+		return false;
+
+	if (pgqrTrackTiming)
+		INSTR_TIME_SET_CURRENT(start);
+
+	found = pgqr_lookup_rule(current_query_source, query, rule);
+
+	if (pgqrTrackTiming)
+		pgqr_pending_stats.lookup_time += pgqr_elapsed(start);
+	pgqr_pending_stats.lookups++;
+
+	/*
+	 * settings rules are applied by planner and executor hooks:
+	 * rule is still set for analysis hook to mark the query
+	 */
+	return found && (*rule)->rewrite == PGQR_REWRITE_STATEMENT;
+}
+
+/*
+ * first relation, function or limit rule for source object:
+ * rules are sorted by rewrite mode, source object and slot.
+ */
+static int pgqr_find_transform(int rewrite, Oid source_oid)
+{
+	int	low = 0;
+	int	high = pgqr_local.transform_rule_number;
+
+	while (low < high)
+	{
+		int		mid = (low + high) / 2;
+		pgqrLocalRule	*r = pgqr_local.transform_rules[mid];
+
+		if (r->rewrite < rewrite || (r->rewrite == rewrite && r->source_oid < source_oid))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * check that target of relation or function rule can still replace
+ * its source: checked again only after a catalog invalidation.
+ * Relations must be locked.
+ */
+static bool pgqr_transform_compatible(pgqrLocalRule *rule)
+{
+	if (rule->checked && rule->checked_epoch == pgqr_catalog_epoch)
+		return rule->compatible;
+
+	switch (rule->rewrite)
+	{
+		case PGQR_REWRITE_RELATION:
+			rule->compatible = pgqr_check_relations(rule->source_oid, rule->target_oid, false);
+			break;
+		case PGQR_REWRITE_FUNCTION:
+			rule->compatible = pgqr_check_functions(rule->source_oid, rule->target_oid, false);
+			break;
+		default:
+			rule->compatible = (rule->limit_count > 0);
+			break;
+	}
+	rule->checked = true;
+	rule->checked_epoch = pgqr_catalog_epoch;
+
+	return rule->compatible;
+}
+
+typedef struct pgqrTransformState
+{
+	Query	*statement;	/* top-level query of current statement */
+	List	*applied;	/* rules applied to current statement */
+} pgqrTransformState;
+
+/*
+ * rule in scope of current statement whose target can replace source
+ * object: lowest slot wins when several rules have the same source.
+ * Target relation of relation rule is locked before being checked.
+ */
+static pgqrLocalRule *pgqr_transform_rule(int rewrite, Oid source_oid, RangeTblEntry *rte,
+					  pgqrTransformState *state)
+{
+	int	i;
+
+	for (i = pgqr_find_transform(rewrite, source_oid); i < pgqr_local.transform_rule_number; i++)
+	{
+		pgqrLocalRule	*r = pgqr_local.transform_rules[i];
+
+		if (r->rewrite != rewrite || r->source_oid != source_oid)
+			break;
+		if (!pgqr_in_scope(r, state->statement) || !pgqr_fresh(r))
+			continue;
+		if (rewrite == PGQR_REWRITE_RELATION)
+#if PG_VERSION_NUM >= 120000
+			LockRelationOid(r->target_oid, rte->rellockmode);
+#else
+			LockRelationOid(r->target_oid, AccessShareLock);
+#endif
+		if (!pgqr_transform_compatible(r))
+			continue;
+		return r;
+	}
+
+	return NULL;
+}
+
+/*
+ * rewrite count of each rule is incremented once per statement
+ */
+static void pgqr_transform_applied(pgqrLocalRule *rule, pgqrTransformState *state)
+{
+	if (!list_member_ptr(state->applied, rule))
+		state->applied = lappend(state->applied, rule);
+}
+
+static bool pgqr_transform_walker(Node *node, pgqrTransformState *state);
+
+/*
+ * apply relation and limit rules to range table of query and
+ * function rules to its expressions. Only relations read by
+ * SELECT queries without row locks are replaced, and a LIMIT is
+ * only added to the top-level query of a SELECT statement without
+ * LIMIT: smallest row count of limit rules of its relations is used.
+ */
+static void pgqr_transform_query(Query *query, pgqrTransformState *state, bool top_level)
+{
+	ListCell	*lc;
+	pgqrLocalRule	*limit_rule = NULL;
+
+	if (query->commandType == CMD_SELECT && query->rowMarks == NIL)
+	{
+		foreach(lc, query->rtable)
+		{
+			RangeTblEntry	*rte = (RangeTblEntry *) lfirst(lc);
+			pgqrLocalRule	*rule;
+
+			if (rte->rtekind != RTE_RELATION)
+				continue;
+
+			if (top_level && query->limitCount == NULL &&
+			    (rule = pgqr_transform_rule(PGQR_REWRITE_LIMIT, rte->relid, rte, state)) != NULL &&
+			    (limit_rule == NULL || rule->limit_count < limit_rule->limit_count))
+				limit_rule = rule;
+
+			if ((rule = pgqr_transform_rule(PGQR_REWRITE_RELATION, rte->relid, rte, state)) != NULL)
+			{
+				elog(DEBUG1, "pg_query_rewrite: pgqr_transform_query: relation %u replaced by %u",
+				     rte->relid, rule->target_oid);
+#if PG_VERSION_NUM >= 160000
+				if (rte->perminfoindex != 0)
+					getRTEPermissionInfo(query->rteperminfos, rte)->relid = rule->target_oid;
+#endif
+				rte->relid = rule->target_oid;
+				rte->relkind = get_rel_relkind(rule->target_oid);
+				pgqr_transform_applied(rule, state);
+			}
+		}
+	}
+
+	if (limit_rule != NULL)
+	{
+		query->limitCount = (Node *) makeConst(INT8OID, -1, InvalidOid, sizeof(int64),
+						       Int64GetDatum(limit_rule->limit_count), false,
+						       FLOAT8PASSBYVAL);
+#if PG_VERSION_NUM >= 130000
+		query->limitOption = LIMIT_OPTION_COUNT;
+#endif
+		pgqr_transform_applied(limit_rule, state);
+	}
+
+	query_tree_walker(query, pgqr_transform_walker, (void *) state, 0);
+}
+
+static bool pgqr_transform_walker(Node *node, pgqrTransformState *state)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, FuncExpr))
+	{
+		FuncExpr	*func = (FuncExpr *) node;
+		pgqrLocalRule	*rule;
+
+		if ((rule = pgqr_transform_rule(PGQR_REWRITE_FUNCTION, func->funcid, NULL, state)) != NULL)
+		{
+			func->funcid = rule->target_oid;
+			pgqr_transform_applied(rule, state);
+		}
+		/* fall through to process function arguments */
+	}
+	if (IsA(node, Query))
+	{
+		pgqr_transform_query((Query *) node, state, false);
+		return false;
+	}
+	return expression_tree_walker(node, pgqr_transform_walker, (void *) state);
+}
+
+/*
+ * apply relation, function and limit rules to analyzed query of
+ * current statement, whether it has been rewritten or not: the
+ * query tree is modified in place without parsing any text.
+ * Returns applied rules having a freshness bound.
+ */
+static List *pgqr_transform(Query *query)
+{
+	pgqrTransformState	state;
+	List			*summaries = NIL;
+	ListCell		*lc;
+
+	if (pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) == 0 && pgqr->loaded)
+		return NIL;
+
+	pgqr_refresh_local_rules();
+
+	if (pgqr_local.transform_rule_number == 0 || query->commandType == CMD_UTILITY)
+		return NIL;
+
+	state.statement = query;
+	state.applied = NIL;
+	pgqr_transform_query(query, &state, true);
+
+	foreach(lc, state.applied)
+	{
+		pgqrLocalRule	*rule = (pgqrLocalRule *) lfirst(lc);
+
+		pgqr_incr_rewrite_count(rule);
+		if (rule->max_age >= 0)
+			summaries = lappend(summaries, rule);
+	}
+	if (state.applied != NIL && !statement_rewritten)
+		pgqr_pending_stats.rewrites++;
+	list_free(state.applied);
+
+	return summaries;
+}
+
+static void pgqr_clone_Query(Query *source, Query *target)
+{
+	target->type = source->type;
+	target->commandType = source->commandType;
+	target->querySource = source->querySource;
+	target->queryId = source->queryId;
+	target->canSetTag = source->canSetTag;
+	target->utilityStmt = source->utilityStmt;
+	target->resultRelation = source->resultRelation;
+	target->hasAggs = source->hasAggs;
+	target->hasWindowFuncs = source->hasWindowFuncs;
+	target->hasTargetSRFs = source->hasTargetSRFs;
+	target->hasSubLinks = source->hasSubLinks;
+	target->hasDistinctOn = source->hasDistinctOn;
+	target->hasRecursive = source->hasRecursive;
+	target->hasModifyingCTE = source->hasModifyingCTE;
+	target->hasForUpdate = source->hasForUpdate;
+	target->hasRowSecurity = source->hasRowSecurity;
+#if PG_VERSION_NUM >= 140000
+	target->isReturn = source->isReturn;
+#endif
+	target->cteList = source->cteList;
+	target->rtable = source->rtable;
+#if PG_VERSION_NUM >= 160000
+	target->rteperminfos = source->rteperminfos;
+#endif
+	target->jointree = source->jointree;
+	target->targetList = source->targetList;
+	target->override = source->override;
+	target->onConflict = source->onConflict;
+	target->returningList = source->returningList;
+#if PG_VERSION_NUM >= 150000
+	target->mergeActionList = source->mergeActionList;
+#endif
+	target->groupClause = source->groupClause;
+#if PG_VERSION_NUM >= 140000
+	target->groupDistinct = source->groupDistinct;
+#endif
+	target->groupingSets = source->groupingSets;
+	target->havingQual = source->havingQual;
+	target->windowClause = source->windowClause;
+	target->distinctClause= source->distinctClause;
+	target->sortClause= source->sortClause;
+	target->limitOffset= source->limitOffset;
+	target->limitCount= source->limitCount;
+#if PG_VERSION_NUM > 130000 
+	target->limitOption = source->limitOption;
+#endif
+	target->rowMarks= source->rowMarks;
+	target->setOperations= source->setOperations;
+	target->constraintDeps= source->constraintDeps;
+	target->withCheckOptions = source->withCheckOptions;
+#if PG_VERSION_NUM > 140000 
+	target->limitOption = source->limitOption;
+#endif
+	target->stmt_location=source->stmt_location;
+	target->stmt_len=source->stmt_len;
+
+}
+
+static void pgqr_clone_ParseState(ParseState *source, ParseState *target)
+{
+	target->parentParseState = source->parentParseState;
+	target->p_sourcetext = source->p_sourcetext;
+	target->p_rtable= source->p_rtable;
+	target->p_joinexprs= source->p_joinexprs;
+	target->p_joinlist= source->p_joinlist;
+	target->p_namespace= source->p_namespace;
+	target->p_lateral_active= source->p_lateral_active;
+	target->p_ctenamespace= source->p_ctenamespace;
+	target->p_future_ctes= source->p_future_ctes;
+	target->p_parent_cte= source->p_parent_cte;
+	target->p_target_relation= source->p_target_relation;
+	target->p_is_insert= source->p_is_insert;
+	target->p_windowdefs= source->p_windowdefs;
+	target->p_expr_kind= source->p_expr_kind;
+	target->p_next_resno= source->p_next_resno;
+	target->p_multiassign_exprs= source->p_multiassign_exprs;
+	target->p_locking_clause= source->p_locking_clause;
+	target->p_locked_from_parent= source->p_locked_from_parent;
+	target->p_resolve_unknowns= source->p_resolve_unknowns;
+	target->p_queryEnv= source->p_queryEnv;
+	target->p_hasAggs = source->p_hasAggs;
+	target->p_hasWindowFuncs = source->p_hasWindowFuncs;
+	target->p_hasTargetSRFs= source->p_hasTargetSRFs;
+	target->p_hasSubLinks= source->p_hasSubLinks;
+	target->p_hasModifyingCTE= source->p_hasModifyingCTE;
+	target->p_last_srf = source->p_last_srf;
+	target->p_pre_columnref_hook = source->p_pre_columnref_hook;
+	target->p_post_columnref_hook = source->p_post_columnref_hook;
+	target->p_paramref_hook = source->p_paramref_hook;
+	target->p_coerce_param_hook = source->p_coerce_param_hook;
 	target->p_ref_hook_state = source->p_ref_hook_state;
 }
 
-static void pgqr_reanalyze(const char *new_query_string)
+/*
+ * acquire locks on relations of an analyzed statement 
+ * taken from cache (same as parse analysis would do):
+ * from ScanQueryForLocks in src/backend/utils/cache/plancache.c
+ */
+static void pgqr_lock_query(Query *query);
+
+static bool pgqr_lock_walker(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, SubLink))
+	{
+		SubLink	*sub = (SubLink *) node;
+
+		pgqr_lock_query(castNode(Query, sub->subselect));
+		/* fall through to process the rest of the sublink */
+	}
+	return expression_tree_walker(node, pgqr_lock_walker, context);
+}
+
+static void pgqr_lock_query(Query *query)
+{
+	ListCell	*lc;
+	int		rt_index = 0;
+
+	foreach(lc, query->rtable)
+	{
+		RangeTblEntry	*rte = (RangeTblEntry *) lfirst(lc);
+
+		rt_index++;
+		switch (rte->rtekind)
+		{
+			case RTE_RELATION:
+#if PG_VERSION_NUM >= 120000
+				LockRelationOid(rte->relid, rte->rellockmode);
+#else
+				if (rt_index == query->resultRelation)
+					LockRelationOid(rte->relid, RowExclusiveLock);
+				else if (get_parse_rowmark(query, rt_index) != NULL)
+					LockRelationOid(rte->relid, RowShareLock);
+				else
+					LockRelationOid(rte->relid, AccessShareLock);
+#endif
+				break;
+			case RTE_SUBQUERY:
+				pgqr_lock_query(rte->subquery);
+				break;
+			default:
+				break;
+		}
+	}
+
+	foreach(lc, query->cteList)
+	{
+		CommonTableExpr	*cte = lfirst_node(CommonTableExpr, lc);
+
+		pgqr_lock_query(castNode(Query, cte->ctequery));
+	}
+
+	if (query->hasSubLinks)
+		query_tree_walker(query, pgqr_lock_walker, NULL, QTW_IGNORE_RC_SUBQUERIES);
+}
+
+/*
+ * collect types of external parameters referenced by current statement
+ */
+static bool pgqr_params_walker(Node *node, pgqrParams *params)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, Param))
+	{
+		Param	*param = (Param *) node;
+
+		if (param->paramkind == PARAM_EXTERN && param->paramid > 0)
+		{
+			if (param->paramid > params->maxParams)
+			{
+				int	maxParams = Max(param->paramid, 2 * params->maxParams);
+
+				if (params->paramTypes == NULL)
+					params->paramTypes = (Oid *) palloc0(maxParams * sizeof(Oid));
+				else
+				{
+					params->paramTypes = (Oid *) repalloc(params->paramTypes, maxParams * sizeof(Oid));
+					MemSet(params->paramTypes + params->maxParams, 0,
+					       (maxParams - params->maxParams) * sizeof(Oid));
+				}
+				params->maxParams = maxParams;
+			}
+			params->paramTypes[param->paramid - 1] = param->paramtype;
+			params->numParams = Max(params->numParams, param->paramid);
+		}
+		return false;
+	}
+	if (IsA(node, Query))
+		return query_tree_walker((Query *) node, pgqr_params_walker, (void *) params, 0);
+	return expression_tree_walker(node, pgqr_params_walker, (void *) params);
+}
+
+/*
+ * parse statement which must be a single SQL statement
+ */
+static RawStmt *pgqr_parse_single(const char *stmt, const char *kind)
+{
+	List	*raw_parsetree_list = pg_parse_query(stmt);
+
+	if (list_length(raw_parsetree_list) != 1)
+		ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("%s statement must be a single SQL statement", kind)));
+
+	return linitial_node(RawStmt, raw_parsetree_list);
+}
+
+/*
+ * raw parse tree of rule target statement:
+ * statement is only parsed on first use.
+ */
+static RawStmt *pgqr_parse_target(pgqrLocalRule *rule)
+{
+	MemoryContext	oldcontext;
+	RawStmt		*raw;
+
+	if (rule->target_raw == NULL)
+	{
+		raw = pgqr_parse_single(rule->target_stmt, "target");
+		oldcontext = MemoryContextSwitchTo(pgqr_local.context);
+		rule->target_raw = copyObject(raw);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	/* parse analysis may scribble on its input */
+	return copyObject(rule->target_raw);
+}
+
+/*
+ * analyze rule target statement into new_static_pstate
+ * and new_static_query: analyzed statement is taken
+ * from cache when still valid, otherwise statement is
+ * analyzed from cached parse tree and cached again.
+ * Returns true if analyzed statement has been taken from cache.
+ */
+static bool pgqr_analyze_target(pgqrLocalRule *rule, pgqrParams *params)
+{
+	/* local copy of rules may be rebuilt before current pstate is released */
+	char		*target = pstrdup(rule->target_stmt);
+	uint32		generation = pgqr_local.generation;
+	uint64		epoch = pgqr_catalog_epoch;
+	MemoryContext	oldcontext;
+
+	if (	rule->target_query != NULL &&
+		rule->target_epoch == epoch &&
+		rule->target_nparams == params->numParams &&
+		(params->numParams == 0 ||
+		 memcmp(rule->target_paramtypes, params->paramTypes, params->numParams * sizeof(Oid)) == 0) &&
+		pgqr_search_path_matches(rule->target_search_path))
+	{
+		Query	*query = copyObject(rule->target_query);
+
+		/* locking may process invalidation messages */
+		pgqr_lock_query(query);
+		if (pgqr_catalog_epoch == epoch)
+		{
+			elog(DEBUG1, "pg_query_rewrite: pgqr_analyze_target: cache hit");
+			new_static_pstate = make_parsestate(NULL);
+			new_static_pstate->p_sourcetext = target;
+			new_static_query = query;
+			return true;
+		}
+	}
+
+	pgqr_reanalyze(target, pgqr_parse_target(rule), params->paramTypes, params->numParams);
+
+	/*
+	 * cache analyzed statement unless rules or catalog have changed
+	 * during analysis; utility statements may embed analyzed statements
+	 * whose relations would not be locked by pgqr_lock_query.
+	 */
+	if (	!pgqr_local.valid ||
+		pgqr_local.generation != generation ||
+		pgqr_catalog_epoch != epoch ||
+		new_static_query->commandType == CMD_UTILITY)
+		return false;
+
+	if (rule->target_context == NULL)
+		rule->target_context = AllocSetContextCreate(pgqr_local.context,
+							     "pg_query_rewrite target",
+							     ALLOCSET_SMALL_MINSIZE,
+							     ALLOCSET_SMALL_INITSIZE,
+							     ALLOCSET_SMALL_MAXSIZE);
+	else
+		MemoryContextReset(rule->target_context);
+	rule->target_query = NULL;
+
+	oldcontext = MemoryContextSwitchTo(rule->target_context);
+	rule->target_search_path = pgqr_get_search_path(rule->target_context);
+	rule->target_nparams = params->numParams;
+	rule->target_paramtypes = NULL;
+	if (params->numParams > 0)
+	{
+		rule->target_paramtypes = (Oid *) palloc(params->numParams * sizeof(Oid));
+		memcpy(rule->target_paramtypes, params->paramTypes, params->numParams * sizeof(Oid));
+	}
+	rule->target_query = copyObject(new_static_query);
+	rule->target_epoch = epoch;
+	MemoryContextSwitchTo(oldcontext);
+
+	return false;
+}
+
+/*
+ * analyze target statement text built for current statement
+ * into new_static_pstate and new_static_query: not cached.
+ */
+static void pgqr_analyze_text(const char *target, pgqrParams *params)
+{
+	pgqr_reanalyze(target, pgqr_parse_single(target, "target"),
+		       params->paramTypes, params->numParams);
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * analyze target statement of normalized rule into new_static_pstate
+ * and new_static_query: target statement text depends on constants 
+ * of current statement and is not cached.
+ */
+static void pgqr_analyze_normalized(pgqrLocalRule *rule, const char *query_string, 
+				    Query *query, JumbleState *jstate, pgqrParams *params)
+{
+	char	*target;
+
+	/* constants locations are only known if query has been jumbled */
+	if (jstate == NULL)
+		jstate = pgqr_jumble(query, query_string);
+	target = pgqr_fill_placeholders(rule->target_stmt, query_string, jstate);
+	elog(DEBUG1, "pg_query_rewrite: pgqr_analyze_normalized: target=%s", target);
+
+	pgqr_analyze_text(target, params);
+}
+#endif
+
+static void pgqr_reanalyze(const char *new_query_string, RawStmt *new_parsetree,
+			   Oid *paramTypes, int numParams)
+{
+
+	/* 
+ 	 * >>> FROM parse_analyze in src/backend/parser/analyze.c <<< 
+ 	 */
+
+	ParseState 	*new_pstate = make_parsestate(NULL);
+	Query		*new_query = (Query *)NULL;
+
+	elog(DEBUG1, "pg_query_rewrite: pgqr_reanalyze: entry");
+	new_pstate->p_sourcetext = new_query_string;
+
+	/* 
+ 	 * target statement parameters have the types of
+	 * current statement parameters
+	 * (missing data: queryEnv)
+         */
+	if (numParams > 0)
+#if PG_VERSION_NUM >= 150000
+		setup_parse_fixed_parameters(new_pstate, paramTypes, numParams);
+#else
+		parse_fixed_parameters(new_pstate, paramTypes, numParams);
+#endif
+	
+	new_query = transformTopLevelStmt(new_pstate, new_parsetree);	
+
+	new_static_pstate = new_pstate;
+	new_static_query = new_query;
+
+	elog(DEBUG1, "pg_query_rewrite: pgqr_reanalyze: exit");
+}
+
+/*
+ * rule mark of query being analyzed or planned
+ */
+typedef struct pgqrMark
+{
+	int		slot;		/* PGQR_NO_RULE if not marked */
+	uint32		created;
+	int		variant;	/* PGQR_VARIANT_xxx of sample mark */
+} pgqrMark;
+
+/*
+ * mark query analyzed with rule for the planner hook
+ */
+static void pgqr_mark_query(Query *query, int kind, pgqrMark *rule_mark)
+{
+	WithCheckOption	*mark = makeNode(WithCheckOption);
+
+	mark->kind = WCO_VIEW_CHECK;
+	mark->polname = pstrdup(PGQR_QUERY_MARK);
+	mark->relname = psprintf("%d %d %u %d", kind, rule_mark->slot, rule_mark->created,
+				 rule_mark->variant);
+	mark->qual = NULL;
+	if (kind == PGQR_MARK_SAMPLE || kind == PGQR_MARK_SUMMARY)
+		mark->qual = (Node *) makeConst(REGCLASSOID, -1, InvalidOid, sizeof(Oid),
+						ObjectIdGetDatum(PGQR_MARK_RELID(kind, rule_mark->slot)),
+						false, true);
+	mark->cascaded = false;
+	query->withCheckOptions = lappend(query->withCheckOptions, mark);
+}
+
+/*
+ * invalidate statements of plan cache marked with rule
+ */
+static void pgqr_invalidate_marked(int kind, int slot)
+{
+	SharedInvalidationMessage	msg;
+
+	msg.rc.id = SHAREDINVALRELCACHE_ID;
+	msg.rc.dbId = MyDatabaseId;
+	msg.rc.relId = PGQR_MARK_RELID(kind, slot);
+	LocalExecuteInvalidationMessage(&msg);
+}
+
+/*
+ * remove marks of query being planned into marks array
+ * indexed by mark kind, and into list of summary marks:
+ * plan cache plans a copy of the query, whose original
+ * keeps its marks.
+ */
+static void pgqr_take_marks(Query *parse, pgqrMark *marks, List **summaries)
+{
+	List		*options = NIL;
+	bool		marked = false;
+	ListCell	*lc;
+	int		i;
+
+	for (i = 0; i < PGQR_MARKS; i++)
+		marks[i].slot = PGQR_NO_RULE;
+	*summaries = NIL;
+
+	foreach(lc, parse->withCheckOptions)
+	{
+		WithCheckOption	*mark = lfirst_node(WithCheckOption, lc);
+		int		kind;
+		int		slot;
+		uint32		created;
+		int		variant;
+
+		if (	mark->polname == NULL ||
+			strcmp(mark->polname, PGQR_QUERY_MARK) != 0)
+		{
+			options = lappend(options, mark);
+			continue;
+		}
+		marked = true;
+		if (sscanf(mark->relname, "%d %d %u %d", &kind, &slot, &created, &variant) != 4)
+			continue;
+		if (kind == PGQR_MARK_SUMMARY)
+		{
+			pgqrMark	*summary = (pgqrMark *) palloc(sizeof(pgqrMark));
+
+			summary->slot = slot;
+			summary->created = created;
+			summary->variant = variant;
+			*summaries = lappend(*summaries, summary);
+		}
+		else if (kind >= 0 && kind < PGQR_MARKS)
+		{
+			marks[kind].slot = slot;
+			marks[kind].created = created;
+			marks[kind].variant = variant;
+		}
+	}
+	if (marked)
+		parse->withCheckOptions = options;
+}
+
+/*
+ *
+ * pqqr_analyze: main routine
+ *
+ */
+#if PG_VERSION_NUM < 140000
+static void pgqr_analyze(ParseState *pstate, Query *query)
+#else
+static void pgqr_analyze(ParseState *pstate, Query *query, JumbleState *js)
+#endif
+{
+	
+	pgqrLocalRule	*rule = NULL;
+	pgqrParams	params;
+	int		slot;
+	uint32		generation;
+	bool		cache_hit = false;
+	bool		valid_xact;
+	instr_time	start;
+	uint64		analyze_time = 0;
+	bool		matched;
+	pgqrMark	rule_mark = {PGQR_NO_RULE, 0, 0};
+	bool		summary = false;
+	List		*summaries = NIL;
+	ListCell	*lc;
+	bool		sampled = false;
+	int		variant = PGQR_VARIANT_REWRITTEN;
+
+	elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: entry: %s",pstate->p_sourcetext);
+
+	statement_rewritten = false;
+
+	/*
+ 	** not possible to access parameters using pstate->p_ref_hook_state
+	** because no easy way to check FixedParamState vs VarParamState
+	** (p_ref_hook_state is generic pointer in both cases
+	** and p_param_ref_hook refer to a static function in parse_params.c):
+	** parameter types are taken from Param nodes of analyzed query.
+	*/
+
+	/* pstate->p_sourcetext is the current query text */	
+	elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: %s",pstate->p_sourcetext);
+
+	/*
+	 * rules are neither looked up nor copied to local memory
+	 * when catalogs cannot be read (ROLLBACK of aborted transaction)
+	 * nor applied to definitions of views, rules, materialized views
+	 * and functions, which would keep the rule target forever
+	 */
+	valid_xact = (IsTransactionState() && !IsAbortedTransactionBlockState() &&
+		      pgqr_definition_level != pgqr_nesting_level);
+	matched = (valid_xact && pgqr_check_rewrite(pstate->p_sourcetext, query, &rule));
+	if (matched)
+	{
+		/* local copy of rules may be rebuilt during target analysis */
+		rule_mark.slot = rule->slot;
+		rule_mark.created = (uint32) rule->created;
+		rule_mark.variant = 0;
+		summary = (rule->max_age >= 0);
+	}
+	if (matched && rule->sample >= 0)
+	{
+		/* executions sampled out run source statement */
+		if (pgqr_random() >= rule->sample)
+			variant = PGQR_VARIANT_ORIGINAL;
+		sampled = true;
+	}
+
+	if (matched && variant == PGQR_VARIANT_REWRITTEN)
+	{
+		elog(DEBUG1,"pg_query_rewrite: pgqr_to_rewrite %s: rc=true", 
+                                    pstate->p_sourcetext);
+		generation = pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]);
+		slot = pgqr_incr_rewrite_count(rule);
+
+		/* 
+ 		** analyze destination statement with current statement
+		** parameter types if needed
+		*/
+		if (pgqrTrackTiming)
+			INSTR_TIME_SET_CURRENT(start);
+		MemSet(&params, 0, sizeof(pgqrParams));
+		if (rule->target_params)
+			pgqr_params_walker((Node *) query, &params);
+#if PG_VERSION_NUM >= 140000
+		if (rule->match == PGQR_MATCH_NORMALIZED)
+			pgqr_analyze_normalized(rule, pstate->p_sourcetext, query, js, &params);
+		else
+#endif
+		if (rule->target_captures)
+		{
+			elog(DEBUG1, "pg_query_rewrite: pgqr_analyze: target=%s", pgqr_pattern_target);
+			pgqr_analyze_text(pgqr_pattern_target, &params);
+		}
+		else
+			cache_hit = pgqr_analyze_target(rule, &params);
+		if (pgqrTrackTiming)
+			analyze_time = pgqr_elapsed(start);
+
+		/* rule may have been removed during analysis */
+		pgqr_count_analysis(slot, generation, cache_hit, analyze_time);
+
+		/* clone data */
+		pgqr_clone_ParseState(new_static_pstate, pstate);
+		elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: rewrite=true pstate->p_source_text %s",
+                                   pstate->p_sourcetext);
+		pgqr_clone_Query(new_static_query, query);
+		statement_rewritten = true;
+		if (rule->result_cache && query->commandType == CMD_SELECT)
+			pgqr_mark_query(query, PGQR_MARK_RESULT, &rule_mark);
+		if (summary)
+			pgqr_mark_query(query, PGQR_MARK_SUMMARY, &rule_mark);
+
+		free_parsestate(new_static_pstate); 
+	}
+	else if (rule != NULL && rule->rewrite == PGQR_REWRITE_SETTINGS)
+	{
+		/* rewrite count of settings rules counts matching statements */
+		(void) pgqr_incr_rewrite_count(rule);
+		rule_mark.slot = rule->slot;
+		rule_mark.created = (uint32) rule->created;
+		rule_mark.variant = 0;
+		pgqr_mark_query(query, PGQR_MARK_SETTINGS, &rule_mark);
+	}
+	else
+		elog(DEBUG1,"pg_query_rewrite: pgqr_to_rewrite %s: rc=false", 
+                             pstate->p_sourcetext);
+
+	if (valid_xact)
+		summaries = pgqr_transform(query);
+	foreach(lc, summaries)
+	{
+		pgqrLocalRule	*r = (pgqrLocalRule *) lfirst(lc);
+		pgqrMark	summary_mark = {r->slot, (uint32) r->created, 0};
+
+		pgqr_mark_query(query, PGQR_MARK_SUMMARY, &summary_mark);
+	}
+	list_free(summaries);
+
+	if (pgqr_pending_stats.lookups >= PGQR_STATS_FLUSH)
+		pgqr_flush_stats();
+
+	/* no "standard_analyze" to call 
+  	 * according to parse_analyze in analyze.c 
+  	 */
+	if (prev_post_parse_analyze_hook)
+	{
+#if PG_VERSION_NUM < 140000
+		prev_post_parse_analyze_hook(pstate, query);
+#else
+		prev_post_parse_analyze_hook(pstate, query, js);
+#endif
+	 }
+
+	/* plans of sampled statement carry their variant */
+	if (sampled)
+	{
+		rule_mark.variant = variant;
+		pgqr_mark_query(query, PGQR_MARK_SAMPLE, &rule_mark);
+	}
+
+	elog(DEBUG1, "pg_query_rewrite: pgqr_analyze: exit");
+}
+
+
+/*
+ * partition ancestors of a relation
+ */
+static List *pgqr_partition_ancestors(Oid relid)
+{
+#if PG_VERSION_NUM >= 110000
+	if (get_rel_relispartition(relid))
+		return get_partition_ancestors(relid);
+	return NIL;
+#else
+	List	*ancestors = NIL;
+
+	for (;;)
+	{
+		HeapTuple	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+		bool		ispartition;
+
+		if (!HeapTupleIsValid(tuple))
+			break;
+		ispartition = ((Form_pg_class) GETSTRUCT(tuple))->relispartition;
+		ReleaseSysCache(tuple);
+		if (!ispartition)
+			break;
+		relid = get_partition_parent(relid);
+		ancestors = lappend_oid(ancestors, relid);
+	}
+	return ancestors;
+#endif
+}
+
+/*
+ * append parameter value to result key: varlena values
+ * are detoasted so that equal values have equal bytes
+ */
+static void pgqr_result_key_datum(StringInfo key, Datum value, Oid type)
+{
+	int16	typlen;
+	bool	typbyval;
+	Size	len;
+	char	*data;
+
+	get_typlenbyval(type, &typlen, &typbyval);
+	if (typbyval)
+	{
+		len = sizeof(Datum);
+		data = (char *) &value;
+	}
+	else if (typlen == -1)
+	{
+		struct varlena	*v = pg_detoast_datum((struct varlena *) DatumGetPointer(value));
+
+		len = VARSIZE(v);
+		data = (char *) v;
+	}
+	else if (typlen == -2)
+	{
+		data = DatumGetCString(value);
+		len = strlen(data) + 1;
+	}
+	else
+	{
+		len = typlen;
+		data = DatumGetPointer(value);
+	}
+	appendBinaryStringInfo(key, (char *) &len, sizeof(Size));
+	appendBinaryStringInfo(key, data, len);
+}
+
+/*
+ * query marked by analysis hook as rewritten by a result cache
+ * rule can be cached: checked before planning as planner
+ * scribbles on its input.
+ */
+static bool pgqr_result_query(Query *parse, int cursorOptions)
+{
+	return	pgqrResultCacheSize > 0 &&
+		parse->commandType == CMD_SELECT &&
+		parse->utilityStmt == NULL &&
+		parse->rowMarks == NIL &&
+		!parse->hasModifyingCTE &&
+		(cursorOptions & (CURSOR_OPT_SCROLL | CURSOR_OPT_HOLD)) == 0 &&
+		!contain_mutable_functions((Node *) parse);
+}
+
+/*
+ * settings rule of a query or plan mark: rule may
+ * have been removed or be out of session scope.
+ */
+static pgqrLocalRule *pgqr_marked_settings(int slot, uint32 created)
+{
+	int	i;
+
+	if (	slot == PGQR_NO_RULE ||
+		pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) == 0)
+		return NULL;
+
+	pgqr_refresh_local_rules();
+	for (i = 0; i < pgqr_local.settings_rule_number; i++)
+		if (	pgqr_local.settings_rules[i]->slot == slot &&
+			(uint32) pgqr_local.settings_rules[i]->created == created)
+			return pgqr_local.settings_rules[i];
+
+	return NULL;
+}
+
+/*
+ * settings rule of plan marked by planner hook
+ */
+static pgqrLocalRule *pgqr_plan_settings(PlannedStmt *stmt)
+{
+	int		slot = PGQR_NO_RULE;
+	uint32		created = 0;
+	ListCell	*lc;
+
+	foreach(lc, stmt->invalItems)
+	{
+		PlanInvalItem	*item = lfirst_node(PlanInvalItem, lc);
+
+		if (item->cacheId == PGQR_SETTINGS_MARK_SLOT)
+			slot = (int) item->hashValue;
+		else if (item->cacheId == PGQR_SETTINGS_MARK_CREATED)
+			created = item->hashValue;
+	}
+
+	return pgqr_marked_settings(slot, created);
+}
+
+/*
+ * set parameters of settings rule in a new GUC nesting level,
+ * which caller ends with AtEOXact_GUC: as for function SET clauses,
+ * transaction or subtransaction abort restores previous values.
+ * Values are checked when the rule is added, but may still be rejected
+ * in current session (for example by a check depending on other
+ * parameters): failures are reported as warnings and the statement
+ * runs without the parameter.
+ */
+static int pgqr_apply_settings(pgqrLocalRule *rule)
+{
+	int		nestlevel = NewGUCNestLevel();
+	ListCell	*name;
+	ListCell	*value;
+
+	forboth(name, rule->setting_names, value, rule->setting_values)
+		(void) set_config_option((char *) lfirst(name), (char *) lfirst(value),
+					 PGC_USERSET, PGC_S_SESSION,
+					 GUC_ACTION_SAVE, true, WARNING, false);
+
+	return nestlevel;
+}
+
+/*
+ * planner hook: plan of a query marked by analysis hook as rewritten
+ * by a result cache rule, as sampled or as reading summaries is
+ * marked with the rule, so that the mark survives plan caching and
+ * copies of plans. Queries marked with a settings rule are planned
+ * with its parameters and their plan is marked so that executor hooks
+ * set them again.
+ */
+#if PG_VERSION_NUM >= 130000
+static PlannedStmt *pgqr_planner(Query *parse, const char *query_string,
+				 int cursorOptions, ParamListInfo boundParams)
+#else
+static PlannedStmt *pgqr_planner(Query *parse, int cursorOptions, ParamListInfo boundParams)
+#endif
+{
+	pgqrLocalRule	*rule;
+	pgqrMark	marks[PGQR_MARKS];
+	List		*summaries;
+	ListCell	*lc;
+	int		slot = PGQR_NO_RULE;
+	uint32		created = 0;
+	int		settings_slot = PGQR_NO_RULE;
+	TimestampTz	settings_created = 0;
+	int		nestlevel = 0;
+	PlannedStmt	*result;
+	PlanInvalItem	*item;
+
+	pgqr_take_marks(parse, marks, &summaries);
+	if (	marks[PGQR_MARK_RESULT].slot != PGQR_NO_RULE &&
+		pgqr_result_query(parse, cursorOptions))
+	{
+		slot = marks[PGQR_MARK_RESULT].slot;
+		created = marks[PGQR_MARK_RESULT].created;
+	}
+
+	rule = pgqr_marked_settings(marks[PGQR_MARK_SETTINGS].slot, marks[PGQR_MARK_SETTINGS].created);
+	if (rule != NULL)
+	{
+		settings_slot = rule->slot;
+		settings_created = rule->created;
+		nestlevel = pgqr_apply_settings(rule);
+	}
+
+#if PG_VERSION_NUM >= 130000
+	if (prev_planner_hook)
+		result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+	else
+		result = standard_planner(parse, query_string, cursorOptions, boundParams);
+#else
+	if (prev_planner_hook)
+		result = prev_planner_hook(parse, cursorOptions, boundParams);
+	else
+		result = standard_planner(parse, cursorOptions, boundParams);
+#endif
+
+	if (slot != PGQR_NO_RULE)
+	{
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_RESULT_MARK_SLOT;
+		item->hashValue = (uint32) slot;
+		result->invalItems = lappend(result->invalItems, item);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_RESULT_MARK_CREATED;
+		item->hashValue = created;
+		result->invalItems = lappend(result->invalItems, item);
+	}
+
+	if (marks[PGQR_MARK_SAMPLE].slot != PGQR_NO_RULE)
+	{
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SAMPLE_MARK_SLOT;
+		item->hashValue = (uint32) marks[PGQR_MARK_SAMPLE].slot;
+		result->invalItems = lappend(result->invalItems, item);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SAMPLE_MARK_CREATED;
+		item->hashValue = marks[PGQR_MARK_SAMPLE].created;
+		result->invalItems = lappend(result->invalItems, item);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SAMPLE_MARK_VARIANT;
+		item->hashValue = (uint32) marks[PGQR_MARK_SAMPLE].variant;
+		result->invalItems = lappend(result->invalItems, item);
+	}
+
+	foreach(lc, summaries)
+	{
+		pgqrMark	*summary = (pgqrMark *) lfirst(lc);
+
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SUMMARY_MARK_SLOT;
+		item->hashValue = (uint32) summary->slot;
+		result->invalItems = lappend(result->invalItems, item);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SUMMARY_MARK_CREATED;
+		item->hashValue = summary->created;
+		result->invalItems = lappend(result->invalItems, item);
+	}
+
+	if (settings_slot != PGQR_NO_RULE)
+	{
+		AtEOXact_GUC(true, nestlevel);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SETTINGS_MARK_SLOT;
+		item->hashValue = (uint32) settings_slot;
+		result->invalItems = lappend(result->invalItems, item);
+		item = makeNode(PlanInvalItem);
+		item->cacheId = PGQR_SETTINGS_MARK_CREATED;
+		item->hashValue = (uint32) settings_created;
+		result->invalItems = lappend(result->invalItems, item);
+	}
+
+	return result;
+}
+
+/*
+ * result cache rule slot of a top-level SELECT statement whose plan
+ * is marked with a result cache rule, PGQR_NO_RULE if its results
+ * cannot be cached: called before executor start.
+ * Results are only used in READ COMMITTED transactions which have
+ * not written data, as they are computed with other snapshots.
+ */
+static int pgqr_result_slot(QueryDesc *queryDesc, int eflags, uint32 *created)
+{
+	PlannedStmt	*stmt = queryDesc->plannedstmt;
+	ParamListInfo	params = queryDesc->params;
+	int		slot = PGQR_NO_RULE;
+	ListCell	*lc;
+	int		i;
+
+	if (	pgqrResultCacheSize == 0 ||
+		pgqr_nesting_level > 0 ||
+		queryDesc->operation != CMD_SELECT ||
+		stmt->hasModifyingCTE ||
+		stmt->rowMarks != NIL ||
+		(eflags & (EXEC_FLAG_EXPLAIN_ONLY | EXEC_FLAG_REWIND | EXEC_FLAG_BACKWARD | EXEC_FLAG_MARK)) != 0 ||
+		queryDesc->instrument_options != 0 ||
+		IsParallelWorker() ||
+		IsolationUsesXactSnapshot() ||
+		RecoveryInProgress() ||
+		TransactionIdIsValid(GetTopTransactionIdIfAny()) ||
+		(params != NULL && params->paramFetch != NULL))
+		return PGQR_NO_RULE;
+
+	*created = 0;
+	foreach(lc, stmt->invalItems)
+	{
+		PlanInvalItem	*item = lfirst_node(PlanInvalItem, lc);
+
+		if (item->cacheId == PGQR_RESULT_MARK_SLOT)
+			slot = (int) item->hashValue;
+		else if (item->cacheId == PGQR_RESULT_MARK_CREATED)
+			*created = item->hashValue;
+	}
+	if (slot == PGQR_NO_RULE || pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) == 0)
+		return PGQR_NO_RULE;
+
+	/* rule may have been removed since plan has been built */
+	pgqr_refresh_local_rules();
+	for (i = 0; i < pgqr_local.result_rule_number; i++)
+		if (	pgqr_local.result_rules[i]->slot == slot &&
+			(uint32) pgqr_local.result_rules[i]->created == *created)
+			return slot;
+	return PGQR_NO_RULE;
+}
+
+/*
+ * look up result of a statement whose results can be cached:
+ * called after executor start.
+ * Result key is made of database, user, rule slot and creation time,
+ * relations read by the plan and parameter values.
+ */
+static void pgqr_result_start(QueryDesc *queryDesc, int slot, uint32 created)
+{
+	PlannedStmt	*stmt = queryDesc->plannedstmt;
+	ParamListInfo	params = queryDesc->params;
+	pgqrResultState	*result;
+	StringInfoData	key;
+	List		*relations = NIL;
+	ListCell	*lc;
+	MemoryContext	oldcontext;
+	dsa_pointer	dp;
+	Oid		userid = GetUserId();
+	TimestampTz	rule_created = 0;
+	int		i;
+
+	/* rule creation time is part of result key */
+	for (i = 0; i < pgqr_local.result_rule_number; i++)
+		if (	pgqr_local.result_rules[i]->slot == slot &&
+			(uint32) pgqr_local.result_rules[i]->created == created)
+			rule_created = pgqr_local.result_rules[i]->created;
+	if (rule_created == 0)
+		return;
+
+	/* changes of foreign tables data are not known */
+	foreach(lc, stmt->relationOids)
+	{
+		Oid	relid = lfirst_oid(lc);
+
+		if (get_rel_relkind(relid) == RELKIND_FOREIGN_TABLE)
+			return;
+		relations = list_append_unique_oid(relations, relid);
+		relations = list_concat_unique_oid(relations, pgqr_partition_ancestors(relid));
+	}
+
+	if (pgqr_area == NULL)
+	{
+		LWLockAcquire(pgqr->lock, LW_SHARED);
+		pgqr_attach_area();
+		LWLockRelease(pgqr->lock);
+	}
+
+	oldcontext = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+	result = (pgqrResultState *) palloc0(sizeof(pgqrResultState));
+	result->queryDesc = queryDesc;
+	result->slot = slot;
+	result->epoch = pg_atomic_read_u64(&pgqr->result_epoch);
+	result->nrelations = list_length(relations);
+	result->relations = (Oid *) palloc(Max(result->nrelations, 1) * sizeof(Oid));
+	i = 0;
+	foreach(lc, relations)
+		result->relations[i++] = lfirst_oid(lc);
+
+	initStringInfo(&key);
+	appendBinaryStringInfo(&key, (char *) &MyDatabaseId, sizeof(Oid));
+	appendBinaryStringInfo(&key, (char *) &userid, sizeof(Oid));
+	appendBinaryStringInfo(&key, (char *) &slot, sizeof(int));
+	appendBinaryStringInfo(&key, (char *) &rule_created, sizeof(TimestampTz));
+	appendBinaryStringInfo(&key, (char *) &result->nrelations, sizeof(int));
+	appendBinaryStringInfo(&key, (char *) result->relations, result->nrelations * sizeof(Oid));
+	if (params != NULL)
+		for (i = 0; i < params->numParams; i++)
+		{
+			ParamExternData	*prm = &params->params[i];
+
+			appendBinaryStringInfo(&key, (char *) &prm->ptype, sizeof(Oid));
+			appendStringInfoChar(&key, prm->isnull ? 'n' : 'v');
+			if (!prm->isnull && OidIsValid(prm->ptype))
+				pgqr_result_key_datum(&key, prm->value, prm->ptype);
+		}
+	result->key = key.data;
+	result->key_len = key.len;
+	result->hash = DatumGetUInt32(hash_any((const unsigned char *) key.data, key.len));
+
+	if (pgqr_area != NULL)
+	{
+		LWLockAcquire(pgqr->result_lock, LW_EXCLUSIVE);
+		dp = pgqr_result_find(result->hash, result->key, result->key_len);
+		if (DsaPointerIsValid(dp))
+		{
+			pgqrResultEntry	*entry = PGQR_RESULT_ENTRY(dp);
+
+			result->hit = true;
+			result->ntuples = entry->ntuples;
+			result->tuples = (char *) palloc(Max(entry->tuples_len, 1));
+			memcpy(result->tuples, PGQR_RESULT_TUPLES(entry), entry->tuples_len);
+			pgqr_result_lru_unlink(entry);
+			pgqr_result_lru_push(dp);
+		}
+		LWLockRelease(pgqr->result_lock);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	pgqr_result = result;
+}
+
+/*
+ * send cached result to statement destination instead of running plan
+ */
+static void pgqr_result_send(QueryDesc *queryDesc, pgqrResultState *result)
+{
+	EState		*estate = queryDesc->estate;
+	DestReceiver	*dest = queryDesc->dest;
+	TupleTableSlot	*slot;
+	MemoryContext	oldcontext;
+	char		*tuple = result->tuples;
+	uint64		i;
+
+	oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+#if PG_VERSION_NUM >= 120000
+	slot = MakeSingleTupleTableSlot(queryDesc->tupDesc, &TTSOpsMinimalTuple);
+#else
+	slot = MakeSingleTupleTableSlot(queryDesc->tupDesc);
+#endif
+	dest->rStartup(dest, queryDesc->operation, queryDesc->tupDesc);
+	for (i = 0; i < result->ntuples; i++)
+	{
+		ExecStoreMinimalTuple((MinimalTuple) tuple, slot, false);
+		tuple += MAXALIGN(((MinimalTuple) tuple)->t_len);
+		if (!dest->receiveSlot(slot, dest))
+			break;
+		estate->es_processed++;
+	}
+	dest->rShutdown(dest);
+	ExecDropSingleTupleTableSlot(slot);
+	MemoryContextSwitchTo(oldcontext);
+
+	pg_atomic_fetch_add_u64(&pgqr->stat_result_hits, 1);
+	/* slot still holds the same rule if rules have not changed */
+	if (pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]) == pgqr_local.generation)
+		pg_atomic_fetch_add_u64(&pgqr_rule(result->slot)->result_hits, 1);
+}
+
+/*
+ * destination receiver copying tuples sent to statement
+ * destination: result is not stored if it is larger than
+ * max_size or if statement destination stopped the plan.
+ */
+typedef struct pgqrResultReceiver
+{
+	DestReceiver	pub;
+	DestReceiver	*dest;
+	MemoryContext	context;
+	StringInfoData	tuples;
+	uint64		ntuples;
+	Size		max_size;
+	bool		complete;
+} pgqrResultReceiver;
+
+static void pgqr_result_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	pgqrResultReceiver	*receiver = (pgqrResultReceiver *) self;
+
+	receiver->dest->rStartup(receiver->dest, operation, typeinfo);
+}
+
+static bool pgqr_result_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	pgqrResultReceiver	*receiver = (pgqrResultReceiver *) self;
+
+	if (receiver->complete)
+	{
+		MemoryContext	oldcontext = MemoryContextSwitchTo(receiver->context);
+		MinimalTuple	tuple = ExecCopySlotMinimalTuple(slot);
+		Size		len = MAXALIGN(tuple->t_len);
+
+		if (receiver->tuples.len + len > receiver->max_size)
+			receiver->complete = false;
+		else
+		{
+			enlargeStringInfo(&receiver->tuples, len);
+			memcpy(receiver->tuples.data + receiver->tuples.len, tuple, tuple->t_len);
+			receiver->tuples.len += len;
+			receiver->ntuples++;
+		}
+		pfree(tuple);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	if (!receiver->dest->receiveSlot(slot, receiver->dest))
+	{
+		receiver->complete = false;
+		return false;
+	}
+	return true;
+}
+
+static void pgqr_result_shutdown(DestReceiver *self)
+{
+	pgqrResultReceiver	*receiver = (pgqrResultReceiver *) self;
+
+	receiver->dest->rShutdown(receiver->dest);
+}
+
+static void pgqr_result_destroy(DestReceiver *self)
+{
+}
+
+/*
+ * copy results sent by plan: entry key and relations must fit
+ * with the tuples in 1/8 of result cache size.
+ */
+static pgqrResultReceiver *pgqr_result_receiver(QueryDesc *queryDesc, pgqrResultState *result)
+{
+	pgqrResultReceiver	*receiver;
+	Size			max_size = (Size) pgqrResultCacheSize * 1024 / 8;
+	Size			header_size;
+	MemoryContext		oldcontext;
+
+	header_size = MAXALIGN(sizeof(pgqrResultEntry)) + MAXALIGN(result->key_len) +
+		      MAXALIGN(result->nrelations * sizeof(Oid));
+	if (max_size <= header_size)
+		return NULL;
+
+	receiver = (pgqrResultReceiver *) MemoryContextAllocZero(queryDesc->estate->es_query_cxt,
+								 sizeof(pgqrResultReceiver));
+	receiver->pub.receiveSlot = pgqr_result_receive;
+	receiver->pub.rStartup = pgqr_result_startup;
+	receiver->pub.rShutdown = pgqr_result_shutdown;
+	receiver->pub.rDestroy = pgqr_result_destroy;
+	receiver->pub.mydest = queryDesc->dest->mydest;
+	receiver->dest = queryDesc->dest;
+	receiver->context = queryDesc->estate->es_query_cxt;
+	receiver->max_size = Min(max_size - header_size, MaxAllocSize / 2);
+	receiver->complete = true;
+	oldcontext = MemoryContextSwitchTo(receiver->context);
+	initStringInfo(&receiver->tuples);
+	MemoryContextSwitchTo(oldcontext);
+
+	return receiver;
+}
+
+/*
+ * whether committed top-level transaction is visible
+ * to MVCC snapshot taken out of recovery
+ */
+static bool pgqr_xid_visible(TransactionId xid, Snapshot snapshot)
+{
+	uint32	i;
+
+	if (TransactionIdPrecedes(xid, snapshot->xmin))
+		return true;
+	if (!TransactionIdPrecedes(xid, snapshot->xmax))
+		return false;
+	for (i = 0; i < snapshot->xcnt; i++)
+		if (TransactionIdEquals(xid, snapshot->xip[i]))
+			return false;
+	return true;
+}
+
+/*
+ * whether result epoch is still the one read at executor start and
+ * writers which have bumped it are visible to statement snapshot,
+ * which may have been taken long before executor start (cursor,
+ * extended protocol): otherwise result could miss data of a writer
+ * whose results have been purged before executor start. Writers
+ * overwritten in the ring are visible if the newest one is older
+ * than all transactions running when the snapshot was taken.
+ */
+static bool pgqr_result_writers_visible(pgqrResultState *result)
+{
+	Snapshot	snapshot = result->queryDesc->snapshot;
+	TransactionId	writers[PGQR_RESULT_WRITERS];
+	TransactionId	evicted;
+	bool		changed;
+	int		i;
+
+	SpinLockAcquire(&pgqr->result_mutex);
+	changed = (pg_atomic_read_u64(&pgqr->result_epoch) != result->epoch);
+	memcpy(writers, pgqr->result_writers, sizeof(writers));
+	evicted = pgqr->result_evicted;
+	SpinLockRelease(&pgqr->result_mutex);
+
+	if (changed || snapshot == NULL)
+		return false;
+	if (TransactionIdIsValid(evicted) && !TransactionIdPrecedes(evicted, snapshot->xmin))
+		return false;
+	for (i = 0; i < PGQR_RESULT_WRITERS; i++)
+		if (TransactionIdIsValid(writers[i]) && !pgqr_xid_visible(writers[i], snapshot))
+			return false;
+	return true;
+}
+
+/*
+ * store complete result of statement in result cache unless result
+ * epoch has changed since executor start or statement snapshot does
+ * not see all previous writers: relations bits are set before epoch
+ * is checked (see pgqr_result_invalidate).
+ * Least recently used results are evicted to make room.
+ */
+static void pgqr_result_store(pgqrResultState *result, pgqrResultReceiver *receiver)
+{
+	Size		limit = (Size) pgqrResultCacheSize * 1024;
+	Size		size;
+	dsa_pointer	dp;
+	pgqrResultEntry	*entry;
+	int		i;
+
+	if (pgqr_area == NULL)
+		return;
+
+	size = MAXALIGN(sizeof(pgqrResultEntry)) + MAXALIGN(result->key_len) +
+	       MAXALIGN(result->nrelations * sizeof(Oid)) + receiver->tuples.len;
+
+	LWLockAcquire(pgqr->result_lock, LW_EXCLUSIVE);
+
+	for (i = 0; i < result->nrelations; i++)
+	{
+		uint32	bit = pgqr_result_bit(MyDatabaseId, result->relations[i]);
+
+		pg_atomic_fetch_or_u32(&pgqr->result_relations[bit / 32], 1U << (bit % 32));
+	}
+	if (!pgqr_result_writers_visible(result))
+	{
+		LWLockRelease(pgqr->result_lock);
+		return;
+	}
+
+	if (!DsaPointerIsValid(pgqr->result_buckets))
+	{
+		pgqr->result_buckets = dsa_allocate_extended(pgqr_area,
+							     PGQR_RESULT_BUCKETS * sizeof(dsa_pointer),
+							     DSA_ALLOC_NO_OOM | DSA_ALLOC_ZERO);
+		if (!DsaPointerIsValid(pgqr->result_buckets))
+		{
+			LWLockRelease(pgqr->result_lock);
+			return;
+		}
+	}
+
+	/* result may have been stored by another backend */
+	dp = pgqr_result_find(result->hash, result->key, result->key_len);
+	if (DsaPointerIsValid(dp))
+		pgqr_result_remove(dp);
+	while (pgqr->result_used + size > limit && DsaPointerIsValid(pgqr->result_lru_tail))
+		pgqr_result_remove(pgqr->result_lru_tail);
+
+	dp = dsa_allocate_extended(pgqr_area, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(dp))
+	{
+		LWLockRelease(pgqr->result_lock);
+		return;
+	}
+	entry = PGQR_RESULT_ENTRY(dp);
+	entry->dbid = MyDatabaseId;
+	entry->hash = result->hash;
+	entry->size = size;
+	entry->key_len = result->key_len;
+	entry->nrelations = result->nrelations;
+	entry->ntuples = receiver->ntuples;
+	entry->tuples_len = receiver->tuples.len;
+	memcpy(PGQR_RESULT_KEY(entry), result->key, result->key_len);
+	memcpy(PGQR_RESULT_RELATIONS(entry), result->relations, result->nrelations * sizeof(Oid));
+	memcpy(PGQR_RESULT_TUPLES(entry), receiver->tuples.data, receiver->tuples.len);
+	entry->next = PGQR_RESULT_BUCKET_ARRAY()[result->hash % PGQR_RESULT_BUCKETS];
+	PGQR_RESULT_BUCKET_ARRAY()[result->hash % PGQR_RESULT_BUCKETS] = dp;
+	pgqr_result_lru_push(dp);
+	pgqr->result_used += size;
+	pgqr->result_entries++;
+
+	LWLockRelease(pgqr->result_lock);
+
+	pg_atomic_fetch_add_u64(&pgqr->stat_result_stores, 1);
+}
+
+/*
+ * check freshness bound of summary rules marking plan, which may
+ * have been built long before its execution: statements whose plan
+ * reads a summary which is no longer fresh are analyzed again before
+ * their next execution, which falls back to source relations.
+ */
+static void pgqr_summary_check(PlannedStmt *stmt)
+{
+	int		slot = PGQR_NO_RULE;
+	bool		refreshed = false;
+	ListCell	*lc;
+	int		i;
+
+	foreach(lc, stmt->invalItems)
+	{
+		PlanInvalItem	*item = lfirst_node(PlanInvalItem, lc);
+
+		if (item->cacheId == PGQR_SUMMARY_MARK_SLOT)
+			slot = (int) item->hashValue;
+		else if (item->cacheId == PGQR_SUMMARY_MARK_CREATED && slot != PGQR_NO_RULE)
+		{
+			/* rule may have been removed since plan has been built */
+			if (!refreshed)
+				pgqr_refresh_local_rules();
+			refreshed = true;
+			for (i = 0; i < pgqr_local.summary_rule_number; i++)
+				if (	pgqr_local.summary_rules[i]->slot == slot &&
+					(uint32) pgqr_local.summary_rules[i]->created == item->hashValue)
+					break;
+			if (	i == pgqr_local.summary_rule_number ||
+				!pgqr_fresh(pgqr_local.summary_rules[i]))
+				pgqr_invalidate_marked(PGQR_MARK_SUMMARY, slot);
+			slot = PGQR_NO_RULE;
+		}
+	}
+}
+
+/*
+ * start measuring a top-level execution of a plan marked
+ * with a sampled rule: called before executor start.
+ * Statements with this plan are analyzed again before their
+ * next execution, which draws its own variant.
+ */
+static void pgqr_sample_start(QueryDesc *queryDesc, int eflags)
+{
+	PlannedStmt	*stmt = queryDesc->plannedstmt;
+	int		slot = PGQR_NO_RULE;
+	uint32		created = 0;
+	int		variant = PGQR_VARIANT_REWRITTEN;
+	ListCell	*lc;
+	int		i;
+
+	/* statement measured before may not have reached executor end */
+	if (pgqr_sample_running.queryDesc == queryDesc)
+		pgqr_sample_running.queryDesc = NULL;
+
+	if ((eflags & EXEC_FLAG_EXPLAIN_ONLY) != 0 || stmt->invalItems == NIL)
+		return;
+
+	foreach(lc, stmt->invalItems)
+	{
+		PlanInvalItem	*item = lfirst_node(PlanInvalItem, lc);
+
+		if (item->cacheId == PGQR_SAMPLE_MARK_SLOT)
+			slot = (int) item->hashValue;
+		else if (item->cacheId == PGQR_SAMPLE_MARK_CREATED)
+			created = item->hashValue;
+		else if (item->cacheId == PGQR_SAMPLE_MARK_VARIANT)
+			variant = (int) item->hashValue;
+	}
+	if (slot == PGQR_NO_RULE)
+		return;
+	pgqr_invalidate_marked(PGQR_MARK_SAMPLE, slot);
+
+	if (	pgqr_nesting_level > 0 ||
+		variant < 0 || variant >= PGQR_VARIANTS ||
+		pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) == 0)
+		return;
+
+	/* rule may have been removed since plan has been built */
+	pgqr_refresh_local_rules();
+	for (i = 0; i < pgqr_local.sample_rule_number; i++)
+		if (	pgqr_local.sample_rules[i]->slot == slot &&
+			(uint32) pgqr_local.sample_rules[i]->created == created)
+			break;
+	if (i == pgqr_local.sample_rule_number)
+		return;
+
+	pgqr_sample_running.slot = slot;
+	pgqr_sample_running.generation = pgqr_local.generation;
+	pgqr_sample_running.variant = variant;
+	pgqr_sample_running.queryDesc = queryDesc;
+	INSTR_TIME_SET_CURRENT(pgqr_sample_running.start);
+}
+
+/*
+ * count measured execution in latency histogram of its variant:
+ * rule slot still holds the same rule if rules have not changed.
+ */
+static void pgqr_sample_end(void)
+{
+	pgqrSharedItem	*item;
+	uint64		elapsed = pgqr_elapsed(pgqr_sample_running.start);
+	uint64		usecs = elapsed / 1000;
+	int		bucket = 0;
+
+	pgqr_sample_running.queryDesc = NULL;
+	if (	pgqr_area == NULL ||
+		pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]) != pgqr_sample_running.generation)
+		return;
+
+	while (usecs > 0 && bucket < PGQR_SAMPLE_BUCKETS - 1)
+	{
+		usecs >>= 1;
+		bucket++;
+	}
+
+	item = pgqr_rule(pgqr_sample_running.slot);
+	pg_atomic_fetch_add_u64(&item->sample_time[pgqr_sample_running.variant], elapsed);
+	pg_atomic_fetch_add_u64(&item->sample_histogram[pgqr_sample_running.variant][bucket], 1);
+}
+
+/*
+ * ExecutorEnd hook: forget result cache state of statement
+ * and count latency of measured statement
+ */
+static void pgqr_executor_end(QueryDesc *queryDesc)
+{
+	bool	sampled = (pgqr_sample_running.queryDesc == queryDesc);
+
+	if (pgqr_result != NULL && pgqr_result->queryDesc == queryDesc)
+		pgqr_result = NULL;
+
+	if (prev_executor_end_hook)
+		prev_executor_end_hook(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	if (sampled)
+		pgqr_sample_end();
+}
+
+/*
+ * pgqr_exec
+ *
+ */
+static void pgqr_exec(QueryDesc *queryDesc, int eflags)
+{
+	pgqrLocalRule	*settings;
+	int		nestlevel = 0;
+	int		result_slot;
+	uint32		result_created = 0;
+	int		stmt_loc;
+	int		stmt_len;
+	const char	*src;
+
+	if (statement_rewritten == true)
+	{
+
+		src = queryDesc->sourceText;
+		stmt_loc = queryDesc->plannedstmt->stmt_location;
+		stmt_len = queryDesc->plannedstmt->stmt_len;
+
+		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: src=%s", src);
+		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_loc=%d", stmt_loc);
+		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_len=%d", stmt_len);
+
+		/*
+	 	 * set stmt_location to -1 to avoid assertion failure in pgss_store:
+ 		 * Assert(query_len <= strlen(query)
+	 	 */
+		queryDesc->plannedstmt->stmt_location = -1;
+		stmt_loc = queryDesc->plannedstmt->stmt_location;
+		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_loc=%d", stmt_loc);
+	}
+
+	if ((eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0)
+	{
+		pgqr_result_plan_written(queryDesc->plannedstmt);
+		pgqr_summary_check(queryDesc->plannedstmt);
+	}
+	pgqr_sample_start(queryDesc, eflags);
+
+	result_slot = pgqr_result_slot(queryDesc, eflags, &result_created);
+
+	settings = pgqr_plan_settings(queryDesc->plannedstmt);
+	if (settings != NULL)
+		nestlevel = pgqr_apply_settings(settings);
+
+	if (prev_executor_start_hook)
+                (*prev_executor_start_hook)(queryDesc, eflags);
+	else	standard_ExecutorStart(queryDesc, eflags);
+
+	if (settings != NULL)
+		AtEOXact_GUC(true, nestlevel);
+
+	if (result_slot != PGQR_NO_RULE)
+		pgqr_result_start(queryDesc, result_slot, result_created);
+}
+
+/*
+ * ExecutorRun hook: statements analyzed while 
+ * running a statement are nested.
+ * First run of a statement with a result cache entry sends
+ * cached result without running plan; otherwise tuples sent by
+ * first run of a complete statement are copied to result cache.
+ */
+static void pgqr_executor_run(QueryDesc *queryDesc, ScanDirection direction,
+			      uint64 count, bool execute_once)
+{
+	pgqrResultState		*result = NULL;
+	pgqrResultReceiver	*receiver = NULL;
+	DestReceiver		*dest = queryDesc->dest;
+	pgqrLocalRule		*settings;
+	int			nestlevel = 0;
+
+	if (pgqr_result != NULL && pgqr_result->queryDesc == queryDesc && !pgqr_result->started)
+	{
+		result = pgqr_result;
+		result->started = true;
+		if (count != 0 || !ScanDirectionIsForward(direction))
+			result = NULL;
+		else if (result->hit)
+		{
+			pgqr_result_send(queryDesc, result);
+			return;
+		}
+		else
+			receiver = pgqr_result_receiver(queryDesc, result);
+	}
+
+	if (receiver != NULL)
+		queryDesc->dest = (DestReceiver *) receiver;
+
+	settings = pgqr_plan_settings(queryDesc->plannedstmt);
+	if (settings != NULL)
+		nestlevel = pgqr_apply_settings(settings);
+
+	pgqr_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_executor_run_hook)
+			prev_executor_run_hook(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+		pgqr_nesting_level--;
+		queryDesc->dest = dest;
+	}
+	PG_CATCH();
+	{
+		pgqr_nesting_level--;
+		queryDesc->dest = dest;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (settings != NULL)
+		AtEOXact_GUC(true, nestlevel);
+
+	if (receiver != NULL && receiver->complete)
+		pgqr_result_store(result, receiver);
+}
+
+/*
+ * ExecutorFinish hook: AFTER triggers statements are nested
+ * and run with parameters of settings rule of plan.
+ */
+static void pgqr_executor_finish(QueryDesc *queryDesc)
 {
+	pgqrLocalRule	*settings;
+	int		nestlevel = 0;
 
-	/* 
- 	 * >>> FROM parse_analyze in src/backend/parser/analyze.c <<< 
- 	 */
+	settings = pgqr_plan_settings(queryDesc->plannedstmt);
+	if (settings != NULL)
+		nestlevel = pgqr_apply_settings(settings);
 
-	ParseState 	*new_pstate = make_parsestate(NULL);
-	Query		*new_query = (Query *)NULL;
+	pgqr_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_executor_finish_hook)
+			prev_executor_finish_hook(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+		pgqr_nesting_level--;
+	}
+	PG_CATCH();
+	{
+		pgqr_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-#if PG_VERSION_NUM >= 100000
-	RawStmt		*new_parsetree;
+	if (settings != NULL)
+		AtEOXact_GUC(true, nestlevel);
+}
+
+/*
+ * ProcessUtility hook: statements run by CALL and DO are nested.
+ * Statements analyzed by other utility statements (PREPARE, EXPLAIN,
+ * CREATE TABLE AS ...) are top-level statements, except definitions
+ * stored by the utility statement which are not rewritten.
+ */
+#if PG_VERSION_NUM >= 140000
+static void pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				 bool readOnlyTree, ProcessUtilityContext context,
+				 ParamListInfo params, QueryEnvironment *queryEnv,
+				 DestReceiver *dest, QueryCompletion *qc)
+#elif PG_VERSION_NUM >= 130000
+static void pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				 ProcessUtilityContext context,
+				 ParamListInfo params, QueryEnvironment *queryEnv,
+				 DestReceiver *dest, QueryCompletion *qc)
 #else
-	Node      	*new_parsetree;
+static void pgqr_process_utility(PlannedStmt *pstmt, const char *queryString,
+				 ProcessUtilityContext context,
+				 ParamListInfo params, QueryEnvironment *queryEnv,
+				 DestReceiver *dest, char *completionTag)
 #endif
-	List		*raw_parsetree_list;
-	ListCell 	*lc1; 
-
-	elog(DEBUG1, "pg_query_rewrite: pgqr_reanalyze: entry");
-	new_pstate->p_sourcetext = new_query_string;
-
-	/* 
- 	 * missing data: 
-         * 1. numParams 
-         * 2. ParamTypes 
-         * 3. queryEnv
-         */
-	
-
-	new_parsetree =  NULL;
-	raw_parsetree_list = pg_parse_query(new_query_string);	
+{
+	Node	*parsetree = pstmt->utilityStmt;
+	bool	nested;
+	int	definition_level = pgqr_definition_level;
 
-	/*
- 	 * we assume only one SQL statement
- 	 */
+#if PG_VERSION_NUM >= 110000
+	nested = IsA(parsetree, CallStmt) || IsA(parsetree, DoStmt);
+#else
+	nested = IsA(parsetree, DoStmt);
+#endif
 
-	foreach(lc1, raw_parsetree_list)
+	if (nested)
+		pgqr_nesting_level++;
+	/* query of CREATE MATERIALIZED VIEW is analyzed with the utility statement */
+	if (IsA(parsetree, ViewStmt) || IsA(parsetree, RuleStmt) || IsA(parsetree, CreateFunctionStmt))
+		pgqr_definition_level = pgqr_nesting_level;
+	PG_TRY();
 	{
-#if PG_VERSION_NUM >= 100000
-		new_parsetree = lfirst_node(RawStmt, lc1);
+#if PG_VERSION_NUM >= 140000
+		if (prev_process_utility_hook)
+			prev_process_utility_hook(pstmt, queryString, readOnlyTree, context,
+						  params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, readOnlyTree, context,
+						params, queryEnv, dest, qc);
+#elif PG_VERSION_NUM >= 130000
+		if (prev_process_utility_hook)
+			prev_process_utility_hook(pstmt, queryString, context,
+						  params, queryEnv, dest, qc);
+		else
+			standard_ProcessUtility(pstmt, queryString, context,
+						params, queryEnv, dest, qc);
 #else
-		new_parsetree = (Node *) lfirst(lc1);
+		if (prev_process_utility_hook)
+			prev_process_utility_hook(pstmt, queryString, context,
+						  params, queryEnv, dest, completionTag);
+		else
+			standard_ProcessUtility(pstmt, queryString, context,
+						params, queryEnv, dest, completionTag);
 #endif
+		if (nested)
+			pgqr_nesting_level--;
+		pgqr_definition_level = definition_level;
 	}
+	PG_CATCH();
+	{
+		if (nested)
+			pgqr_nesting_level--;
+		pgqr_definition_level = definition_level;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-	new_query = transformTopLevelStmt(new_pstate, new_parsetree);	
+	pgqr_result_utility_written(parsetree);
 
-	new_static_pstate = new_pstate;
-	new_static_query = new_query;
+	/* rules reading refreshed materialized view apply again at commit */
+	if (IsA(parsetree, RefreshMatViewStmt) &&
+	    pg_atomic_read_u32(&pgqr->rule_count[pgqr_local_stripe()]) > 0)
+	{
+		Oid	relid = RangeVarGetRelid(((RefreshMatViewStmt *) parsetree)->relation,
+						 NoLock, true);
 
-	elog(DEBUG1, "pg_query_rewrite: pgqr_reanalyze: exit");
+		if (OidIsValid(relid))
+			pgqr_summary_refreshed(relid);
+	}
 }
 
 /*
- *
- * pqqr_analyze: main routine
- *
+ * rule option match as text
  */
-#if PG_VERSION_NUM < 140000
-static void pgqr_analyze(ParseState *pstate, Query *query)
-#else
-static void pgqr_analyze(ParseState *pstate, Query *query, JumbleState *js)
+static const char *pgqr_match_name(int match)
+{
+	switch (match)
+	{
+		case PGQR_MATCH_QUERYID:
+			return "queryid";
+		case PGQR_MATCH_NORMALIZED:
+			return "normalized";
+		case PGQR_MATCH_REGEX:
+			return "regex";
+		case PGQR_MATCH_LIKE:
+			return "like";
+		default:
+			return "text";
+	}
+}
+
+/*
+ * rule option rewrite as text
+ */
+static const char *pgqr_rewrite_name(int rewrite)
+{
+	switch (rewrite)
+	{
+		case PGQR_REWRITE_RELATION:
+			return "relation";
+		case PGQR_REWRITE_FUNCTION:
+			return "function";
+		case PGQR_REWRITE_LIMIT:
+			return "limit";
+		case PGQR_REWRITE_SETTINGS:
+			return "settings";
+		default:
+			return "statement";
+	}
+}
+
+/*
+ * rule option commands as text: "all" or list of commands
+ * in the format accepted by pgqr_set_option
+ */
+static char *pgqr_commands_name(uint32 commands)
+{
+	StringInfoData	buf;
+
+	if (commands == PGQR_ALL_COMMANDS)
+		return pstrdup("all");
+
+	initStringInfo(&buf);
+	if (commands & PGQR_COMMAND(CMD_SELECT))
+		appendStringInfoString(&buf, ",select");
+	if (commands & PGQR_COMMAND(CMD_INSERT))
+		appendStringInfoString(&buf, ",insert");
+	if (commands & PGQR_COMMAND(CMD_UPDATE))
+		appendStringInfoString(&buf, ",update");
+	if (commands & PGQR_COMMAND(CMD_DELETE))
+		appendStringInfoString(&buf, ",delete");
+#if PG_VERSION_NUM >= 150000
+	if (commands & PGQR_COMMAND(CMD_MERGE))
+		appendStringInfoString(&buf, ",merge");
 #endif
+	if (commands & PGQR_COMMAND(CMD_UTILITY))
+		appendStringInfoString(&buf, ",utility");
+
+	return buf.len > 0 ? buf.data + 1 : buf.data;
+}
+
+/*
+ * rows of rule in slot i displayed by a SQL-callable function: callback
+ * fills up to PGQR_VARIANTS rows of consecutive values and nulls and
+ * returns their number. Caller holds pgqr->lock and values are allocated
+ * in current memory context.
+ */
+typedef int (*pgqrRowsCallback) (int i, pgqrSharedItem *rule, Datum *values, bool *nulls);
+
+#define	PGQR_RULES_BATCH	256
+
+/*
+ * fill tuplestore with rows of used rule slots, by slot order.
+ * Rows are built for batches of PGQR_RULES_BATCH slots under shared
+ * lock, and each batch is written to the tuplestore (which spills to
+ * disk beyond work_mem) after lock release, so that rule changes never
+ * wait for temporary file I/O: rules changed during the scan may or may
+ * not be returned.
+ */
+static void pgqr_put_rules(Tuplestorestate *tupstore, TupleDesc tupdesc, pgqrRowsCallback rows)
 {
-	
-	int		rules_index;
+	int		ncols = tupdesc->natts;
+	MemoryContext	oldcontext;
+	MemoryContext	batchcontext;
+	Datum		*values;
+	bool		*nulls;
+	bool		more;
+	int		i;
+	int		j;
+	int		n;
+
+	/* row values are copied by tuplestore: memory is reused for each batch */
+	batchcontext = AllocSetContextCreate(CurrentMemoryContext,
+					     "pg_query_rewrite rules batch",
+					     ALLOCSET_DEFAULT_MINSIZE,
+					     ALLOCSET_DEFAULT_INITSIZE,
+					     ALLOCSET_DEFAULT_MAXSIZE);
+	values = (Datum *) palloc(PGQR_RULES_BATCH * PGQR_VARIANTS * ncols * sizeof(Datum));
+	nulls = (bool *) palloc(PGQR_RULES_BATCH * PGQR_VARIANTS * ncols * sizeof(bool));
+
+	pgqr_ensure_loaded();
+	i = 0;
+	do
+	{
+		int	nrules = 0;
 
-	elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: entry: %s",pstate->p_sourcetext);
+		n = 0;
+		oldcontext = MemoryContextSwitchTo(batchcontext);
+		LWLockAcquire(pgqr->lock, LW_SHARED);
+		pgqr_attach_area();
+		for (; i < pgqr->nslots && nrules < PGQR_RULES_BATCH; i++)
+		{
+			pgqrSharedItem	*rule = pgqr_rule(i);
 
-	statement_rewritten = false;
+			if (!PGQR_SLOT_USED(rule))
+				continue;
+			n += rows(i, rule, &values[n * ncols], &nulls[n * ncols]);
+			nrules++;
+		}
+		more = (i < pgqr->nslots);
+		LWLockRelease(pgqr->lock);
+		MemoryContextSwitchTo(oldcontext);
 
-	/*
- 	** not possible to access parameters using pstate->p_ref_hook_state
-	** because no easy way to check FixedParamState vs VarParamState
-	** (p_ref_hook_state is generic pointer in both cases
-	** and p_param_ref_hook refer to a static function in parse_params.c).
-	*/
+		for (j = 0; j < n; j++)
+			tuplestore_putvalues(tupstore, tupdesc, &values[j * ncols], &nulls[j * ncols]);
+		MemoryContextReset(batchcontext);
+		CHECK_FOR_INTERRUPTS();
+	} while (more);
 
-	/* pstate->p_sourcetext is the current query text */	
-	elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: %s",pstate->p_sourcetext);
+	MemoryContextDelete(batchcontext);
+	pfree(values);
+	pfree(nulls);
+}
 
-	if (pgqr_check_rewrite(pstate->p_sourcetext, &rules_index))
+/*
+ * pgqr_rules row of rule in slot i
+ */
+#define	PGQR_RULES_COLS		19
+
+static int pgqr_rule_values(int i, pgqrSharedItem *rule, Datum *values, bool *nulls)
+{
+	uint64		last_rewrite;
+	uint64		refreshed;
+
+	MemSet(nulls, 0, PGQR_RULES_COLS * sizeof(bool));
+	values[0] = Int32GetDatum(i);
+	values[1] = ObjectIdGetDatum(rule->dbid);
+	values[2] = PointerGetDatum(cstring_to_text_with_len(PGQR_STMT(rule->source_stmt),
+							     rule->source_len));
+	values[3] = PointerGetDatum(cstring_to_text_with_len(PGQR_STMT(rule->target_stmt),
+							     rule->target_len));
+	values[4] = CStringGetTextDatum(pgqr_match_name(rule->match));
+	values[5] = CStringGetTextDatum(pgqr_rewrite_name(rule->rewrite));
+	values[6] = BoolGetDatum(rule->nested);
+	values[7] = CStringGetTextDatum(pgqr_commands_name(rule->commands));
+	values[8] = Int64GetDatum((int64) pg_atomic_read_u64(&rule->rewrite_count));
+	values[9] = TimestampTzGetDatum(rule->created);
+	last_rewrite = pg_atomic_read_u64(&rule->last_rewrite);
+	if (last_rewrite != 0)
+		values[10] = TimestampTzGetDatum((TimestampTz) last_rewrite);
+	else
+		nulls[10] = true;
+	if (OidIsValid(rule->summary_oid))
+		values[11] = ObjectIdGetDatum(rule->summary_oid);
+	else
+		nulls[11] = true;
+	if (rule->max_age >= 0)
 	{
-		elog(DEBUG1,"pg_query_rewrite: pgqr_to_rewrite %s: rc=true", 
-                                    pstate->p_sourcetext);
-		/* 
- 		** analyze destination statement 
-		*/
-		pgqr_reanalyze(pgqr->rules[rules_index].target_stmt);
+		Interval	*age = (Interval *) palloc0(sizeof(Interval));
 
-		/* clone data */
-		pgqr_clone_ParseState(new_static_pstate, pstate);
-		elog(DEBUG1,"pg_query_rewrite: pgqr_analyze: rewrite=true pstate->p_source_text %s",
-                                   pstate->p_sourcetext);
-		pgqr_clone_Query(new_static_query, query);
-		statement_rewritten = true;
-		
-		pgqr_incr_rewrite_count(rules_index);
+		age->time = rule->max_age;
+		values[12] = IntervalPGetDatum(age);
+	}
+	else
+		nulls[12] = true;
+	refreshed = pg_atomic_read_u64(&rule->refreshed);
+	if (refreshed != 0)
+		values[13] = TimestampTzGetDatum((TimestampTz) refreshed);
+	else
+		nulls[13] = true;
+	values[14] = BoolGetDatum(rule->result_cache);
+	if (OidIsValid(rule->role_oid))
+		values[15] = ObjectIdGetDatum(rule->role_oid);
+	else
+		nulls[15] = true;
+	if (rule->application_name[0] != '\0')
+		values[16] = CStringGetTextDatum(rule->application_name);
+	else
+		nulls[16] = true;
+	if (OidIsValid(rule->schema_oid))
+		values[17] = ObjectIdGetDatum(rule->schema_oid);
+	else
+		nulls[17] = true;
+	if (rule->sample >= 0)
+		values[18] = Float8GetDatum(rule->sample);
+	else
+		nulls[18] = true;
+
+	return 1;
+}
 
-		free_parsestate(new_static_pstate); 
-	} else
-		elog(DEBUG1,"pg_query_rewrite: pgqr_to_rewrite %s: rc=false", 
-                             pstate->p_sourcetext);
+/*
+ * 
+ *  pgqr_rules: SQL-callable function to display shared rules 
+ *  
+ *  Only used slots are returned, by slot order (see pgqr_put_rules).
+ *  Database names are resolved by view pgqr_rules.
+ */
+Datum pgqr_rules(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate	*tupstore;
+	MemoryContext	oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+	    (rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+
+	/* The tupdesc and tuplestore must be created in ecxt_per_query_memory */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+					 false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	pgqr_put_rules(tupstore, tupdesc, pgqr_rule_values);
+
+	return (Datum) 0;
+}
 
-	/* no "standard_analyze" to call 
-  	 * according to parse_analyze in analyze.c 
-  	 */
-	if (prev_post_parse_analyze_hook)
+/*
+ * count a rewrite by rule in slot
+ */
+static void pgqr_count_rewrite(int slot)
+{
+	pgqrSharedItem	*item = pgqr_rule(slot);
+
+	pg_atomic_fetch_add_u64(&item->rewrite_count, 1);
+	pg_atomic_write_u64(&item->last_rewrite, (uint64) GetCurrentStatementStartTimestamp());
+}
+
+/*
+ * increment rule rewrite counter: no lock is needed
+ * as long as rule slot has not changed since local copy
+ * of rules has been built, which is the common case.
+ * Returns rule slot or PGQR_NO_RULE if rule has been removed.
+ */
+static int pgqr_incr_rewrite_count(pgqrLocalRule *rule)
+{
+	int	index;
+
+	if (pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]) == pgqr_local.generation)
 	{
-#if PG_VERSION_NUM < 140000
-		prev_post_parse_analyze_hook(pstate, query);
-#else
-		prev_post_parse_analyze_hook(pstate, query, js);
-#endif
-	 }
+		pgqr_count_rewrite(rule->slot);
+		return rule->slot;
+	}
+	
+	/*
+	 * rule may have been removed and its slot reused since
+	 * local copy has been built
+	 */
+        LWLockAcquire(pgqr->lock, LW_SHARED);
+	index = pgqr_find_rule(MyDatabaseId, rule->source_stmt, rule->source_hash, &rule->scope);
+	if (index != PGQR_NO_RULE)
+		pgqr_count_rewrite(index);
+        LWLockRelease(pgqr->lock);
 
-	elog(DEBUG1, "pg_query_rewrite: pgqr_analyze: exit");
+	return index;
 }
 
+/*
+ * count target analysis of rule in slot: slot still holds 
+ * the same rule if generation of current database stripe 
+ * has not changed since slot has been looked up.
+ */
+static void pgqr_count_analysis(int slot, uint32 generation, bool cache_hit, uint64 analyze_time)
+{
+	pgqrSharedItem	*item;
+
+	pgqr_pending_stats.rewrites++;
+	if (cache_hit)
+		pgqr_pending_stats.cache_hits++;
+	pgqr_pending_stats.analyze_time += analyze_time;
+
+	if (	slot == PGQR_NO_RULE ||
+		pg_atomic_read_u32(&pgqr->generation[pgqr_local_stripe()]) != generation)
+		return;
+
+	item = pgqr_rule(slot);
+	if (cache_hit)
+		pg_atomic_fetch_add_u64(&item->cache_hits, 1);
+	if (analyze_time > 0)
+		pg_atomic_fetch_add_u64(&item->analyze_time, analyze_time);
+}
 
 /*
- * pgqr_exec
+ *  pgqr_stats
+ *
+ *  SQL-callable function to display global statistics
  *
  */
-static void pgqr_exec(QueryDesc *queryDesc, int eflags)
+Datum pgqr_stats(PG_FUNCTION_ARGS)
 {
-#if PG_VERSION_NUM > 100000 
+	TupleDesc	tupdesc;
+	Datum		values[8];
+	bool		nulls[8];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	/* statistics of current backend are up to date */
+	pgqr_flush_stats();
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) pg_atomic_read_u64(&pgqr->stat_lookups));
+	values[1] = Int64GetDatum((int64) pg_atomic_read_u64(&pgqr->stat_rewrites));
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&pgqr->stat_cache_hits));
+	values[3] = Float8GetDatum(pg_atomic_read_u64(&pgqr->stat_lookup_time) / 1000000.0);
+	values[4] = Float8GetDatum(pg_atomic_read_u64(&pgqr->stat_analyze_time) / 1000000.0);
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+	values[5] = TimestampTzGetDatum(pgqr->stats_reset);
+	LWLockRelease(pgqr->lock);
+	values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&pgqr->stat_result_hits));
+	values[7] = Int64GetDatum((int64) pg_atomic_read_u64(&pgqr->stat_result_stores));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
 
-	int stmt_loc;
-	int stmt_len;
-	const char *src;
+/*
+ * pgqr_rule_stats row of rule in slot i
+ */
+static int pgqr_rule_stats_values(int i, pgqrSharedItem *rule, Datum *values, bool *nulls)
+{
+	MemSet(nulls, 0, 6 * sizeof(bool));
+	values[0] = ObjectIdGetDatum(rule->dbid);
+	values[1] = CStringGetTextDatum(PGQR_STMT(rule->source_stmt));
+	values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&rule->rewrite_count));
+	values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&rule->cache_hits));
+	values[4] = Float8GetDatum(pg_atomic_read_u64(&rule->analyze_time) / 1000000.0);
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&rule->result_hits));
+
+	return 1;
+}
 
-	if (statement_rewritten == true)
-	{
+/*
+ *  pgqr_rule_stats
+ *
+ *  SQL-callable function to display statistics of each rule
+ *
+ */
+Datum pgqr_rule_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate	*tupstore;
+	MemoryContext	oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+	    (rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+
+	/* The tupdesc and tuplestore must be created in ecxt_per_query_memory */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+					 false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	pgqr_put_rules(tupstore, tupdesc, pgqr_rule_stats_values);
+
+	return (Datum) 0;
+}
 
-		src = queryDesc->sourceText;
-		stmt_loc = queryDesc->plannedstmt->stmt_location;
-		stmt_len = queryDesc->plannedstmt->stmt_len;
+/*
+ * latency quantile in milliseconds estimated from histogram by
+ * linear interpolation inside the bucket holding the quantile
+ */
+static double pgqr_sample_quantile(const uint64 *histogram, uint64 calls, double q)
+{
+	double	rank = q * calls;
+	uint64	seen = 0;
+	int	b;
 
-		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: src=%s", src);
-		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_loc=%d", stmt_loc);
-		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_len=%d", stmt_len);
+	for (b = 0; b < PGQR_SAMPLE_BUCKETS; b++)
+	{
+		double	low = (b == 0 ? 0 : (double) ((uint64) 1 << (b - 1)));
+		double	high = (double) ((uint64) 1 << b);
 
-		/*
-	 	 * set stmt_location to -1 to avoid assertion failure in pgss_store:
- 		 * Assert(query_len <= strlen(query)
-	 	 */
-		queryDesc->plannedstmt->stmt_location = -1;
-		stmt_loc = queryDesc->plannedstmt->stmt_location;
-		elog(DEBUG1, "pg_query_rewrite: pgqr_exec: stmt_loc=%d", stmt_loc);
+		if (histogram[b] > 0 && seen + histogram[b] >= rank)
+			return (low + (high - low) * (rank - seen) / histogram[b]) / 1000.0;
+		seen += histogram[b];
 	}
-#endif
-	/*
- 	 * must always execute here whatever PG_VERSION_NUM
- 	 */
 
-	if (prev_executor_start_hook)
-                (*prev_executor_start_hook)(queryDesc, eflags);
-	else	standard_ExecutorStart(queryDesc, eflags);
+	return 0;
 }
 
 /*
- * 
- *  pgqr_rules: SQL-callable function to display shared rules 
- *  
+ * pgqr_sample_stats rows of rule in slot i: one row by variant
+ * of sampled rules, none for other rules
  */
+static int pgqr_sample_stats_values(int i, pgqrSharedItem *rule, Datum *values, bool *nulls)
+{
+	int	v;
 
+	if (rule->sample < 0)
+		return 0;
 
-static Datum pgqr_rules_internal(FunctionCallInfo fcinfo)
-{
-        ReturnSetInfo   *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-        bool            randomAccess;
-        TupleDesc       tupdesc;
-        Tuplestorestate *tupstore;
-        AttInMetadata    *attinmeta;
-        MemoryContext   oldcontext;
-        int             i;
+	for (v = 0; v < PGQR_VARIANTS; v++)
+	{
+		uint64		histogram[PGQR_SAMPLE_BUCKETS];
+		uint64		calls = 0;
+		double		total_time;
+		int		b;
 
-        /* The tupdesc and tuplestore must be created in ecxt_per_query_memory */
-        oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
-#if PG_VERSION_NUM <= 120000
-        tupdesc = CreateTemplateTupleDesc(4, false);
-#else
-        tupdesc = CreateTemplateTupleDesc(4);
-#endif
-        TupleDescInitEntry(tupdesc, (AttrNumber) 1, "datname", TEXTOID, -1, 0);
-        TupleDescInitEntry(tupdesc, (AttrNumber) 2, "source", TEXTOID, -1, 0);
-        TupleDescInitEntry(tupdesc, (AttrNumber) 3, "target", TEXTOID, -1, 0);
-        TupleDescInitEntry(tupdesc, (AttrNumber) 4, "rewrite_count", TEXTOID, -1, 0);
-
-        randomAccess = (rsinfo->allowedModes & SFRM_Materialize_Random) != 0;
-        tupstore = tuplestore_begin_heap(randomAccess, false, work_mem);
-        rsinfo->returnMode = SFRM_Materialize;
-        rsinfo->setResult = tupstore;
-        rsinfo->setDesc = tupdesc;
-
-        MemoryContextSwitchTo(oldcontext);
-
-        attinmeta = TupleDescGetAttInMetadata(tupdesc);
-
-        for (i=0; i < pgqrMaxRules; i++)
-        {
-                char            *values[4];
-                HeapTuple       tuple;
-                char            buf_v1[NAMEDATALEN];
-                char            buf_v2[PGQR_MAX_STMT_BUF_LENGTH];
-                char            buf_v3[PGQR_MAX_STMT_BUF_LENGTH];
-                char            buf_v4[50];
-		char		*source;
-	        char   		*target;
-		char		*p_source;
-		char		*p_target;
-        	char    	*null_string = "NULL";
-
-		source = pgqr->rules[i].source_stmt;
-                target = pgqr->rules[i].target_stmt;
-
-		if (strlen(source) == 0)
-                        p_source = null_string;
-                else    p_source = source;
-                if (strlen(target) == 0)
-                        p_target = null_string;
-                else    p_target = target;
-               
-		if (pgqr->rules[i].dbid != 0) 
-			snprintf(buf_v1, sizeof(buf_v1), "datname=%s", get_database_name(pgqr->rules[i].dbid));
+		for (b = 0; b < PGQR_SAMPLE_BUCKETS; b++)
+		{
+			histogram[b] = pg_atomic_read_u64(&rule->sample_histogram[v][b]);
+			calls += histogram[b];
+		}
+		total_time = pg_atomic_read_u64(&rule->sample_time[v]) / 1000000.0;
+
+		MemSet(nulls, 0, 9 * sizeof(bool));
+		values[0] = ObjectIdGetDatum(rule->dbid);
+		values[1] = CStringGetTextDatum(PGQR_STMT(rule->source_stmt));
+		values[2] = Float8GetDatum(rule->sample);
+		values[3] = CStringGetTextDatum(v == PGQR_VARIANT_ORIGINAL ? "original" : "rewritten");
+		values[4] = Int64GetDatum((int64) calls);
+		values[5] = Float8GetDatum(total_time);
+		if (calls > 0)
+		{
+			values[6] = Float8GetDatum(total_time / calls);
+			values[7] = Float8GetDatum(pgqr_sample_quantile(histogram, calls, 0.5));
+			values[8] = Float8GetDatum(pgqr_sample_quantile(histogram, calls, 0.99));
+		}
 		else
-			snprintf(buf_v1, sizeof(buf_v1), "datname=%s", null_string);
-			
-                values[0] = buf_v1;
+			nulls[6] = nulls[7] = nulls[8] = true;
+		values += 9;
+		nulls += 9;
+	}
 
-		snprintf(buf_v2, sizeof(buf_v2), "source=%s", p_source);
-                values[1] = buf_v2;
+	return PGQR_VARIANTS;
+}
+
+/*
+ *  pgqr_sample_stats
+ *
+ *  SQL-callable function to display latency of original and
+ *  rewritten variants of statements of rules with sample option:
+ *  one row by rule and variant, times are in milliseconds.
+ *
+ */
+Datum pgqr_sample_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate	*tupstore;
+	MemoryContext	oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+	    (rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("set-valued function called in context that cannot accept a set")));
+
+	/* The tupdesc and tuplestore must be created in ecxt_per_query_memory */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap((rsinfo->allowedModes & SFRM_Materialize_Random) != 0,
+					 false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	pgqr_put_rules(tupstore, tupdesc, pgqr_sample_stats_values);
+
+	return (Datum) 0;
+}
 
-                snprintf(buf_v3, sizeof(buf_v3), "target=%s", p_target);
-                values[2] = buf_v3;
+/*
+ *  pgqr_stats_reset
+ *
+ *  SQL-callable function to reset global and rule statistics
+ *
+ */
+Datum pgqr_stats_reset(PG_FUNCTION_ARGS)
+{
+	int	i;
 
-                snprintf(buf_v4, sizeof(buf_v4), "rewrite_count=%d", pgqr->rules[i].rewrite_count);
-                values[3] = buf_v4;
+	LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
+	pgqr_attach_area();
+
+	pg_atomic_write_u64(&pgqr->stat_lookups, 0);
+	pg_atomic_write_u64(&pgqr->stat_rewrites, 0);
+	pg_atomic_write_u64(&pgqr->stat_cache_hits, 0);
+	pg_atomic_write_u64(&pgqr->stat_lookup_time, 0);
+	pg_atomic_write_u64(&pgqr->stat_analyze_time, 0);
+	pg_atomic_write_u64(&pgqr->stat_result_hits, 0);
+	pg_atomic_write_u64(&pgqr->stat_result_stores, 0);
+	for (i = 0; i < pgqr->nslots; i++)
+	{
+		pgqrSharedItem	*rule = pgqr_rule(i);
 
-        	tuple = BuildTupleFromCStrings(attinmeta, values);
-	        tuplestore_puttuple(tupstore, tuple);
+		pg_atomic_write_u64(&rule->rewrite_count, 0);
+		pg_atomic_write_u64(&rule->cache_hits, 0);
+		pg_atomic_write_u64(&rule->analyze_time, 0);
+		pg_atomic_write_u64(&rule->result_hits, 0);
+		pgqr_reset_samples(rule, false);
+	}
+	pgqr->stats_reset = GetCurrentTimestamp();
 
-        }
+	LWLockRelease(pgqr->lock);
 
-        return (Datum)0;
+	MemSet(&pgqr_pending_stats, 0, sizeof(pgqrStats));
 
+	PG_RETURN_VOID();
 }
 
-Datum pgqr_rules(PG_FUNCTION_ARGS)
+/*
+ *  pgqr_refreshed
+ *
+ *  SQL-callable function to mark a summary relation as refreshed
+ *  by current transaction: returns true if relation is the summary
+ *  of a rule of current database.
+ *
+ */
+Datum pgqr_refreshed(PG_FUNCTION_ARGS)
 {
+	Oid	relid = PG_GETARG_OID(0);
+	bool	found = false;
+	int	i;
 
-        return (pgqr_rules_internal(fcinfo));
+	/* only the owner of the summary can declare it fresh */
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, relid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(relid, GetUserId()))
+#endif
+#if PG_VERSION_NUM >= 110000
+		aclcheck_error(ACLCHECK_NOT_OWNER, get_relkind_objtype(get_rel_relkind(relid)),
+			       get_rel_name(relid));
+#else
+		aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS, get_rel_name(relid));
+#endif
+
+	pgqr_ensure_loaded();
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+	pgqr_attach_area();
+	for (i = 0; i < pgqr->nslots && !found; i++)
+		found = (pgqr_rule(i)->dbid == MyDatabaseId && pgqr_rule(i)->summary_oid == relid);
+	LWLockRelease(pgqr->lock);
+
+	pgqr_summary_refreshed(relid);
+
+	PG_RETURN_BOOL(found);
 }
 
-static void pgqr_incr_rewrite_count(int index)
+/*
+ *  pgqr_result_cache_reset
+ *
+ *  SQL-callable function to remove all cached results
+ *
+ */
+Datum pgqr_result_cache_reset(PG_FUNCTION_ARGS)
 {
-	
-        LWLockAcquire(pgqr->lock, LW_EXCLUSIVE);
-        pgqr->rules[index].rewrite_count++ ;
-        LWLockRelease(pgqr->lock);
+	LWLockAcquire(pgqr->lock, LW_SHARED);
+	pgqr_attach_area();
+	LWLockRelease(pgqr->lock);
+
+	if (pgqr_area != NULL)
+	{
+		LWLockAcquire(pgqr->result_lock, LW_EXCLUSIVE);
+		pgqr_result_purge(InvalidOid, NULL, 0);
+		LWLockRelease(pgqr->result_lock);
+	}
 
+	PG_RETURN_VOID();
 }
 
 Datum pgqr_test(PG_FUNCTION_ARGS)
@@ -0,0 +1,28 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t10;
+create table t10(x int, y int);
+insert into t10 values(1, 2);
+insert into t10 values(2, 3);
+--
+select pgqr_add_rule('select x from t10 where x = $1;','select x, y from t10 where x = $1;','match=queryid');
+--
+prepare p(int) as select x from t10 where x = $1;
+execute p(1);
+execute p(2);
+deallocate p;
+--
+prepare q as select x from t10 where x = $1;
+execute q(2);
+deallocate q;
+--
+prepare r(int, int) as select x from t10 where x = $2;
+execute r(0, 1);
+deallocate r;
+--
+select pgqr_truncate();
+drop table t10;
+drop extension pg_query_rewrite;
@@ -0,0 +1,26 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t11;
+create table t11(id int, v text);
+insert into t11 values(1, 'one');
+insert into t11 values(2, 'two');
+insert into t11 values(3, 'three');
+--
+select pgqr_add_rule('select v from t11 where id = 1;','select id, v from t11 where id = $1;','match=normalized');
+select pgqr_add_rule('select v from t11 where id = 1 and v = ''x'';','select v, id from t11 where v = $2 and id = $1;','match=normalized');
+--
+select v from t11 where id = 2;
+SELECT v FROM t11 WHERE id = 3;
+select v from t11 where id = -1;
+select v from t11 where id = 2 and v = 'two';
+select v from t11 where id = 2 and v = '$1';
+select v from t11 where id > 2;
+--
+select pgqr_add_rule('select id from t11 where id = 1;','select $2;','match=normalized');
+--
+select pgqr_truncate();
+drop table t11;
+drop extension pg_query_rewrite;
@@ -0,0 +1,40 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+select pgqr_add_rules(array[['select 10;','select 11;'],['select 20;','select 21;']]);
+select 10;
+select 20;
+--
+-- rules from a table
+--
+create table r12(source text, target text, options text);
+insert into r12 values('select 30;','select 31;',null);
+insert into r12 values('select 40;','select 41;','match=text');
+select pgqr_add_rules(array_agg(array[source, target, options])) from r12;
+select 30;
+select 40;
+--
+-- all or nothing
+--
+select pgqr_add_rules(array[['select 50;','select 51;'],['select 10;','select 12;']]);
+select pgqr_add_rules(array[['select 50;','select 51;'],['select 50;','select 52;']]);
+select pgqr_add_rules(array[['select 50;','select 51;',''],['select 60;','select 61;','match=unknown']]);
+select pgqr_add_rules(array['select 50;','select 51;']);
+select pgqr_add_rules(array[['select 50;',null]]);
+select 50;
+select 10;
+--
+-- replace rule set of current database
+--
+select pgqr_add_rules(array[['select 10;','select 12;'],['select 50;','select 51;']], true);
+select 10;
+select 20;
+select 50;
+select pgqr_add_rules('{}', true);
+select 10;
+--
+drop table r12;
+select pgqr_truncate();
+drop extension pg_query_rewrite;
@@ -0,0 +1,43 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t13;
+create table t13(i int);
+insert into t13 values(1);
+insert into t13 values(2);
+insert into t13 values(3);
+--
+create function f13(q text) returns bigint as $$
+declare
+    n bigint;
+begin
+    execute q into n;
+    return n;
+end$$
+language plpgsql;
+--
+select pgqr_add_rule('select count(*) from t13;','select count(*) + 100 from t13;','nested=off');
+select pgqr_add_rule('select max(i) from t13;','select max(i) * 10 from t13;');
+select pgqr_add_rule('select min(i) from t13;','select min(i) - 10 from t13;','commands=''select,insert'' nested=on');
+--
+select count(*) from t13;
+select f13('select count(*) from t13;');
+select max(i) from t13;
+select f13('select max(i) from t13;');
+select min(i) from t13;
+select f13('select min(i) from t13;');
+--
+select pgqr_add_rule('delete from t13 where i = 1;','delete from t13 where i = 0;','commands=select');
+delete from t13 where i = 1;
+select * from t13 order by i;
+--
+select pgqr_add_rule('select 1;','select 2;','nested=maybe');
+select pgqr_add_rule('select 1;','select 2;','commands=drop');
+select pgqr_add_rule('select 1;','select 2;','commands=''''');
+--
+select pgqr_truncate();
+drop function f13(text);
+drop table t13;
+drop extension pg_query_rewrite;
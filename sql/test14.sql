@@ -0,0 +1,27 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+select pgqr_stats_reset();
+set pg_query_rewrite.track_timing = on;
+--
+select pgqr_add_rule('select 10;','select 11;');
+select 10;
+select 10;
+select 20;
+--
+select source, rewrites, cache_hits, analyze_time > 0 as analyze_time
+from pgqr_rule_stats
+where dbid = (select oid from pg_database where datname = current_database());
+select lookups >= 4 as lookups, rewrites >= 2 as rewrites, cache_hits >= 1 as cache_hits,
+       lookup_time > 0 as lookup_time, analyze_time > 0 as analyze_time
+from pgqr_stats;
+--
+select pgqr_stats_reset();
+select source, rewrites, cache_hits, analyze_time
+from pgqr_rule_stats
+where dbid = (select oid from pg_database where datname = current_database());
+select stats_reset > now() - interval '1 hour' as stats_reset from pgqr_stats;
+--
+select pgqr_truncate();
+drop extension pg_query_rewrite;
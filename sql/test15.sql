@@ -0,0 +1,32 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t15;
+create table t15(id int, v text);
+insert into t15 values(1, 'one');
+insert into t15 values(2, 'two');
+insert into t15 values(3, 'three');
+--
+select pgqr_add_rule('select v from t15 where id = ([0-9]+);','select id, v from t15 where id = \1;','match=regex');
+select pgqr_add_rule('select % from t15 order by id;','select \1 from t15 order by id desc;','match=like');
+select pgqr_add_rule('select count\(\*\) from t15.*','select 0;','match=regex');
+--
+select v from t15 where id = 2;
+select v from t15 where id = 3;
+select id from t15 order by id;
+select v from t15 order by id;
+select count(*) from t15;
+select count(*) from t15 where id > 1;
+select v from t15 where id=2;
+--
+select match, count(*), sum(rewrite_count) from pgqr_rules group by match order by match;
+--
+select pgqr_add_rule('select (a)\1;','select 1;','match=regex');
+select pgqr_add_rule('select (a);','select \2;','match=regex');
+select pgqr_add_rule('select (;','select 1;','match=regex');
+--
+select pgqr_truncate();
+drop table t15;
+drop extension pg_query_rewrite;
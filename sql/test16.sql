@@ -0,0 +1,58 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t16;
+drop table if exists t16s;
+drop table if exists t16l;
+create table t16(id int, v text);
+insert into t16 select i, 'v' || i from generate_series(1, 5) i;
+create table t16s(id int, v text);
+insert into t16s values(0, 'summary');
+create table t16l(id int);
+insert into t16l select generate_series(1, 10);
+create function f16(i int) returns int as 'select $1 + 1' language sql;
+create function g16(i int) returns int as 'select $1 * 100' language sql;
+--
+select pgqr_add_rule('t16','t16s','rewrite=relation');
+select pgqr_add_rule('f16(int)','g16(int)','rewrite=function');
+select pgqr_add_rule('t16l','3','rewrite=limit');
+--
+select v from t16;
+SELECT V
+  FROM T16 ;
+select count(*) from (select * from t16 where id > 0) s;
+select f16(id) from t16l where id < 3 order by id;
+select id from t16l order by id;
+select id from t16l order by id limit 5;
+select count(*) from t16l;
+insert into t16 values(6, 'v6');
+select id from t16 where id = 6 for update;
+--
+-- view definitions keep source relation
+create view v16 as select id, v from t16;
+select v from v16 where id = 1;
+drop view v16;
+--
+alter table t16s drop column v;
+select v from t16 where id = 1;
+--
+select source, target, rewrite, rewrite_count from pgqr_rules order by rewrite;
+--
+create table t16b(id bigint);
+select pgqr_add_rule('t16x','t16s','rewrite=relation');
+select pgqr_add_rule('t16l','t16b','rewrite=relation');
+select pgqr_add_rule('f16(int)','length(text)','rewrite=function');
+select pgqr_add_rule('t16l','0','rewrite=limit');
+select pgqr_add_rule('t16l','5','rewrite=limit match=like');
+select pgqr_add_rule('t16','t16s','rewrite=view');
+--
+select pgqr_truncate();
+drop function f16(int);
+drop function g16(int);
+drop table t16b;
+drop table t16l;
+drop table t16s;
+drop table t16;
+drop extension pg_query_rewrite;
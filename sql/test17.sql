@@ -0,0 +1,78 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop materialized view if exists t17m;
+drop table if exists t17;
+drop table if exists t17s;
+drop table if exists t17c;
+create table t17(k int, v int);
+insert into t17 select i % 3, i from generate_series(1, 9) i;
+create materialized view t17m as select k, sum(v) as total from t17 group by k;
+create table t17s(k int, total bigint);
+create table t17c(k int, v int);
+insert into t17c values(0, 1);
+--
+select pgqr_add_rule('select k, sum(v) from t17 group by k order by k;','select k, total from t17m order by k;','summary=t17m max_age=''1 hour''');
+select pgqr_add_rule('select sum(v) from t17;','select sum(total) from t17s;','summary=t17s max_age=''1 hour''');
+select pgqr_add_rule('select count(*) from t17;','select count(*) * 0 from t17m;','summary=t17m max_age=0');
+--
+insert into t17 values(0, 100);
+select k, sum(v) from t17 group by k order by k;
+refresh materialized view t17m;
+insert into t17 values(1, 100);
+select k, sum(v) from t17 group by k order by k;
+--
+select sum(v) from t17;
+begin;
+insert into t17s select k, sum(v) from t17 group by k;
+select pgqr_refreshed('t17s');
+rollback;
+select sum(v) from t17;
+insert into t17s select k, sum(v) from t17 group by k;
+select pgqr_refreshed('t17s');
+insert into t17 values(2, 1000);
+select sum(v) from t17;
+--
+select count(*) from t17;
+--
+select pgqr_add_rule('t17','t17c','rewrite=relation max_age=''1 hour''');
+select max(v) from t17;
+select pgqr_refreshed('t17c');
+select max(v) from t17;
+--
+select summary, max_age, refreshed is not null as refreshed, rewrite_count from pgqr_rules order by summary::text, max_age;
+--
+-- execution of a cached plan finding the freshness bound
+-- passed invalidates it: next execution reads source relation
+create table t17d(k int, v int);
+insert into t17d values(0, 2);
+select pgqr_add_rule('t17c','t17d','rewrite=relation max_age=''1 second''');
+select pgqr_refreshed('t17d');
+prepare p17 as select max(v) from t17c;
+execute p17;
+select pg_sleep(1.5);
+execute p17;
+execute p17;
+deallocate p17;
+--
+select pgqr_add_rule('select 1;','select 2;','max_age=''1 hour''');
+select pgqr_add_rule('select 1;','select 2;','summary=t17x');
+select pgqr_add_rule('select 1;','select 2;','summary=t17m max_age=''-1 hour''');
+select pgqr_add_rule('t17','5','rewrite=limit summary=t17m');
+select pgqr_refreshed('t17');
+--
+create role pgqr_role17;
+set role pgqr_role17;
+select pgqr_refreshed('t17s');
+reset role;
+drop role pgqr_role17;
+--
+select pgqr_truncate();
+drop materialized view t17m;
+drop table t17d;
+drop table t17c;
+drop table t17s;
+drop table t17;
+drop extension pg_query_rewrite;
@@ -0,0 +1,45 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+select pgqr_stats_reset();
+select pgqr_result_cache_reset();
+--
+drop table if exists t18;
+create table t18(id int, v text);
+insert into t18 values(1, 'a'), (2, 'b'), (3, 'c');
+--
+select pgqr_add_rule('select id, v from t18 order by id;','select id, upper(v) as v from t18 order by id;','result_cache=on');
+select id, v from t18 order by id;
+select id, v from t18 order by id;
+select id, v from t18 order by id;
+select source, rewrites, result_hits
+from pgqr_rule_stats
+where dbid = (select oid from pg_database where datname = current_database());
+--
+insert into t18 values(4, 'd');
+select id, v from t18 order by id;
+select id, v from t18 order by id;
+--
+begin;
+insert into t18 values(5, 'e');
+select id, v from t18 order by id;
+rollback;
+select id, v from t18 order by id;
+select result_hits, result_stores from pgqr_stats;
+--
+select pgqr_result_cache_reset();
+select id, v from t18 order by id;
+select result_hits, result_stores from pgqr_stats;
+--
+select id, upper(v) as v from t18 order by id;
+select id, upper(v) as v from t18 order by id;
+select result_hits, result_stores from pgqr_stats;
+--
+select source, result_cache from pgqr_rules order by id;
+select pgqr_add_rule('select 1;','select 2;','result_cache=maybe');
+select pgqr_add_rule('select %;','select 2;','match=like result_cache=on');
+--
+select pgqr_truncate();
+drop table t18;
+drop extension pg_query_rewrite;
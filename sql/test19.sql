@@ -0,0 +1,29 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t19;
+create table t19(i int);
+--
+select pgqr_add_rule('insert into t19 values (1);','insert into t19 values (10);');
+select pgqr_add_rule('insert into t19 values (2);','insert into t19 values (20);');
+select pgqr_add_rule('insert into t19 values \(([0-9]+)\);','insert into t19 values (\1 * 100);','match=regex');
+--
+insert into t19 values (1)\; insert into t19 values (2)\;   insert into t19 values (3);
+insert into t19 values (2)\; insert into t19 values (5) ;
+--
+select pgqr_add_rule('insert into t19 values (6) ;','insert into t19 values (60);');
+select pgqr_add_rule('  insert into t19 values (8);','insert into t19 values (80);');
+insert into t19 values (6) \; insert into t19 values (7);
+select '  insert into t19 values (8);' \gexec
+select 'insert into t19 values (8);' \gexec
+select i from t19 order by i;
+select source, rewrite_count from pgqr_rules order by id;
+--
+select pgqr_add_rule('select 1;','select 2; select 3;');
+select pgqr_add_rule('select 1;',';');
+--
+select pgqr_truncate();
+drop table t19;
+drop extension pg_query_rewrite;
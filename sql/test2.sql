@@ -17,15 +17,15 @@ select 1+1;
 select x from t;
 --
 select pgqr_remove_rule('select 1+1;');
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 select 1+1;
 --
 select pgqr_remove_rule('select 10;');
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 select 10;
 --
 select pgqr_remove_rule('select x from t;');
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 select x from t;
 --
 select x from t;
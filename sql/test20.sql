@@ -0,0 +1,62 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop schema if exists s20;
+drop role if exists pgqr_role20;
+create schema s20;
+create role pgqr_role20;
+--
+select pgqr_add_rule('select 10;','select 11;','role=pgqr_role20');
+select pgqr_add_rule('select 20;','select 21;','application_name=report');
+select pgqr_add_rule('select 30;','select 31;','schema=s20');
+--
+select 10;
+select 20;
+select 30;
+--
+set role pgqr_role20;
+select 10;
+reset role;
+select 10;
+--
+set application_name = 'report';
+select 20;
+reset application_name;
+select 20;
+--
+set search_path = s20, public;
+select 30;
+reset search_path;
+select 30;
+--
+select source, role, application_name, schema, rewrite_count from pgqr_rules order by id;
+--
+select pgqr_add_rule('select 1;','select 2;','role=pgqr_role20x');
+select pgqr_add_rule('select 1;','select 2;','schema=s20x');
+--
+select pgqr_add_rule('select 40;','select 41;');
+select pgqr_add_rule('select 40;','select 42;','application_name=report');
+select pgqr_add_rule('select 40;','select 43;','role=pgqr_role20 application_name=report');
+select pgqr_add_rule('select 40;','select 44;','application_name=report');
+select 40;
+set application_name = 'report';
+select 40;
+set role pgqr_role20;
+select 40;
+reset role;
+reset application_name;
+select pgqr_remove_rule('select 40;');
+select count(*) from pgqr_rules where source = 'select 40;';
+--
+set role pgqr_role20;
+select pgqr_add_rule('select 50;','select 51;');
+select pgqr_remove_rule('select 10;');
+select pgqr_result_cache_reset();
+reset role;
+--
+select pgqr_truncate();
+drop schema s20;
+drop role pgqr_role20;
+drop extension pg_query_rewrite;
@@ -0,0 +1,44 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+drop table if exists t21;
+create table t21(id int);
+--
+select pgqr_add_rule('select 10;','select 11;','sample=0');
+select pgqr_add_rule('select 20;','select 21;','sample=1');
+select pgqr_add_rule('select 30;','select 31;');
+--
+select 10;
+select 10;
+select 10;
+select 20;
+select 20;
+select 20;
+select 30;
+--
+select source, sample, rewrite_count from pgqr_rules order by id;
+select source, sample, variant, calls, p50_time is not null as measured,
+       p50_time <= p99_time as ordered
+  from pgqr_sample_stats order by source, variant;
+--
+select pgqr_stats_reset();
+select source, variant, calls from pgqr_sample_stats order by source, variant;
+--
+-- executions of cached plans draw their variant
+select pgqr_add_rule('select 40','select 41','sample=1');
+create function f21() returns setof int as $$ begin return query select 40; end $$ language plpgsql;
+select f21();
+select f21();
+select f21();
+select rewrite_count from pgqr_rules where source = 'select 40';
+drop function f21();
+--
+select pgqr_add_rule('select 1;','select 2;','sample=2');
+select pgqr_add_rule('select 1;','select 2;','sample=half');
+select pgqr_add_rule('t21','10','rewrite=limit sample=0.5');
+--
+select pgqr_truncate();
+drop table t21;
+drop extension pg_query_rewrite;
@@ -0,0 +1,41 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+select pgqr_add_rule('select current_setting(''work_mem'') as work_mem, current_setting(''enable_nestloop'') as enable_nestloop;','work_mem=64MB, enable_nestloop=off','rewrite=settings');
+select pgqr_add_rule('select current_setting(''work_mem'') as w%;','work_mem=''128MB''','rewrite=settings match=like');
+--
+select current_setting('work_mem') as work_mem, current_setting('enable_nestloop') as enable_nestloop;
+show work_mem;
+show enable_nestloop;
+select current_setting('work_mem') as wm;
+show work_mem;
+--
+set work_mem = '8MB';
+select current_setting('work_mem') as wm;
+show work_mem;
+reset work_mem;
+--
+select source, target, match, rewrite, rewrite_count from pgqr_rules order by id;
+--
+create table t22(i int);
+create table t22_log(id serial, matched bool);
+create function t22_log() returns trigger language plpgsql as $$ begin insert into t22_log(matched) values (current_setting('work_mem') = '32MB'); return null; end $$;
+create trigger t22_after after insert on t22 for each statement execute procedure t22_log();
+select pgqr_add_rule('insert into t22 values (1);','work_mem=32MB','rewrite=settings');
+insert into t22 values (1);
+insert into t22 values (2);
+select matched from t22_log order by id;
+drop table t22;
+drop table t22_log;
+drop function t22_log();
+--
+select pgqr_add_rule('select 1;','no_such_parameter=1','rewrite=settings');
+select pgqr_add_rule('select 1;','enable_nestloop=maybe','rewrite=settings');
+select pgqr_add_rule('select 1;','work_mem','rewrite=settings');
+select pgqr_add_rule('select 1;','','rewrite=settings');
+select pgqr_add_rule('select 1;','work_mem=64MB','rewrite=settings sample=0.5');
+--
+select pgqr_truncate();
+drop extension pg_query_rewrite;
@@ -0,0 +1,18 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite version '0.0.5';
+select pgqr_truncate();
+--
+alter extension pg_query_rewrite update;
+select extversion from pg_extension where extname = 'pg_query_rewrite';
+select has_function_privilege('public', 'pgqr_add_rule(cstring, cstring, cstring)', 'execute') as add_rule,
+       has_function_privilege('public', 'pgqr_truncate()', 'execute') as truncate,
+       has_function_privilege('public', 'pgqr_refreshed(regclass)', 'execute') as refreshed;
+--
+select pgqr_add_rule('select 10;','select 11;','match=text');
+select 10;
+select source, target, match, rewrite_count from pgqr_rules order by id;
+select pgqr_remove_rule('select 10;');
+--
+select pgqr_truncate();
+drop extension pg_query_rewrite;
@@ -3465,7 +3465,7 @@ c is null or c=0;
 ' ,
 'select $KO$;');
 --
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 select 
 c as cabcdefgh1,
@@ -5194,6 +5194,6 @@ c = 57 or
 c = 58 or
 c is null or c=0;
 --
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 
@@ -11,18 +11,18 @@ create database db2;
 create extension pg_query_rewrite;
 select pgqr_add_rule('select 1;','select 11;');
 select 1;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 \c db2
 create extension pg_query_rewrite;
 select pgqr_add_rule('select 2;','select 22;');
 select 2;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 \c db1
 select 1;
 select 2;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 \c db2
 select 1;
@@ -31,7 +31,7 @@ select 2;
 select pgqr_remove_rule('select 2;');
 select 1;
 select 2;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 --
 \c db1
@@ -40,5 +40,5 @@ select 2;
 select pgqr_remove_rule('select 1;');
 select 1;
 select 2;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 
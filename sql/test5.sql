@@ -16,4 +16,4 @@ delete from t;
 --
 select * from t;
 --
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
@@ -16,7 +16,7 @@ language plpgsql;
 --
 select fs(1);
 select * from t;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 select pgqr_add_rule('insert into t(i) values (fs.p) returning t.i', 'insert into t(i) values(2) returning t.i');
 --
@@ -29,7 +29,7 @@ language plpgsql;
 --
 select fs(1);
 select * from t;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 --
 --
@@ -46,10 +46,10 @@ language plpgsql;
 --
 select fd(2);
 select * from t;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 select pgqr_add_rule('select count(*) from t where i = 2', 'select count(*) from t where i = 3');
 --
 select fd(2);
 select * from t;
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
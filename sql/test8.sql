@@ -25,6 +25,6 @@ select 'Hello';
 select pgqr_remove_rule('select ''Hello'';');
 select 'Hello';
 --
-select pgqr_rules();
+select datname, source, target, rewrite_count from pgqr_rules order by id;
 --
 drop extension pg_query_rewrite;
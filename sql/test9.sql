@@ -0,0 +1,19 @@
+drop extension if exists pg_query_rewrite;
+--
+create extension pg_query_rewrite;
+select pgqr_truncate();
+--
+select pgqr_add_rule('select 10;','select 11;','match=queryid');
+--
+select 10;
+SELECT   10 ;
+/* comment */ select 10;
+select 20;
+select 'Hello';
+--
+select pgqr_add_rule('select 10;','select 12;','match=queryid');
+select pgqr_add_rule('select 1;','select 2;','match=unknown');
+select pgqr_add_rule('select 1;','select 2;','foo=bar');
+--
+select pgqr_truncate();
+drop extension pg_query_rewrite;
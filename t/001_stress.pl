@@ -0,0 +1,104 @@
+#
+# 001_stress.pl
+#
+# Stress test of rule changes under load: pgbench clients run statements
+# matching rules which are concurrently added, replaced and removed, and
+# check that each statement returns either its own result or the result
+# of its rule target. A torn read of a rule by a backend would return
+# another value, raise an error or crash the server.
+#
+# Requires PostgreSQL 15 or later built with TAP tests: run with "make stress".
+# Environment: STRESS_DURATION in seconds (default 10), STRESS_CLIENTS (default 8).
+#
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use IPC::Run;
+use Test::More;
+
+my $duration = $ENV{STRESS_DURATION} || 10;
+my $clients = $ENV{STRESS_CLIENTS} || 8;
+
+my $node = PostgreSQL::Test::Cluster->new('stress');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'pg_query_rewrite'
+pg_query_rewrite.max_rules = 1000
+pg_query_rewrite.save = off
+});
+$node->start;
+$node->safe_psql('postgres', 'create extension pg_query_rewrite;');
+
+# filler rules make hash buckets and rule chunks shared with tested rules
+my $fillers = q{
+select pgqr_add_rules(array_agg(array['select ' || (100000 + i) || ';', 'select ' || -i || ';']), true)
+from generate_series(1, 500) i;
+};
+$node->safe_psql('postgres', $fillers);
+
+# readers fail with a division by zero if a statement returns an unexpected value
+my $reader = $node->basedir . '/reader.sql';
+append_to_file($reader, q{
+select 10 as a \gset
+\if :a != 10 and :a != 11
+\set torn 1 / 0
+\endif
+select 20 as b, 0 as z \gset
+\if :b != 20 and :b != 21
+\set torn 1 / 0
+\endif
+select 30 as c where true \gset
+\if :c != 30 and :c != 31
+\set torn 1 / 0
+\endif
+select 100001;
+});
+
+my %readers;
+foreach my $mode ('simple', 'extended', 'prepared')
+{
+	my $reader_err = '';
+
+	$readers{$mode} = [ IPC::Run::start(
+		[ 'pgbench', '-n', '-M', $mode, '-c', $clients, '-j', $clients,
+		  '-T', $duration, '-f', $reader, '-h', $node->host, '-p', $node->port,
+		  'postgres' ],
+		'>', '/dev/null', '2>', \$reader_err), \$reader_err ];
+}
+
+# rules are changed one at a time, by set and all at once while readers run
+my $changes = 0;
+my $end = time() + $duration;
+while (time() < $end)
+{
+	$node->safe_psql('postgres', q{
+select pgqr_add_rule('select 10 as a;', 'select 11 as a;', 'match=queryid');
+select pgqr_add_rules(array[['select 20 as b, 0 as z;', 'select 21 as b, 0 as z;', 'match=queryid'],
+                            ['select 30 as c where true;', 'select 31 as c where true;', 'match=queryid']]);
+select pgqr_remove_rule('select 10 as a;');
+select pgqr_add_rule('select 10 as a;', 'select 11 as a;', 'match=queryid');
+select pgqr_remove_rule('select 30 as c where true;');
+});
+	$node->safe_psql('postgres', $fillers);
+	$node->safe_psql('postgres', 'select pgqr_truncate();');
+	$changes++;
+}
+
+foreach my $mode (sort keys %readers)
+{
+	my ($h, $reader_err) = @{ $readers{$mode} };
+
+	$h->finish;
+	is($h->result, 0, "pgbench $mode readers did not fail");
+	unlike($$reader_err, qr/aborted|division by zero|ERROR/, "no $mode reader error");
+}
+ok($changes > 0, "$changes rule change rounds");
+
+# shared rules are still consistent
+$node->safe_psql('postgres', $fillers);
+is($node->safe_psql('postgres', 'select count(*) from pgqr_rules;'), '500', 'rule count');
+is($node->safe_psql('postgres', 'select 100001;'), '-1', 'rule still applies');
+
+$node->stop;
+done_testing();
@@ -0,0 +1,70 @@
+#
+# 002_persistence.pl
+#
+# Rules are saved to the dump file by transactions changing them and
+# reloaded after a clean restart and after a crash (immediate stop),
+# including rules changed by an aborted transaction (saved when its
+# backend exits) and by a transaction changing several rules.
+#
+# Requires PostgreSQL 15 or later built with TAP tests: run with "make persistence".
+#
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('persistence');
+$node->init;
+$node->append_conf('postgresql.conf', q{
+shared_preload_libraries = 'pg_query_rewrite'
+pg_query_rewrite.max_rules = 1000
+});
+$node->start;
+$node->safe_psql('postgres', 'create extension pg_query_rewrite;');
+
+my $rules = q{
+select source, target, match, rewrite, nested, commands, created
+from pgqr_rules order by source;
+};
+
+$node->safe_psql('postgres', q{
+select pgqr_add_rules(array_agg(array['select ' || (100000 + i) || ';', 'select ' || -i || ';']))
+from generate_series(1, 100) i;
+select pgqr_add_rule('select 10 as a;', 'select 11 as a;', 'match=queryid commands=select');
+select pgqr_remove_rule('select 100050;');
+begin;
+select pgqr_add_rule('select 20;', 'select 21;');
+select pgqr_add_rule('select 30;', 'select 31;', 'nested=off');
+commit;
+begin;
+select pgqr_add_rule('select 40;', 'select 41;');
+rollback;
+});
+my $before = $node->safe_psql('postgres', $rules);
+is($node->safe_psql('postgres', 'select count(*) from pgqr_rules;'), '103', 'rule count before restart');
+
+$node->restart;
+is($node->safe_psql('postgres', $rules), $before, 'rules survive clean restart');
+is($node->safe_psql('postgres', 'select 10 as a;'), '11', 'queryid rule applies after clean restart');
+is($node->safe_psql('postgres', 'select 100001;'), '-1', 'rule applies after clean restart');
+
+$node->safe_psql('postgres', q{
+select pgqr_add_rule('select 50;', 'select 51;');
+select pgqr_remove_rule('select 20;');
+});
+$before = $node->safe_psql('postgres', $rules);
+
+$node->stop('immediate');
+$node->start;
+is($node->safe_psql('postgres', $rules), $before, 'rules survive crash');
+is($node->safe_psql('postgres', 'select 50;'), '51', 'rule applies after crash');
+is($node->safe_psql('postgres', 'select 20;'), '20', 'removed rule does not apply after crash');
+
+$node->safe_psql('postgres', 'select pgqr_truncate();');
+$node->stop('immediate');
+$node->start;
+is($node->safe_psql('postgres', 'select count(*) from pgqr_rules;'), '0', 'truncate survives crash');
+
+$node->stop;
+done_testing();